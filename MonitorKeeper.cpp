@@ -13,7 +13,8 @@
 // Limitations:
 //		- Windows are only repositions when the number of monitors INCREASES. There is no way to specify a layout
 //			to use on a single monitor, for example (although this would not be a difficult change)
-//		- Support is limited to 5 monitors. This is arbitrary and done simply to limit the storage for each application.
+//		- Support is limited to 64 monitors, and each window remembers its placement for the MAX_LAYOUTS monitor
+//			configurations it was most recently seen in. This is arbitrary and done simply to limit the storage for each application.
 //		- If application is run as a standard user, it cannot move any applications that are running as a privileged user.
 //			If you run into this, you can run this program as administrator, perhaps using Task Scheduler to launch it at login.
 //		- Window position is only saved while application is running. There is no persistent storage of position (say, between reboots)
@@ -26,242 +27,73 @@
 // Keeper and when not.
 
 
-#include "MonitorKeeper.h"
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperHook.h"
 
+#pragma comment(lib, "wtsapi32.lib")
 
-#define MAX_MONITORS 5
-#define MIN_MONITORTORESTORE 2
-
-#define LOGBUFFERSIZE  (32*1024)
 #define MAX_LOADSTRING 100
 // Global Variables:
 HINSTANCE hInst;                                // current instance
 WCHAR szTitle[MAX_LOADSTRING];                  // The title bar text
 WCHAR szWindowClass[MAX_LOADSTRING];            // the main window class name
+HPOWERNOTIFY hDisplayState;                     // display power notifications, see WM_POWERBROADCAST
+HPOWERNOTIFY hMonitorPower;
+UINT uTaskbarCreated;                           // sent when the shell starts again
 
 
-//
-// class representing the data we save for each top level window.
-//
-class SavedWindowData {
-public:
-    SavedWindowData() {
-        m_wndClass[0] = '\0';
-        m_hwnd = NULL;
-        m_nUnusedCount = 1;
-    }
+// Forward declarations of functions included in this code module:
+ATOM                MyRegisterClass(HINSTANCE hInstance);
+BOOL                InitInstance(HINSTANCE, int);
+LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
+INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
 
-    int					m_nUnusedCount;
-    WINDOWPLACEMENT		m_windowPlacement[MAX_MONITORS - MIN_MONITORTORESTORE + 1];
-    HWND				m_hwnd;
-    TCHAR				m_wndClass[40];  // window class, for verification.
+int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
+    _In_opt_ HINSTANCE hPrevInstance,
+    _In_ LPWSTR    lpCmdLine,
+    _In_ int       nCmdShow)
+{
+    UNREFERENCED_PARAMETER(hPrevInstance);
 
-    BOOL SetData(HWND hwnd, int NumMonitors)
+    if (lstrcmpi(lpCmdLine, _T("/benchmark")) == 0)
     {
-        m_hwnd = hwnd;
-        m_nUnusedCount = 0;
-        RealGetWindowClass(hwnd, m_wndClass, sizeof(m_wndClass) / sizeof(TCHAR));
-
-        if (NumMonitors < MIN_MONITORTORESTORE || NumMonitors > MAX_MONITORS) return false;  // too many monitors or not enought
-        m_windowPlacement[NumMonitors - MIN_MONITORTORESTORE].length = sizeof(WINDOWPLACEMENT);
-        GetWindowPlacement(hwnd, &(m_windowPlacement[NumMonitors - MIN_MONITORTORESTORE]));
-        return true;
+        // time the engine and exit, see MonitorKeeperBench.cpp
+        LoadSettings();
+        return RunBenchmark();
     }
-
-    void RestoreWindow(int NumMonitors)
+    if (CompareString(LOCALE_INVARIANT, NORM_IGNORECASE, lpCmdLine, min(lstrlen(lpCmdLine), 5), _T("/fuzz"), 5) == CSTR_EQUAL &&
+        (lpCmdLine[5] == '\0' || lpCmdLine[5] == ' '))
     {
-        TCHAR szTempClass[40];
-        if (NumMonitors >= MIN_MONITORTORESTORE && NumMonitors <= MAX_MONITORS) {
-            if (IsWindow(m_hwnd) &&
-                m_windowPlacement[NumMonitors - MIN_MONITORTORESTORE].length == sizeof(WINDOWPLACEMENT)) {
-                // verify window class
-                RealGetWindowClass(m_hwnd, szTempClass, sizeof(szTempClass) / sizeof(TCHAR));
-                if (lstrcmp(szTempClass, m_wndClass) == 0) {
-                    WINDOWPLACEMENT * place = &(m_windowPlacement[NumMonitors - MIN_MONITORTORESTORE]);
-                    // don't worry about "minimized position", it is a concept from Windows 3.0.
-                    place->flags = WPF_ASYNCWINDOWPLACEMENT;
-
-                    if (place->showCmd == SW_MAXIMIZE) {
-                        // we need to treat this special, first restore it to the correct position,
-                        // then maximize. Otherwise, it will just maximize it on the current screen
-                        // and ingore the coordinates.
-                        place->showCmd = SW_SHOWNOACTIVATE;
-                        SetWindowPlacement(m_hwnd, &(m_windowPlacement[NumMonitors - MIN_MONITORTORESTORE]));
-                        place->showCmd = SW_MAXIMIZE;
-                    }
-                    else if (place->showCmd == SW_MINIMIZE || place->showCmd == SW_SHOWMINIMIZED) {
-                        place->showCmd = SW_SHOWMINNOACTIVE;
-                    }
-                    else if (place->showCmd == SW_NORMAL) {
-                        place->showCmd = SW_SHOWNOACTIVATE;
-                    }
-                    SetWindowPlacement(m_hwnd, &(m_windowPlacement[NumMonitors - MIN_MONITORTORESTORE]));
-                }
-            }
-        }
+        // random histories against the window table, see MonitorKeeperFuzz.cpp
+        LoadSettings();
+        return RunFuzz(lpCmdLine + 5);
     }
-};
-
-
-//
-// Other global information we need for our application in this class, as
-// well as methods that operate on the saved data.
-//
-class InstanceData {
-public:
-    InstanceData() {
-        _Hook = NULL;
-#ifdef _DEBUG
-        _LogInfo[0] = '\0';
-#endif
-        _WindowDataLength = 32;
-        _NumMonitors = 1;
-        _WindowData = new SavedWindowData[_WindowDataLength];
-        _MainWnd = NULL;
-        InChangingState = false;
-    }
-
-    ~InstanceData()
+    if (CompareString(LOCALE_INVARIANT, NORM_IGNORECASE, lpCmdLine, min(lstrlen(lpCmdLine), 7), _T("/stress"), 7) == CSTR_EQUAL &&
+        (lpCmdLine[7] == '\0' || lpCmdLine[7] == ' '))
     {
-        Shutdown();
-    }
-
-    void Shutdown() {
-        if (_Hook != NULL) UnhookWinEvent(_Hook);
-        _Hook = NULL;
-
-        if (_WindowData != NULL) {
-            delete[] _WindowData;
-        }
+        // the engine's callers all at once, see MonitorKeeperStress.cpp
+        LoadSettings();
+        return RunStress(lpCmdLine + 7);
     }
-
-    static InstanceData  g_Instance;
-
-    //
-    // there is a primiative log window in debug mode.
-    //
-    void LogMessage(LPCTSTR str)
+    if (lstrcmpi(lpCmdLine, _T("/hook")) == 0)
     {
-#ifdef _DEBUG
-        int len = lstrlen(_LogInfo);
-        int newlen = lstrlen(str);
-        if (len + newlen >= LOGBUFFERSIZE)
-        {
-            len = 0;
-        }
-        lstrcpy(_LogInfo + len, str);
-        if (_MainWnd != NULL) {
-            SetScrollPos(_MainWnd, SB_VERT, 10000, true);
-            InvalidateRect(_MainWnd, NULL, TRUE);
-        }
-#endif
+        // the 32 bit creation hook for a 64 bit MonitorKeeper, see MonitorKeeperPlacements.cpp
+        return RunCreationHookHelper();
     }
-
-    //
-    // we are not notified on a window destroy, so we marked windows
-    // if we haven't seen them. If we don't see it 3 times in a row,
-    // we will reuse it's position in the array.
-    //
-    void TagWindowsUnused()
+    if (lstrcmpi(lpCmdLine, _T("/report")) == 0)
     {
-        int i;
-        for (i = 0; i < _WindowDataLength; i++)
-        {
-            // don't count to the point we rollover
-            if (_WindowData[i].m_hwnd != NULL && _WindowData[i].m_nUnusedCount < 100)
-            {
-                _WindowData[i].m_nUnusedCount++;
-            }
-        }
+        // MonitorKeeper.metrics to MonitorKeeper.report.csv, see MonitorKeeperMetrics.cpp
+        LoadSettings();
+        return RunMetricsReport();
     }
-
-    //
-    // restore all the top level windows
-    //
-    void RestoreWindowPositions(int monitors)
-    {
-        int i;
-        for (i = 0; i < _WindowDataLength; i++)
-        {
-            // don't count to the point we rollover
-            if (_WindowData[i].m_hwnd != NULL && _WindowData[i].m_nUnusedCount <= 2)
-            {
-                _WindowData[i].RestoreWindow(monitors);
-            }
-        }
-
-    }
-
-    //
-    // find slow for the window we found.
-    SavedWindowData * FindWindowSlot(HWND hwnd)
+    if (CompareString(LOCALE_INVARIANT, NORM_IGNORECASE, lpCmdLine, min(lstrlen(lpCmdLine), 4), _T("/log"), 4) == CSTR_EQUAL &&
+        (lpCmdLine[4] == '\0' || lpCmdLine[4] == ' '))
     {
-        //
-        // find existing HWND in array
-        int i;
-        for (i = 0; i < _WindowDataLength; i++)
-        {
-            if (_WindowData[i].m_hwnd == hwnd) {
-                return &(_WindowData[i]);
-            }
-        }
-
-        //
-        // find an unused slot.
-        for (i = 0; i < _WindowDataLength; i++)
-        {
-            if (_WindowData[i].m_hwnd == NULL ||
-                _WindowData[i].m_nUnusedCount > 2) {
-                return &(_WindowData[i]);
-            }
-        }
-
-        //
-        // hmmm, all used, need to reallocate.
-        i = _WindowDataLength;
-        int newlength = _WindowDataLength + 32;
-        SavedWindowData * newdata = new SavedWindowData[newlength];
-        for (i = 0; i < _WindowDataLength; i++) {
-            newdata[i] = _WindowData[i];
-        }
-        delete[] _WindowData;
-        _WindowData = newdata;
-        _WindowDataLength = newlength;
-
-        // i === old _WindowDataLength
-        return &(_WindowData[i]);
+        // search MonitorKeeper.diag into MonitorKeeper.log.csv, see MonitorKeeperDiagnostics.cpp
+        LoadSettings();
+        return RunDiagnosticsQuery(lpCmdLine + 4);
     }
 
-    HWINEVENTHOOK		_Hook;
-    SavedWindowData * _WindowData;
-    int					_WindowDataLength;
-    int					_NumMonitors;
-    HWND				_MainWnd;
-    BOOL				InChangingState;
-#ifdef _DEBUG
-    TCHAR				_LogInfo[LOGBUFFERSIZE];
-#endif
-};
-
-
-/*static*/ InstanceData  InstanceData::g_Instance;
-
-// Forward declarations of functions included in this code module:
-ATOM                MyRegisterClass(HINSTANCE hInstance);
-BOOL                InitInstance(HINSTANCE, int);
-LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
-INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
-
-int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
-    _In_opt_ HINSTANCE hPrevInstance,
-    _In_ LPWSTR    lpCmdLine,
-    _In_ int       nCmdShow)
-{
-    UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
-
-    // TODO: Place code here.
-
     // Initialize global strings
     LoadStringW(hInstance, IDS_APP_TITLE, szTitle, MAX_LOADSTRING);
     LoadStringW(hInstance, IDC_MONITORKEEPER, szWindowClass, MAX_LOADSTRING);
@@ -280,7 +112,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     // Main message loop:
     while (GetMessage(&msg, nullptr, 0, 0))
     {
-        if (!TranslateAccelerator(msg.hwnd, hAccelTable, &msg))
+        if (!IsInspectorMessage(&msg) && !TranslateAccelerator(msg.hwnd, hAccelTable, &msg))
         {
             TranslateMessage(&msg);
             DispatchMessage(&msg);
@@ -319,133 +151,134 @@ ATOM MyRegisterClass(HINSTANCE hInstance)
 }
 
 
-LPCTSTR TranslateShowCommand(int nShowCmd)
-{
-    switch (nShowCmd)
-    {
-    case SW_RESTORE:
-    case SW_SHOWNORMAL:
-        return _T("SW_SHOWNORMAL");
-    case SW_MAXIMIZE:
-        return _T("SW_MAXIMIZE");
-    case SW_MINIMIZE:
-    case SW_SHOWMINIMIZED:
-        return _T("SW_MINIMIZE");
-    case SW_SHOWNOACTIVATE:
-        return _T("SW_SHOWNOACTIVATE");
-    case SW_SHOWMINNOACTIVE:
-        return _T("SW_SHOWMINNOACTIVE");
-    default:
-        return _T("Unknown");
-    }
-}
-
-//
-// Called by EnumDesktopWindows whenever a window changes state.
-// This will capture a lot of events.
 //
-BOOL CALLBACK SaveWindowsCallback(
-    _In_ HWND   hwnd,
-    _In_ LPARAM lParam
+// save windows positions after a slight delay
+VOID CALLBACK SaveTimerCallback(
+    _In_ HWND     hwnd,
+    _In_ UINT     uMsg,
+    _In_ UINT_PTR idEvent,
+    _In_ DWORD    dwTime
 )
 {
-    int monitors = (int)lParam;
-
-    //
-    // only track windows that are visible, don't have a parent, 
-    // have at least one style that is in the OVERLAPPEDWINDOW style and
-    // do not have the WS_EX_NOACTIVE style.
-    //
-    // we include WS_EX_TOOLBAR because they sometimes are useful and get
-    // moved as well.
-    //
-    if (IsWindowVisible(hwnd) &&
-        GetParent(hwnd) == NULL) {
-        DWORD dwStyle = (DWORD)GetWindowLong(hwnd, GWL_STYLE);
-        DWORD dwExStyle = (DWORD)GetWindowLong(hwnd, GWL_EXSTYLE);
-        if (((dwStyle & (WS_OVERLAPPEDWINDOW)) != 0 ||
-            (dwExStyle & WS_EX_APPWINDOW) != 0)
-            &&
-            (dwExStyle & (WS_EX_NOACTIVATE)) == 0)
-        {
-            SavedWindowData * pData = InstanceData::g_Instance.FindWindowSlot(hwnd);
-            if (pData->SetData(hwnd, monitors))
-            {
-                TCHAR sz[128];
-                wsprintf(sz, _T("Save Position for %s, monitors %d, x=%d, y=%d, show=%s\n"),
-                    pData->m_wndClass, monitors, pData->m_windowPlacement[monitors - MIN_MONITORTORESTORE].rcNormalPosition.left,
-                    pData->m_windowPlacement[monitors - MIN_MONITORTORESTORE].rcNormalPosition.top,
-                    TranslateShowCommand(pData->m_windowPlacement[monitors - MIN_MONITORTORESTORE].showCmd));
-                InstanceData::g_Instance.LogMessage(sz);
-            }
-        }
-    }
-    return true;
+    ProcessDesktopWindows();
+    KillTimer(hwnd, idEvent);
 }
 
+
+
 //
-// Process when the number of monitors changes. If we have changed monitor count
-// we attempt to restore /
-//
-void ProcessMonitors()
+// write out each minute's metrics, even if nothing happens to trigger it
+VOID CALLBACK MetricsTimerCallback(
+    _In_ HWND     hwnd,
+    _In_ UINT     uMsg,
+    _In_ UINT_PTR idEvent,
+    _In_ DWORD    dwTime
+)
 {
-    int monitors = GetSystemMetrics(SM_CMONITORS);
-    if (monitors > 1 && InstanceData::g_Instance._NumMonitors != monitors)
-    {
-        // restore windows.
-        InstanceData::g_Instance.RestoreWindowPositions(monitors);
-    }
-    InstanceData::g_Instance._NumMonitors = monitors;
-    InstanceData::g_Instance.InChangingState = false;
+    FlushMetrics();
+    FlushTrace();
 }
 
 
 //
-// called by hook for window changes
-//
-void ProcessDesktopWindows()
+// put locked windows back once they've stopped moving
+VOID CALLBACK EnforceTimerCallback(
+    _In_ HWND     hwnd,
+    _In_ UINT     uMsg,
+    _In_ UINT_PTR idEvent,
+    _In_ DWORD    dwTime
+)
 {
-    TCHAR sz[128];
-    int monitors = GetSystemMetrics(SM_CMONITORS);
-    if (monitors != InstanceData::g_Instance._NumMonitors)
-    {
-        // we haven't completed our switch to change of monitors yet.
-        // so don't save positions until we've repositioned things.
-        return;
-    }
-    wsprintf(sz, _T("Monitors: %d\n"), monitors);
-    InstanceData::g_Instance.TagWindowsUnused();
-    InstanceData::g_Instance.LogMessage(sz);
-    EnumDesktopWindows(NULL, SaveWindowsCallback, monitors);
+    KillTimer(hwnd, idEvent);
+    EnforceLayout();
 }
 
 
 //
-// save windows positions after a slight delay
-VOID CALLBACK SaveTimerCallback(
+// an application was still writing a forwarded move, see TakeForwardedMoves
+VOID CALLBACK HookStallTimerCallback(
     _In_ HWND     hwnd,
     _In_ UINT     uMsg,
     _In_ UINT_PTR idEvent,
     _In_ DWORD    dwTime
 )
 {
-    ProcessDesktopWindows();
     KillTimer(hwnd, idEvent);
+    PostMessage(hwnd, WM_HOOKEVENTS, 0, 0);
 }
 
 
-
 //
-// Our window hook, grabbing the event when the active window changes.
-VOID CALLBACK WinEventProcCallback(HWINEVENTHOOK hWinEventHook, DWORD dwEvent, HWND hwnd, LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime)
+// a window moved, from our window hook or forwarded by the event filter.
+static void WindowMoved(DWORD dwEvent, HWND hwnd, LONG idObject, LONG idChild)
 {
+    // the event feed wants every move, including the ones we make.
+    if (hwnd != NULL && idObject == OBJID_WINDOW && idChild == CHILDID_SELF) {
+        PublishWindowMoved(hwnd);
+        TraceWindowMoved(hwnd);
+    }
     if (InstanceData::g_Instance.InChangingState) return;
-    if (hwnd != NULL &&
-        (dwEvent == EVENT_SYSTEM_MOVESIZEEND ||
-            dwEvent == EVENT_OBJECT_LOCATIONCHANGE))
+    //
+    // carets, scroll bars and child windows move all the time; only moves of
+    // windows we track count towards a storm or put off the save. This is the
+    // filter MonitorKeeperHook.dll applies to the moves it forwards.
+    if (hwnd == NULL || idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !IsTrackedWindow(hwnd)) return;
+    if (dwEvent == EVENT_SYSTEM_MOVESIZEEND ||
+        dwEvent == EVENT_OBJECT_LOCATIONCHANGE)
     {
+        if (CheckWindowDrift(hwnd)) {
+            SetTimer(InstanceData::g_Instance._MainWnd, 4,
+                InstanceData::g_Instance.CurrentSettings()->m_nEnforceDelay, EnforceTimerCallback);
+        }
         // use our HWND so that this timer get replaced each time we call SetTimer.
-        SetTimer(InstanceData::g_Instance._MainWnd, 2, 200, SaveTimerCallback);
+        SetTimer(InstanceData::g_Instance._MainWnd, 2, WindowMovedSaveDelay(), SaveTimerCallback);
+    }
+}
+
+//
+// Our window hook, grabbing the event when the active window changes.
+VOID CALLBACK WinEventProcCallback(HWINEVENTHOOK hWinEventHook, DWORD dwEvent, HWND hwnd, LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime)
+{
+    InterlockedIncrement(&InstanceData::g_Instance._EventsDelivered);
+    WindowMoved(dwEvent, hwnd, idObject, idChild);
+}
+
+//
+// moves forwarded by applications with [Hook] Events=1, see StartEventFilter.
+static void TakeForwardedMoves()
+{
+    HWND moved[64];
+    int count;
+    BOOL stalled;
+    do {
+        BOOL lost;
+        count = TakeHookEvents(moved, 64, lost, stalled);
+        InterlockedExchangeAdd(&InstanceData::g_Instance._EventsDelivered, count);
+        int i;
+        for (i = 0; i < count; i++) WindowMoved(EVENT_OBJECT_LOCATIONCHANGE, moved[i], OBJID_WINDOW, CHILDID_SELF);
+        if (lost && !InstanceData::g_Instance.InChangingState) {
+            // the save pass looks at every window anyway.
+            SetTimer(InstanceData::g_Instance._MainWnd, 2, WindowMovedSaveDelay(), SaveTimerCallback);
+        }
+    } while (count == 64);
+    if (stalled) {
+        // an application hasn't finished writing its event, look again then.
+        SetTimer(InstanceData::g_Instance._MainWnd, 6, HOOK_STALLTIME, HookStallTimerCallback);
+    }
+}
+
+
+//
+// see whether the windows we just moved got there
+VOID CALLBACK AccuracyTimerCallback(
+    _In_ HWND     hwnd,
+    _In_ UINT     uMsg,
+    _In_ UINT_PTR idEvent,
+    _In_ DWORD    dwTime
+)
+{
+    if (!SampleRestoreAccuracy()) {
+        KillTimer(hwnd, idEvent);
     }
 }
 
@@ -459,8 +292,14 @@ VOID CALLBACK TimerCallback(
     _In_ DWORD    dwTime
 )
 {
-    ProcessMonitors();
+    if (!ProcessMonitors()) {
+        // the displays just woke, give their monitors a while longer.
+        return;
+    }
     KillTimer(hwnd, idEvent);
+    if (InstanceData::g_Instance._NumAccuracySamples > 0) {
+        SetTimer(hwnd, 3, ACCURACY_SAMPLEINTERVAL, AccuracyTimerCallback);
+    }
 }
 
 
@@ -488,6 +327,18 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
     HWND hWnd = CreateWindowW(szWindowClass, szTitle, WS_OVERLAPPEDWINDOW & ~WS_VISIBLE,
         CW_USEDEFAULT, 0, CW_USEDEFAULT, 0, nullptr, nullptr, hInstance, nullptr);
 
+    uTaskbarCreated = RegisterWindowMessage(_T("TaskbarCreated"));
+    LoadSettings();
+    OpenDiagnostics();
+    OpenTrace();
+    OpenMetrics();
+    OpenEventFeed();
+    HWINEVENTHOOK hEventFilter = StartEventFilter(hWnd);
+    StartCreationHook();
+    InstanceData::g_Instance._Session = GetSystemMetrics(SM_REMOTESESSION) ? SESSION_REMOTE : SESSION_CONSOLE;
+    InstanceData::g_Instance.LockTable();
+    UpdateKnownMonitors(InstanceData::g_Instance);
+    InstanceData::g_Instance.UnlockTable();
     ProcessDesktopWindows();
     InstanceData::g_Instance._NumMonitors = GetSystemMetrics(SM_CMONITORS);
 
@@ -497,7 +348,15 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
     }
 
     InstanceData::g_Instance._MainWnd = hWnd;
-    InstanceData::g_Instance._Hook = HookDisplayChange();
+    InstanceData::g_Instance._Hook = hEventFilter != NULL ? hEventFilter : HookDisplayChange();
+    WTSRegisterSessionNotification(hWnd, NOTIFY_FOR_THIS_SESSION);
+    hDisplayState = RegisterPowerSettingNotification(hWnd, &GUID_CONSOLE_DISPLAY_STATE, DEVICE_NOTIFY_WINDOW_HANDLE);
+    hMonitorPower = RegisterPowerSettingNotification(hWnd, &GUID_MONITOR_POWER_ON, DEVICE_NOTIFY_WINDOW_HANDLE);
+    StartSettingsWatcher();
+    SetTimer(hWnd, 5, 60000, MetricsTimerCallback);
+
+    // we're usually started at logon, along with everything else.
+    BeginWindowStorm();
 
     SetScrollRange(hWnd, SB_VERT, 0, 10000, false);
 
@@ -535,10 +394,35 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     switch (message)
     {
     case WM_DISPLAYCHANGE:
-        InstanceData::g_Instance.LogMessage(_T("WM_DISPLAYCHANGE\n"));
-        InstanceData::g_Instance.InChangingState = true;
-        SetTimer(hWnd, 99, 500, TimerCallback);
+        InstanceData::g_Instance.LogEvent(DIAG_MONITORS, NULL, 0, _T("WM_DISPLAYCHANGE\n"));
+        InstanceData::g_Instance.SetChangingState(true);
+        SetTimer(hWnd, 99, InstanceData::g_Instance.CurrentSettings()->m_nDisplayChangeDelay, TimerCallback);
+        break;
+    case WM_WTSSESSION_CHANGE:
+        if ((wParam == WTS_REMOTE_CONNECT && SwitchSession(SESSION_REMOTE)) ||
+            (wParam == WTS_CONSOLE_CONNECT && SwitchSession(SESSION_CONSOLE))) {
+            SetTimer(hWnd, 99, InstanceData::g_Instance.CurrentSettings()->m_nDisplayChangeDelay, TimerCallback);
+        }
+        if (wParam == WTS_SESSION_LOGON) {
+            // an unlock finds the applications already running.
+            BeginWindowStorm();
+        }
         break;
+    case WM_POWERBROADCAST:
+        if (wParam == PBT_POWERSETTINGCHANGE) {
+            //
+            // both settings are 0 for off; the console state is 2 when dimmed,
+            // which still counts as on.
+            POWERBROADCAST_SETTING * setting = (POWERBROADCAST_SETTING *)lParam;
+            if ((IsEqualGUID(setting->PowerSetting, GUID_CONSOLE_DISPLAY_STATE) ||
+                IsEqualGUID(setting->PowerSetting, GUID_MONITOR_POWER_ON)) &&
+                setting->DataLength >= sizeof(DWORD) &&
+                DisplayPowerChanged(*(DWORD *)setting->Data != 0)) {
+                SetTimer(hWnd, 99, InstanceData::g_Instance.CurrentSettings()->m_nDisplayChangeDelay, TimerCallback);
+            }
+            return TRUE;
+        }
+        return DefWindowProc(hWnd, message, wParam, lParam);
     case WM_COMMAND:
     {
         int wmId = LOWORD(wParam);
@@ -555,11 +439,45 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             ShowWindow(hWnd, SW_RESTORE);
             UpdateWindow(hWnd);
             break;
+        case IDM_INSPECTOR:
+            ShowInspector(hInst, hWnd);
+            break;
+        case IDM_EXTERNALONLY:
+            InstanceData::g_Instance._ExternalOnly = !InstanceData::g_Instance._ExternalOnly;
+            if (InstanceData::g_Instance._ExternalOnly) {
+                ClassifyMonitors();
+            }
+            CheckMenuItem(GetMenu(hWnd), IDM_EXTERNALONLY,
+                MF_BYCOMMAND | (InstanceData::g_Instance._ExternalOnly ? MF_CHECKED : MF_UNCHECKED));
+            break;
+        case IDM_LOCKLAYOUT:
+            if (!InstanceData::g_Instance._LayoutLocked) {
+                // lock them where they are now, not where they were last saved.
+                ProcessDesktopWindows();
+            }
+            SetLayoutLocked(!InstanceData::g_Instance._LayoutLocked);
+            CheckMenuItem(GetMenu(hWnd), IDM_LOCKLAYOUT,
+                MF_BYCOMMAND | (InstanceData::g_Instance._LayoutLocked ? MF_CHECKED : MF_UNCHECKED));
+            break;
         default:
             return DefWindowProc(hWnd, message, wParam, lParam);
         }
     }
     break;
+    case WM_SETTINGCHANGE:
+        if (wParam == SPI_SETWORKAREA) {
+            // the taskbar moved, placements are filed by where it is now.
+            InstanceData::g_Instance.LockTable();
+            UpdateKnownMonitors(InstanceData::g_Instance);
+            InstanceData::g_Instance.UnlockTable();
+        }
+        return DefWindowProc(hWnd, message, wParam, lParam);
+    case WM_HOOKEVENTS:
+        TakeForwardedMoves();
+        break;
+    case WM_SETTINGSRETIRED:
+        delete (Settings *)lParam;
+        break;
     case WM_CLOSE:
         ShowWindow(hWnd, SW_HIDE);
         return false;
@@ -627,6 +545,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         RECT r, r2;
         HDC hdc = BeginPaint(hWnd, &ps);
         GetClientRect(hWnd, &r);
+        AcquireSRWLockShared(&InstanceData::g_Instance._LogLock);
         r2 = r;
         DrawText(hdc, InstanceData::g_Instance._LogInfo,
             -1, &r2, DT_LEFT | DT_NOPREFIX | DT_WORDBREAK | DT_CALCRECT);
@@ -640,6 +559,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         r.top = r.top - pos;
         DrawText(hdc, InstanceData::g_Instance._LogInfo,
             -1, &r, DT_LEFT | DT_NOPREFIX | DT_WORDBREAK);
+        ReleaseSRWLockShared(&InstanceData::g_Instance._LogLock);
 
         EndPaint(hWnd, &ps);
 #endif
@@ -653,10 +573,24 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         icon.hWnd = hWnd;
         icon.uID = 1;
         Shell_NotifyIcon(NIM_DELETE, &icon);
+        WTSUnRegisterSessionNotification(hWnd);
+        if (hDisplayState != NULL) UnregisterPowerSettingNotification(hDisplayState);
+        if (hMonitorPower != NULL) UnregisterPowerSettingNotification(hMonitorPower);
+        StopSettingsWatcher();
+        CloseMetrics();
+        CloseDiagnostics();
+        CloseTrace();
+        CloseEventFeed();
+        // the event filter's DLL can't go while its hook is set.
+        if (InstanceData::g_Instance._Hook != NULL) UnhookWinEvent(InstanceData::g_Instance._Hook);
+        InstanceData::g_Instance._Hook = NULL;
+        StopEventFilter();
+        StopCreationHook();
         PostQuitMessage(0);
     }
     break;
     default:
+        if (message == uTaskbarCreated && message != 0) ForgetClassVerdicts();
         return DefWindowProc(hWnd, message, wParam, lParam);
     }
     return 0;
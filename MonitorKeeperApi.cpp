@@ -0,0 +1,360 @@
+// MonitorKeeperApi.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// C interface to the engine, see MonitorKeeperApi.h.
+//
+
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperApi.h"
+
+static LONG volatile s_bEngineCreated = false;
+
+static InstanceData * Engine(MKEngine * engine)
+{
+    return (InstanceData *)engine;
+}
+
+MKAPI MKEngine * WINAPI MKCreateEngine(void)
+{
+    // two threads may create at once, only one of them gets the engine.
+    if (InterlockedCompareExchange(&s_bEngineCreated, true, false) != false) return NULL;
+
+    InstanceData & inst = InstanceData::g_Instance;
+    inst._Session = GetSystemMetrics(SM_REMOTESESSION) ? SESSION_REMOTE : SESSION_CONSOLE;
+    inst._NumMonitors = GetSystemMetrics(SM_CMONITORS);
+    inst.LockTable();
+    UpdateKnownMonitors(inst);
+    inst.UnlockTable();
+    return (MKEngine *)&inst;
+}
+
+//
+// the saved placements belong to the process wide instance, so they are kept
+// for the next MKCreateEngine and freed when the process exits.
+//
+MKAPI void WINAPI MKDestroyEngine(MKEngine * engine)
+{
+    if (engine == NULL) return;
+    InterlockedExchange(&s_bEngineCreated, false);
+}
+
+MKAPI int WINAPI MKFeedEvents(MKEngine * engine, const MKEvent * events, int count)
+{
+    if (engine == NULL || events == NULL || count <= 0) return 0;
+
+    int need = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        switch (events[i].dwEvent)
+        {
+        case MK_EVENT_WINDOWMOVED:
+            //
+            // only moves of windows we track count towards a storm or put off
+            // the snapshot, as in WindowMoved in MonitorKeeper.cpp.
+            if (events[i].hwnd == NULL || Engine(engine)->InChangingState || !IsTrackedWindow(events[i].hwnd)) break;
+            if (CheckWindowDrift(events[i].hwnd)) need |= MK_NEED_ENFORCE;
+            WindowMovedSaveDelay();
+            need |= MK_NEED_SNAPSHOT;
+            break;
+        case MK_EVENT_DISPLAYCHANGE:
+            Engine(engine)->SetChangingState(true);
+            need |= MK_NEED_RESTORE;
+            break;
+        case MK_EVENT_REMOTESESSION:
+            if (SwitchSession(SESSION_REMOTE)) need |= MK_NEED_RESTORE;
+            break;
+        case MK_EVENT_CONSOLESESSION:
+            if (SwitchSession(SESSION_CONSOLE)) need |= MK_NEED_RESTORE;
+            break;
+        case MK_EVENT_LOGON:
+            BeginWindowStorm();
+            break;
+        case MK_EVENT_DISPLAYOFF:
+            DisplayPowerChanged(false);
+            break;
+        case MK_EVENT_DISPLAYON:
+            if (DisplayPowerChanged(true)) need |= MK_NEED_RESTORE;
+            break;
+        }
+    }
+    if (need & MK_NEED_RESTORE) need &= ~MK_NEED_SNAPSHOT;
+    return need;
+}
+
+MKAPI int WINAPI MKSnapshot(MKEngine * engine)
+{
+    if (engine == NULL) return -1;
+    if (Engine(engine)->InChangingState ||
+        GetSystemMetrics(SM_CMONITORS) != Engine(engine)->_NumMonitors) {
+        return -1;
+    }
+    ProcessDesktopWindows();
+    return Engine(engine)->_PassSaved;
+}
+
+static int PlanShard(WindowTable & shard, int monitors, int session, MKPlacement * placements, int max, int count)
+{
+    int i;
+    for (i = 0; i < shard.m_nLength; i++)
+    {
+        SavedWindowData & data = shard.m_data[i];
+        if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+        WINDOWPLACEMENT * place = data.Placement(monitors, session);
+        if (place == NULL) continue;
+        if (count < max) {
+            placements[count].hwnd = data.m_hwnd;
+            placements[count].placement = *place;
+        }
+        count++;
+    }
+    return count;
+}
+
+//
+// MKCaptureWindow may be changing shards while we copy them, so each is
+// copied under its own lock and then the versions checked. If one changed
+// after it was copied, start again; after a few tries hold them all.
+//
+MKAPI int WINAPI MKPlan(MKEngine * engine, int monitors, int session, MKPlacement * placements, int max)
+{
+    if (engine == NULL) return 0;
+    InstanceData * inst = Engine(engine);
+    if (session < 0 || session >= NUM_SESSIONKINDS) return 0;
+
+    LONG versions[WINDOW_SHARDS];
+    int count = 0;
+    int tries, s;
+    inst->LockTableShared();
+    for (tries = 0; tries < 3; tries++)
+    {
+        count = 0;
+        for (s = 0; s < WINDOW_SHARDS; s++)
+        {
+            inst->_Shards[s].LockShared();
+            versions[s] = inst->_Shards[s].m_nVersion;
+            count = PlanShard(inst->_Shards[s], monitors, session, placements, max, count);
+            inst->_Shards[s].UnlockShared();
+        }
+        for (s = 0; s < WINDOW_SHARDS && inst->_Shards[s].m_nVersion == versions[s]; s++);
+        if (s == WINDOW_SHARDS) break;
+    }
+    if (tries == 3) {
+        count = 0;
+        for (s = 0; s < WINDOW_SHARDS; s++) inst->_Shards[s].LockShared();
+        for (s = 0; s < WINDOW_SHARDS; s++) {
+            count = PlanShard(inst->_Shards[s], monitors, session, placements, max, count);
+        }
+        for (s = 0; s < WINDOW_SHARDS; s++) inst->_Shards[s].UnlockShared();
+    }
+    inst->UnlockTableShared();
+    return count;
+}
+
+MKAPI BOOL WINAPI MKCaptureWindow(MKEngine * engine, HWND hwnd)
+{
+    if (engine == NULL) return false;
+    return CaptureWindow(hwnd);
+}
+
+MKAPI BOOL WINAPI MKRestore(MKEngine * engine)
+{
+    if (engine == NULL) return false;
+    return ProcessMonitors();
+}
+
+MKAPI BOOL WINAPI MKGetStats(MKEngine * engine, MKStats * stats)
+{
+    if (engine == NULL || stats == NULL || stats->cbSize < sizeof(MKStats)) return false;
+
+    InstanceData * inst = Engine(engine);
+    int tracked = 0;
+    int slots = 0;
+    int s, i;
+    inst->LockTableShared();
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        WindowTable & shard = inst->_Shards[s];
+        shard.LockShared();
+        for (i = 0; i < shard.m_nLength; i++)
+        {
+            if (shard.m_data[i].m_hwnd != NULL && shard.m_data[i].m_nUnusedCount <= 2) tracked++;
+        }
+        slots += shard.m_nLength;
+        shard.UnlockShared();
+    }
+    stats->nMonitors = inst->_NumMonitors;
+    stats->nSession = inst->_Session;
+    stats->nTrackedWindows = tracked;
+    stats->nSlots = slots;
+    stats->nPassCount = inst->_PassCount;
+    stats->nLastPassMicroseconds = inst->_LastPassMicroseconds;
+    inst->UnlockTableShared();
+    return true;
+}
+
+MKAPI int WINAPI MKSnapshotDelay(MKEngine * engine)
+{
+    if (engine == NULL) return -1;
+    int delay = Engine(engine)->_LastSaveDelay;
+    return delay >= 0 ? delay : Engine(engine)->CurrentSettings()->m_nSaveDelay;
+}
+
+MKAPI BOOL WINAPI MKGetStormMetrics(MKEngine * engine, MKStormMetrics * metrics)
+{
+    if (engine == NULL || metrics == NULL || metrics->cbSize < sizeof(MKStormMetrics)) return false;
+
+    InstanceData * inst = Engine(engine);
+    inst->LockTableShared();
+    metrics->nStorms = inst->_StormMetrics.m_nStorms;
+    metrics->nEvents = inst->_StormMetrics.m_nEvents;
+    metrics->nPasses = inst->_StormMetrics.m_nPasses;
+    metrics->nPassesAvoided = inst->_StormMetrics.m_nPassesAvoided;
+    inst->UnlockTableShared();
+    return true;
+}
+
+MKAPI BOOL WINAPI MKGetPowerMetrics(MKEngine * engine, MKPowerMetrics * metrics)
+{
+    if (engine == NULL || metrics == NULL || metrics->cbSize < sizeof(MKPowerMetrics)) return false;
+
+    InstanceData * inst = Engine(engine);
+    inst->LockTableShared();
+    metrics->nSleeps = inst->_PowerMetrics.m_nSleeps;
+    metrics->nDisplayChanges = inst->_PowerMetrics.m_nDisplayChanges;
+    metrics->nRestoresAvoided = inst->_PowerMetrics.m_nRestoresAvoided;
+    metrics->nRestoresNeeded = inst->_PowerMetrics.m_nRestoresNeeded;
+    inst->UnlockTableShared();
+    return true;
+}
+
+MKAPI BOOL WINAPI MKSetRestoreStrategy(MKEngine * engine, int strategy)
+{
+    if (engine == NULL || strategy < 0 || strategy >= NUM_RESTORESTRATEGIES) return false;
+    Settings * settings = new Settings(*Engine(engine)->CurrentSettings());
+    settings->m_nRestoreStrategy = strategy;
+    settings->m_pNextRetired = NULL;
+    Engine(engine)->SwapSettings(settings);
+    return true;
+}
+
+MKAPI BOOL WINAPI MKGetRestoreMetrics(MKEngine * engine, int strategy, MKRestoreMetrics * metrics)
+{
+    if (engine == NULL || strategy < 0 || strategy >= NUM_RESTORESTRATEGIES) return false;
+    if (metrics == NULL || metrics->cbSize < sizeof(MKRestoreMetrics)) return false;
+
+    Engine(engine)->LockTableShared();
+    RestoreMetrics & m = Engine(engine)->_RestoreMetrics[strategy];
+    metrics->nRestores = m.m_nRestores;
+    metrics->nWindows = m.m_nWindows;
+    metrics->nMicroseconds = m.m_nMicroseconds;
+    metrics->nForeignCalls = m.m_nForeignCalls;
+    metrics->nMismatched = m.m_nMismatched;
+    Engine(engine)->UnlockTableShared();
+    return true;
+}
+
+MKAPI BOOL WINAPI MKSampleAccuracy(MKEngine * engine)
+{
+    if (engine == NULL) return false;
+    return SampleRestoreAccuracy();
+}
+
+MKAPI BOOL WINAPI MKGetAccuracy(MKEngine * engine, int index, MKAccuracy * accuracy)
+{
+    if (engine == NULL || accuracy == NULL || accuracy->cbSize < sizeof(MKAccuracy)) return false;
+
+    InstanceData * inst = Engine(engine);
+    inst->LockTableShared();
+    if (index < 0 || index >= inst->_NumAccuracyEntries) {
+        inst->UnlockTableShared();
+        return false;
+    }
+    const AccuracyEntry & entry = inst->_AccuracyEntries[index];
+    lstrcpy(accuracy->szApp, entry.m_szApp);
+    accuracy->nFromMonitors = entry.m_nFromMonitors;
+    accuracy->nToMonitors = entry.m_nToMonitors;
+    accuracy->nWindows = entry.m_nWindows;
+    accuracy->nCorrected = entry.m_nCorrected;
+    accuracy->nTotalCorrectMs = entry.m_nTotalCorrectMs;
+    accuracy->nWrong = entry.m_nWrong;
+    accuracy->nShowMismatched = entry.m_nShowMismatched;
+    accuracy->nTotalError = entry.m_nTotalError;
+    accuracy->nMaxError = entry.m_nMaxError;
+    inst->UnlockTableShared();
+    return true;
+}
+
+MKAPI void WINAPI MKLockLayout(MKEngine * engine, BOOL lock)
+{
+    if (engine == NULL) return;
+    SetLayoutLocked(lock);
+}
+
+MKAPI void WINAPI MKEnforce(MKEngine * engine)
+{
+    if (engine == NULL) return;
+    EnforceLayout();
+}
+
+MKAPI BOOL WINAPI MKGetEnforceMetrics(MKEngine * engine, MKEnforceMetrics * metrics)
+{
+    if (engine == NULL || metrics == NULL || metrics->cbSize < sizeof(MKEnforceMetrics)) return false;
+
+    InstanceData * inst = Engine(engine);
+    inst->LockTableShared();
+    metrics->nEvents = inst->_EnforceMetrics.m_nEvents;
+    metrics->nCorrections = inst->_EnforceMetrics.m_nCorrections;
+    metrics->nRateLimited = inst->_EnforceMetrics.m_nRateLimited;
+    metrics->nMicroseconds = inst->_EnforceMetrics.m_nMicroseconds;
+    inst->UnlockTableShared();
+    return true;
+}
+
+struct MKFeed {
+    HANDLE				m_hMapping;
+    const MKFeedHeader *m_pHeader;
+    LONG				m_dwNext;
+};
+
+MKAPI MKFeed * WINAPI MKOpenFeed(void)
+{
+    HANDLE h = OpenFileMappingW(FILE_MAP_READ, false, MK_FEED_NAME);
+    if (h == NULL) return NULL;
+    DWORD size = sizeof(MKFeedHeader) + MK_FEED_CAPACITY * sizeof(MKFeedRecord);
+    const MKFeedHeader * header = (const MKFeedHeader *)MapViewOfFile(h, FILE_MAP_READ, 0, 0, size);
+    if (header == NULL || header->dwMagic != MK_FEED_MAGIC || header->dwVersion != MK_FEED_VERSION ||
+        header->dwCapacity != MK_FEED_CAPACITY || header->cbRecord != sizeof(MKFeedRecord))
+    {
+        if (header != NULL) UnmapViewOfFile(header);
+        CloseHandle(h);
+        return NULL;
+    }
+    MKFeed * feed = new MKFeed;
+    feed->m_hMapping = h;
+    feed->m_pHeader = header;
+    feed->m_dwNext = header->dwNext;
+    return feed;
+}
+
+MKAPI int WINAPI MKReadFeed(MKFeed * feed, MKFeedRecord * records, int max, int * lost)
+{
+    int dropped = 0;
+    int count = 0;
+    if (feed != NULL && records != NULL && max > 0) {
+        count = ReadFeedRing(feed->m_pHeader, feed->m_dwNext, records, max, dropped);
+    }
+    if (lost != NULL) *lost = dropped;
+    return count;
+}
+
+MKAPI void WINAPI MKCloseFeed(MKFeed * feed)
+{
+    if (feed == NULL) return;
+    UnmapViewOfFile(feed->m_pHeader);
+    CloseHandle(feed->m_hMapping);
+    delete feed;
+}
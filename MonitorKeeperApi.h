@@ -0,0 +1,274 @@
+// MonitorKeeperApi.h
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// C interface to the MonitorKeeper engine, so another program can track and
+// restore window placements in process instead of running MonitorKeeper.exe.
+// MonitorKeeperEngine.vcxproj builds the engine as a static library, which
+// MonitorKeeper.exe links; link it into the program the same way, or build
+// it as a DLL with MONITORKEEPER_EXPORTS defined.
+//
+// The host owns the timing. Feed it the same notifications MonitorKeeper.exe
+// listens for, and after a short delay call MKSnapshot or MKRestore as
+// MKFeedEvents asks. The structures only ever grow at the end, and those that
+// may grow start with cbSize.
+//
+
+#pragma once
+
+#include <windows.h>
+
+#ifdef MONITORKEEPER_EXPORTS
+#define MKAPI __declspec(dllexport)
+#else
+#define MKAPI
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MK_API_VERSION 1
+
+typedef struct MKEngine MKEngine;
+
+//
+// events for MKFeedEvents
+//
+#define MK_EVENT_WINDOWMOVED        1   // EVENT_OBJECT_LOCATIONCHANGE or EVENT_SYSTEM_MOVESIZEEND for hwnd,
+                                        // only with OBJID_WINDOW and CHILDID_SELF
+#define MK_EVENT_DISPLAYCHANGE      2   // WM_DISPLAYCHANGE
+#define MK_EVENT_REMOTESESSION      3   // WTS_REMOTE_CONNECT
+#define MK_EVENT_CONSOLESESSION     4   // WTS_CONSOLE_CONNECT
+#define MK_EVENT_LOGON              5   // WTS_SESSION_LOGON, applications are about to start; not for an unlock
+#define MK_EVENT_RESTORED           6   // only in the event feed, windows were put back
+#define MK_EVENT_DISPLAYOFF         7   // GUID_CONSOLE_DISPLAY_STATE or GUID_MONITOR_POWER_ON went to off
+#define MK_EVENT_DISPLAYON          8   // and back on, or dimmed
+
+typedef struct MKEvent {
+    DWORD           dwEvent;
+    HWND            hwnd;
+} MKEvent;
+
+//
+// what MKFeedEvents wants done next
+//
+#define MK_NEED_SNAPSHOT            1
+#define MK_NEED_RESTORE             2
+#define MK_NEED_ENFORCE             4   // a locked window moved, call MKEnforce after a short delay
+
+typedef struct MKPlacement {
+    HWND            hwnd;
+    WINDOWPLACEMENT placement;
+} MKPlacement;
+
+typedef struct MKStats {
+    DWORD           cbSize;
+    int             nMonitors;
+    int             nSession;           // 0 console, 1 remote
+    int             nTrackedWindows;
+    int             nSlots;
+    int             nPassCount;
+    int             nLastPassMicroseconds;
+} MKStats;
+
+//
+// There is one engine per process, MKCreateEngine returns NULL if it
+// already exists. Every other call given a NULL engine does nothing and
+// returns 0 or FALSE, or -1 from MKSnapshot and MKSnapshotDelay.
+//
+MKAPI MKEngine * WINAPI MKCreateEngine(void);
+MKAPI void WINAPI MKDestroyEngine(MKEngine * engine);
+
+//
+// returns a combination of MK_NEED_ flags, 0 if there are no events.
+//
+MKAPI int WINAPI MKFeedEvents(MKEngine * engine, const MKEvent * events, int count);
+
+//
+// save the placement of every top level window. Returns the number of
+// windows saved, or -1 while a display change is waiting for MKRestore.
+//
+MKAPI int WINAPI MKSnapshot(MKEngine * engine);
+
+//
+// save just one window, for a host that knows which window moved. Several
+// threads may call this at once. Returns FALSE if the window isn't one we
+// track or a display change is waiting for MKRestore.
+//
+MKAPI BOOL WINAPI MKCaptureWindow(MKEngine * engine, HWND hwnd);
+
+//
+// the placements that would be restored for a monitor count and session.
+// Fills in at most max entries and returns how many there are.
+//
+MKAPI int WINAPI MKPlan(MKEngine * engine, int monitors, int session, MKPlacement * placements, int max);
+
+//
+// finish a display or session change, putting windows back if the monitor
+// configuration is one we have a layout for. Returns FALSE if the displays
+// have just woken and their monitors aren't all back yet; call it again
+// after another delay.
+//
+MKAPI BOOL WINAPI MKRestore(MKEngine * engine);
+
+MKAPI BOOL WINAPI MKGetStats(MKEngine * engine, MKStats * stats);
+
+//
+// ms to wait after the last MK_NEED_SNAPSHOT before calling MKSnapshot.
+// Longer while windows are being created in bulk, at logon for instance, so
+// the whole burst is saved at once, but never so long that a busy desktop
+// goes more than 10 seconds without one. -1 for a NULL engine.
+//
+MKAPI int WINAPI MKSnapshotDelay(MKEngine * engine);
+
+typedef struct MKStormMetrics {
+    DWORD           cbSize;
+    int             nStorms;
+    int             nEvents;            // window moves during storms
+    int             nPasses;            // snapshots taken for them
+    int             nPassesAvoided;     // snapshots the normal delay would have taken
+} MKStormMetrics;
+
+MKAPI BOOL WINAPI MKGetStormMetrics(MKEngine * engine, MKStormMetrics * metrics);
+
+//
+// display sleep. Between MK_EVENT_DISPLAYOFF and MK_EVENT_DISPLAYON display
+// changes are not acted on; if the monitors wake as they were and the
+// windows haven't moved, no restore is needed.
+//
+typedef struct MKPowerMetrics {
+    DWORD           cbSize;
+    int             nSleeps;
+    int             nDisplayChanges;    // while the displays were off
+    int             nRestoresAvoided;
+    int             nRestoresNeeded;    // woke as they were, but windows had moved
+} MKPowerMetrics;
+
+MKAPI BOOL WINAPI MKGetPowerMetrics(MKEngine * engine, MKPowerMetrics * metrics);
+
+//
+// restore strategies, see MKSetRestoreStrategy
+//
+#define MK_RESTORE_SEQUENTIAL       0
+#define MK_RESTORE_DEFERRED         1
+#define MK_RESTORE_BYPROCESS        2
+#define MK_RESTORE_PARALLEL         3
+
+typedef struct MKRestoreMetrics {
+    DWORD           cbSize;
+    int             nRestores;          // times the strategy was used
+    int             nWindows;           // the rest are for the last restore with it
+    int             nMicroseconds;
+    int             nForeignCalls;      // calls into the kernel on other applications' windows
+    int             nMismatched;
+} MKRestoreMetrics;
+
+//
+// choose how MKRestore puts windows back. Returns FALSE for an unknown strategy.
+//
+MKAPI BOOL WINAPI MKSetRestoreStrategy(MKEngine * engine, int strategy);
+MKAPI BOOL WINAPI MKGetRestoreMetrics(MKEngine * engine, int strategy, MKRestoreMetrics * metrics);
+
+//
+// how well restores worked, per application and monitor change. After
+// MKRestore, call MKSampleAccuracy every 100ms or so until it returns FALSE;
+// windows not where they were sent after two seconds are counted as wrong.
+//
+typedef struct MKAccuracy {
+    DWORD           cbSize;
+    WCHAR           szApp[40];          // executable name
+    int             nFromMonitors;
+    int             nToMonitors;
+    int             nWindows;
+    int             nCorrected;         // got there, and the time they took in total
+    int             nTotalCorrectMs;
+    int             nWrong;             // didn't, and how far off they were
+    int             nShowMismatched;
+    int             nTotalError;
+    int             nMaxError;
+} MKAccuracy;
+
+MKAPI BOOL WINAPI MKSampleAccuracy(MKEngine * engine);
+
+//
+// entries are numbered from 0, returns FALSE past the last one.
+//
+MKAPI BOOL WINAPI MKGetAccuracy(MKEngine * engine, int index, MKAccuracy * accuracy);
+
+//
+// lock every tracked window where it was last saved. While locked, moving a
+// window makes MKFeedEvents ask for MKEnforce, which puts it back.
+//
+typedef struct MKEnforceMetrics {
+    DWORD           cbSize;
+    int             nEvents;            // moves of locked windows out of place
+    int             nCorrections;
+    int             nRateLimited;       // not put back, moved too often
+    int             nMicroseconds;      // time spent checking and putting back
+} MKEnforceMetrics;
+
+MKAPI void WINAPI MKLockLayout(MKEngine * engine, BOOL lock);
+MKAPI void WINAPI MKEnforce(MKEngine * engine);
+MKAPI BOOL WINAPI MKGetEnforceMetrics(MKEngine * engine, MKEnforceMetrics * metrics);
+
+//
+// the event feed. While it runs, MonitorKeeper.exe publishes window moves
+// and monitor and session changes to a ring in shared memory named
+// MK_FEED_NAME, so other programs in the session can follow them without
+// hooks of their own. There is one writer and any number of readers; readers
+// never hold up the writer, and one that falls more than MK_FEED_CAPACITY
+// records behind loses the oldest. The engine itself doesn't publish when
+// used through MKCreateEngine, only the readers below are for hosts.
+//
+// Records are numbered from dwNext in the header. The record numbered n is
+// at index n % MK_FEED_CAPACITY after the header, and is complete when its
+// dwSequence is n, both before and after it has been read.
+//
+#define MK_FEED_NAME                L"Local\\MonitorKeeperFeed"
+#define MK_FEED_MAGIC               0x464b4d4d  // "MMKF"
+#define MK_FEED_VERSION             1
+#define MK_FEED_CAPACITY            4096        // a power of two
+
+typedef struct MKFeedHeader {
+    DWORD           dwMagic;
+    DWORD           dwVersion;
+    DWORD           dwCapacity;
+    DWORD           cbRecord;
+    LONG volatile   dwNext;             // number of the next record written, wraps
+    DWORD           dwProducerId;       // process publishing
+    DWORD           dwReserved[10];
+} MKFeedHeader;
+
+typedef struct MKFeedRecord {
+    LONG volatile   dwSequence;
+    DWORD           dwEvent;            // MK_EVENT_
+    DWORD           dwTime;             // GetTickCount
+    int             nMonitors;
+    ULONGLONG       hwnd;               // the same size for 32 and 64 bit readers
+    RECT            rcWindow;           // where hwnd is now, or the virtual screen
+    int             nSession;           // 0 console, 1 remote
+    DWORD           dwReserved;
+} MKFeedRecord;
+
+typedef struct MKFeed MKFeed;
+
+//
+// NULL if MonitorKeeper.exe isn't running. Reading starts with the next
+// record published.
+//
+MKAPI MKFeed * WINAPI MKOpenFeed(void);
+
+//
+// copies out up to max records, oldest first, and returns how many. lost, if
+// not NULL, gets the number of records that were overwritten before they
+// could be read.
+//
+MKAPI int WINAPI MKReadFeed(MKFeed * feed, MKFeedRecord * records, int max, int * lost);
+MKAPI void WINAPI MKCloseFeed(MKFeed * feed);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,606 @@
+// MonitorKeeperBench.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// Timings of the engine's hot paths, run with "MonitorKeeper.exe /benchmark".
+// Results are written as JSON to MonitorKeeper.bench.json beside the
+// executable. If MonitorKeeper.baseline.json is there too (a renamed earlier
+// results file) each result is compared with it, and any that got slower by
+// more than [Benchmark] RegressionPercent in MonitorKeeper.ini (default 10)
+// is counted as a regression. A benchmark whose engine gave the wrong answer
+// is counted as a failure. The exit code is the number of regressions and
+// failures.
+//
+// The table benchmarks use a private InstanceData and made up HWNDs, so they
+// run at any scale; monitor_index files their placements under four monitors
+// and monitor_query finds one monitor's windows. capture_threads saves windows
+// from 1 to 16 threads at once.
+// feed_publish writes to a private event feed while 0 to 16 readers follow
+// it, feed_read is one reader catching up. diag_append fills a private
+// diagnostics log of a million records, and diag_window and diag_range are
+// one query for a window's records and for a minute of them. Each captured
+// trace in the corpus, MonitorKeeper.<name>.trace, is replayed as
+// trace_<name>, see MonitorKeeperTrace.cpp. classify_name is one look in
+// the excluded classes and classify_window is IsTrackedWindow on each window
+// on the desktop, once their classes are known. The save pass runs against the real desktop, and
+// also reports the calls into the kernel it makes on other windows once they are known.
+// event_path is what each tracked window move costs once WindowMoved has let it through, the
+// save delay and the drift check, and event_path_locked is the same with the layout locked. Restores
+// are not timed here because they would move the user's windows; use the
+// restore metrics (MKGetRestoreMetrics) for those.
+//
+
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperApi.h"
+#include "MonitorKeeperClasses.h"
+
+#define BENCH_MAXRESULTS    64
+#define BENCH_MAXTRACES     16
+#define BENCH_BUFFERSIZE    8192
+#define BENCH_SAVEPASSES    10
+#define BENCH_MONITORS      4
+#define BENCH_MONITORQUERIES 1000
+
+struct BenchResult {
+    const char *		m_szName;
+    int					m_nScale;
+    int					m_nNanoseconds;     // per operation
+    int					m_nCalls;           // per operation, -1 if not counted
+};
+
+static BenchResult s_Results[BENCH_MAXRESULTS];
+static int s_NumResults = 0;
+static int s_NumFailures = 0;
+static char s_szTraceNames[BENCH_MAXTRACES][40];
+
+static LONGLONG BenchNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static void BenchRecord(const char * name, int scale, LONGLONG start, LONGLONG end, int ops)
+{
+    if (s_NumResults >= BENCH_MAXRESULTS || ops <= 0) return;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    BenchResult & r = s_Results[s_NumResults++];
+    r.m_szName = name;
+    r.m_nScale = scale;
+    r.m_nNanoseconds = (int)((end - start) * 1000000000 / freq.QuadPart / ops);
+    r.m_nCalls = -1;
+}
+
+//
+// made up, but spaced like real handles so the hash sees the same low bits.
+//
+static HWND BenchHwnd(int n)
+{
+    return (HWND)(UINT_PTR)(0x10000 + n * 2);
+}
+
+static void BenchTable(int scale)
+{
+    InstanceData * inst = new InstanceData();
+    LONGLONG start, end;
+    int i;
+
+    start = BenchNow();
+    for (i = 0; i < scale; i++) inst->FindWindowSlot(BenchHwnd(i));
+    end = BenchNow();
+    BenchRecord("table_insert", scale, start, end, scale);
+
+    start = BenchNow();
+    for (i = 0; i < scale; i++) inst->FindWindowSlot(BenchHwnd(i));
+    end = BenchNow();
+    BenchRecord("table_find", scale, start, end, scale);
+
+    //
+    // give every slot a layout, then plan a restore the way MKPlan does.
+    int s;
+    for (s = 0; s < WINDOW_SHARDS; s++) {
+        WindowTable & shard = inst->_Shards[s];
+        for (i = 0; i < shard.m_nLength; i++) {
+            if (shard.m_data[i].m_hwnd == NULL) continue;
+            WINDOWPLACEMENT * place = shard.m_data[i].PlacementForSave(2, SESSION_CONSOLE);
+            ZeroMemory(place, sizeof(WINDOWPLACEMENT));
+            place->length = sizeof(WINDOWPLACEMENT);
+        }
+    }
+    int planned = 0;
+    start = BenchNow();
+    for (s = 0; s < WINDOW_SHARDS; s++) {
+        WindowTable & shard = inst->_Shards[s];
+        shard.LockShared();
+        for (i = 0; i < shard.m_nLength; i++) {
+            SavedWindowData & data = shard.m_data[i];
+            if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+            if (data.Placement(2, SESSION_CONSOLE) != NULL) planned++;
+        }
+        shard.UnlockShared();
+    }
+    end = BenchNow();
+    BenchRecord("plan", scale, start, end, planned);
+
+    //
+    // file each placement under one of four monitors side by side, then find
+    // one monitor's windows at a time, which should cost a quarter of a plan.
+    inst->_NumKnownMonitors = BENCH_MONITORS;
+    for (i = 0; i < BENCH_MONITORS; i++) {
+        KnownMonitor & monitor = inst->_KnownMonitors[i];
+        wsprintf(monitor.m_szDevice, _T("\\\\.\\DISPLAY%d"), i + 1);
+        monitor.m_rcMonitor.left = i * 1920;
+        monitor.m_rcMonitor.top = 0;
+        monitor.m_rcMonitor.right = (i + 1) * 1920;
+        monitor.m_rcMonitor.bottom = 1080;
+        monitor.m_bPresent = true;
+    }
+    int indexed = 0;
+    start = BenchNow();
+    for (s = 0; s < WINDOW_SHARDS; s++) {
+        WindowTable & shard = inst->_Shards[s];
+        for (i = 0; i < shard.m_nLength; i++) {
+            SavedWindowData & data = shard.m_data[i];
+            if (data.m_hwnd == NULL) continue;
+            RECT & r = data.Placement(2, SESSION_CONSOLE)->rcNormalPosition;
+            r.left = (indexed % BENCH_MONITORS) * 1920 + 100;
+            r.top = 100;
+            r.right = r.left + 800;
+            r.bottom = 700;
+            inst->IndexSavedWindow(&data, 2, SESSION_CONSOLE);
+            indexed++;
+        }
+    }
+    end = BenchNow();
+    BenchRecord("monitor_index", scale, start, end, indexed);
+
+    SavedWindowData ** found = new SavedWindowData *[scale];
+    start = BenchNow();
+    for (i = 0; i < BENCH_MONITORQUERIES; i++) inst->WindowsOnMonitor(i % BENCH_MONITORS, 2, SESSION_CONSOLE, found, scale);
+    end = BenchNow();
+    BenchRecord("monitor_query", scale, start, end, BENCH_MONITORQUERIES);
+    delete[] found;
+
+    //
+    // every window closes and as many new ones open, which is what a
+    // login storm looks like to the table.
+    start = BenchNow();
+    for (i = 0; i < 3; i++) inst->TagWindowsUnused();
+    for (i = 0; i < scale; i++) inst->FindWindowSlot(BenchHwnd(scale + i));
+    end = BenchNow();
+    BenchRecord("table_churn", scale, start, end, scale);
+
+    delete inst;
+}
+
+//
+// threads saving windows at once, each to the window's shard the way
+// CaptureWindow does. The total is the same for every thread count, so the
+// time per window shows how well the shards let them run side by side.
+//
+#define BENCH_CAPTURES 32768
+
+struct BenchCapture {
+    InstanceData *		m_pInst;
+    int					m_nFirst;
+    int					m_nCount;
+};
+
+static DWORD WINAPI BenchCaptureThread(LPVOID param)
+{
+    BenchCapture * capture = (BenchCapture *)param;
+    int i;
+    for (i = capture->m_nFirst; i < capture->m_nFirst + capture->m_nCount; i++)
+    {
+        HWND hwnd = BenchHwnd(i);
+        WindowTable & shard = capture->m_pInst->ShardFor(hwnd);
+        shard.Lock();
+        WINDOWPLACEMENT * place = shard.FindWindowSlot(hwnd)->PlacementForSave(2, SESSION_CONSOLE);
+        place->length = sizeof(WINDOWPLACEMENT);
+        shard.Unlock();
+    }
+    return 0;
+}
+
+static void BenchCaptureThreads(int threads)
+{
+    InstanceData * inst = new InstanceData();
+    BenchCapture captures[16];
+    HANDLE handles[16];
+    int i;
+    for (i = 0; i < threads; i++)
+    {
+        captures[i].m_pInst = inst;
+        captures[i].m_nCount = BENCH_CAPTURES / threads;
+        captures[i].m_nFirst = i * captures[i].m_nCount;
+    }
+    LONGLONG start = BenchNow();
+    for (i = 0; i < threads; i++)
+    {
+        handles[i] = CreateThread(NULL, 0, BenchCaptureThread, &captures[i], 0, NULL);
+    }
+    WaitForMultipleObjects(threads, handles, true, INFINITE);
+    LONGLONG end = BenchNow();
+    for (i = 0; i < threads; i++) CloseHandle(handles[i]);
+    BenchRecord("capture_threads", threads, start, end, BENCH_CAPTURES);
+    delete inst;
+}
+
+//
+// readers follow a private feed as fast as they can while it is written, the
+// publish time shouldn't change with how many there are.
+//
+#define BENCH_FEEDEVENTS 262144
+
+struct BenchFeedReader {
+    const MKFeedHeader *m_pFeed;
+    LONG volatile *		m_pStop;
+};
+
+static DWORD WINAPI BenchFeedThread(LPVOID param)
+{
+    BenchFeedReader * reader = (BenchFeedReader *)param;
+    MKFeedRecord records[64];
+    LONG next = reader->m_pFeed->dwNext;
+    int lost;
+    while (*reader->m_pStop == 0) ReadFeedRing(reader->m_pFeed, next, records, 64, lost);
+    return 0;
+}
+
+static void BenchFeed(int readers)
+{
+    HANDLE hMapping;
+    MKFeedHeader * feed = CreateFeedRing(NULL, &hMapping);
+    if (feed == NULL) return;
+    LONG volatile stop = 0;
+    BenchFeedReader reader;
+    reader.m_pFeed = feed;
+    reader.m_pStop = &stop;
+    HANDLE handles[16];
+    int i;
+    for (i = 0; i < readers; i++)
+    {
+        handles[i] = CreateThread(NULL, 0, BenchFeedThread, &reader, 0, NULL);
+    }
+    RECT rc = { 0, 0, 800, 600 };
+    LONGLONG start = BenchNow();
+    for (i = 0; i < BENCH_FEEDEVENTS; i++) PublishFeedRecord(feed, MK_EVENT_WINDOWMOVED, BenchHwnd(i), rc, 2, SESSION_CONSOLE);
+    LONGLONG end = BenchNow();
+    InterlockedExchange(&stop, 1);
+    if (readers > 0) WaitForMultipleObjects(readers, handles, true, INFINITE);
+    for (i = 0; i < readers; i++) CloseHandle(handles[i]);
+    BenchRecord("feed_publish", readers, start, end, BENCH_FEEDEVENTS);
+
+    if (readers == 0) {
+        MKFeedRecord * records = new MKFeedRecord[MK_FEED_CAPACITY];
+        LONG next = (LONG)((DWORD)feed->dwNext - MK_FEED_CAPACITY);
+        int lost;
+        start = BenchNow();
+        int read = ReadFeedRing(feed, next, records, MK_FEED_CAPACITY, lost);
+        end = BenchNow();
+        BenchRecord("feed_read", 1, start, end, read);
+        delete[] records;
+    }
+    UnmapViewOfFile(feed);
+    CloseHandle(hMapping);
+}
+
+//
+// a million records, a millisecond apart, about 1000 windows.
+//
+#define BENCH_DIAGRECORDS 1048576
+#define BENCH_DIAGWINDOWS 1000
+#define BENCH_DIAGQUERIES 100
+
+static void BenchDiagnostics()
+{
+    HANDLE hMapping;
+    DiagHeader * diag = CreateDiagnostics(INVALID_HANDLE_VALUE, BENCH_DIAGRECORDS, &hMapping);
+    if (diag == NULL) return;
+    DiagRecord record;
+    ZeroMemory(&record, sizeof(record));
+    record.m_wMonitors = 2;
+    lstrcpyn(record.m_szText, _T("Save Position for Notepad, monitors 2, x=10, y=10, show=SW_SHOWNORMAL"), DIAG_TEXTLEN);
+    ULONGLONG ftStart = 132000000000000000;
+    int i;
+    LONGLONG start = BenchNow();
+    for (i = 0; i < BENCH_DIAGRECORDS; i++)
+    {
+        record.m_wEvent = DIAG_SAVE;
+        record.m_ftTime = ftStart + (ULONGLONG)i * 10000;
+        record.m_dwHwnd = (DWORD)(UINT_PTR)BenchHwnd(i % BENCH_DIAGWINDOWS);
+        record.m_dwProcessId = 1000 + i % BENCH_DIAGWINDOWS;
+        AppendDiagnostic(diag, record);
+    }
+    LONGLONG end = BenchNow();
+    BenchRecord("diag_append", BENCH_DIAGRECORDS, start, end, BENCH_DIAGRECORDS);
+
+    DiagRecord * records = new DiagRecord[BENCH_DIAGRECORDS / BENCH_DIAGWINDOWS + 1];
+    DiagQuery query;
+    ZeroMemory(&query, sizeof(query));
+    query.m_nEvent = -1;
+    start = BenchNow();
+    for (i = 0; i < BENCH_DIAGQUERIES; i++)
+    {
+        query.m_dwHwnd = (DWORD)(UINT_PTR)BenchHwnd(i * 7 % BENCH_DIAGWINDOWS);
+        QueryDiagnostics(diag, query, records, BENCH_DIAGRECORDS / BENCH_DIAGWINDOWS + 1);
+    }
+    end = BenchNow();
+    BenchRecord("diag_window", BENCH_DIAGRECORDS, start, end, BENCH_DIAGQUERIES);
+    delete[] records;
+
+    records = new DiagRecord[60000];
+    query.m_dwHwnd = 0;
+    start = BenchNow();
+    for (i = 0; i < BENCH_DIAGQUERIES; i++)
+    {
+        query.m_ftFrom = ftStart + (ULONGLONG)(i * 9973 % (BENCH_DIAGRECORDS - 60000)) * 10000;
+        query.m_ftTo = query.m_ftFrom + 600000000 - 1;
+        QueryDiagnostics(diag, query, records, 60000);
+    }
+    end = BenchNow();
+    BenchRecord("diag_range", BENCH_DIAGRECORDS, start, end, BENCH_DIAGQUERIES);
+    delete[] records;
+
+    UnmapViewOfFile(diag);
+    CloseHandle(hMapping);
+}
+
+//
+// app and shell class names, half of them excluded, in mixed case.
+//
+#define BENCH_CLASSIFYROUNDS 100000
+#define BENCH_MAXWINDOWS 4096
+
+static LPCWSTR s_szBenchClasses[] = {
+    L"Notepad", L"Progman", L"Chrome_WidgetWin_1", L"Shell_TrayWnd",
+    L"CabinetWClass", L"workerw", L"XLMAIN", L"IME",
+    L"ConsoleWindowClass", L"Windows.UI.Core.CoreWindow", L"MozillaWindowClass", L"#32768",
+    L"ApplicationFrameWindow", L"TOOLTIPS_CLASS32", L"OpusApp", L"Shell_SecondaryTrayWnd",
+};
+#define BENCH_CLASSES (sizeof(s_szBenchClasses) / sizeof(s_szBenchClasses[0]))
+
+struct BenchWindows {
+    HWND				m_hwnd[BENCH_MAXWINDOWS];
+    int					m_nCount;
+};
+
+static BOOL CALLBACK BenchWindowsCallback(HWND hwnd, LPARAM lParam)
+{
+    BenchWindows * windows = (BenchWindows *)lParam;
+    if (windows->m_nCount >= BENCH_MAXWINDOWS) return false;
+    windows->m_hwnd[windows->m_nCount++] = hwnd;
+    return true;
+}
+
+static void BenchClassify()
+{
+    int i, j, excluded = 0;
+    LONGLONG start = BenchNow();
+    for (i = 0; i < BENCH_CLASSIFYROUNDS; i++)
+    {
+        for (j = 0; j < (int)BENCH_CLASSES; j++) excluded += IsExcludedClassName(s_szBenchClasses[j]);
+    }
+    LONGLONG end = BenchNow();
+    BenchRecord("classify_name", BENCH_CLASSES, start, end, BENCH_CLASSIFYROUNDS * BENCH_CLASSES);
+    if (excluded != BENCH_CLASSIFYROUNDS * (int)BENCH_CLASSES / 2) {
+        // the wrong classes were excluded, the time means nothing.
+        s_NumFailures++;
+    }
+
+    BenchWindows * windows = new BenchWindows;
+    windows->m_nCount = 0;
+    EnumWindows(BenchWindowsCallback, (LPARAM)windows);
+    for (j = 0; j < windows->m_nCount; j++) IsTrackedWindow(windows->m_hwnd[j]);   // learn their classes
+    int rounds = BENCH_CLASSIFYROUNDS / 100;
+    start = BenchNow();
+    for (i = 0; i < rounds; i++)
+    {
+        for (j = 0; j < windows->m_nCount; j++) IsTrackedWindow(windows->m_hwnd[j]);
+    }
+    end = BenchNow();
+    BenchRecord("classify_window", windows->m_nCount, start, end, rounds * windows->m_nCount);
+    delete windows;
+}
+
+static void BenchSavePass()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    inst._NumMonitors = GetSystemMetrics(SM_CMONITORS);
+    ProcessDesktopWindows();    // first pass fills the table
+
+    int i;
+    LONGLONG start = BenchNow();
+    for (i = 0; i < BENCH_SAVEPASSES; i++) ProcessDesktopWindows();
+    LONGLONG end = BenchNow();
+    BenchRecord("save_pass", inst._PassSaved, start, end, BENCH_SAVEPASSES);
+    if (s_NumResults > 0) s_Results[s_NumResults - 1].m_nCalls = inst._PassCalls;
+}
+
+//
+// moves of windows we track, handed to the engine the way WindowMoved in
+// MonitorKeeper.cpp does once IsTrackedWindow has passed them. The handles
+// are made up, so with the layout locked the drift check goes as far as
+// GetWindowPlacement. Leaves the real instance storming with its layout
+// locked, so it runs last.
+//
+#define BENCH_EVENTWINDOWS 1000
+#define BENCH_EVENTS 100000
+
+static void BenchEventPath(const char * name, BOOL locked)
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    int i;
+    inst.LockTable();
+    for (i = 0; i < BENCH_EVENTWINDOWS; i++)
+    {
+        WINDOWPLACEMENT * place = inst.FindWindowSlot(BenchHwnd(i))->PlacementForSave(inst._NumMonitors, inst._Session);
+        ZeroMemory(place, sizeof(WINDOWPLACEMENT));
+        place->length = sizeof(WINDOWPLACEMENT);
+    }
+    inst.LockLayout(locked);
+    inst.UnlockTable();
+
+    LONGLONG start = BenchNow();
+    for (i = 0; i < BENCH_EVENTS; i++)
+    {
+        CheckWindowDrift(BenchHwnd(i % BENCH_EVENTWINDOWS));
+        WindowMovedSaveDelay();
+    }
+    LONGLONG end = BenchNow();
+    BenchRecord(name, BENCH_EVENTWINDOWS, start, end, BENCH_EVENTS);
+}
+
+//
+// beside the settings file, which LoadSettings has already found.
+//
+static BOOL BenchFileName(LPTSTR szFile, LPCTSTR szSuffix)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    int len = lstrlen(szSettings);
+    if (len < 4 || len - 3 + lstrlen(szSuffix) >= MAX_PATH) return false;
+    lstrcpyn(szFile, szSettings, len - 3 + 1);      // keeps the '.'
+    lstrcat(szFile, szSuffix);
+    return true;
+}
+
+//
+// replay each trace in the corpus against a private InstanceData, timing
+// the engine per record.
+//
+static void BenchTraces()
+{
+    TCHAR szPattern[MAX_PATH];
+    if (!BenchFileName(szPattern, _T("*.trace"))) return;
+    int dir = lstrlen(szPattern);
+    while (dir > 0 && szPattern[dir - 1] != '\\') dir--;
+    WIN32_FIND_DATA found;
+    HANDLE hFind = FindFirstFile(szPattern, &found);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    int traces = 0;
+    do {
+        if (dir + lstrlen(found.cFileName) >= MAX_PATH) continue;
+        TCHAR szFile[MAX_PATH];
+        lstrcpyn(szFile, szPattern, dir + 1);
+        lstrcat(szFile, found.cFileName);
+        int count;
+        TraceRecord * records = ReadTrace(szFile, count);
+        if (records == NULL) continue;
+
+        //
+        // MonitorKeeper.<name>.trace is trace_<name>, kept to what JSON allows.
+        char * name = s_szTraceNames[traces++];
+        LPCTSTR p = found.cFileName;
+        while (*p != '\0' && *p != '.') p++;
+        if (*p == '.') p++;
+        int len = wsprintfA(name, "trace_");
+        for (; *p != '\0' && *p != '.' && len < 39; p++)
+        {
+            TCHAR c = *p;
+            BOOL plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+            name[len++] = plain ? (char)c : '_';
+        }
+        name[len] = '\0';
+
+        InstanceData * inst = new InstanceData();
+        LONGLONG start = BenchNow();
+        ReplayTrace(inst, records, count);
+        LONGLONG end = BenchNow();
+        BenchRecord(name, count, start, end, count);
+        delete inst;
+        delete[] records;
+    } while (traces < BENCH_MAXTRACES && FindNextFile(hFind, &found));
+    FindClose(hFind);
+}
+
+//
+// the baseline is a results file we wrote, so finding our own key is enough.
+//
+static int BenchBaseline(const char * baseline, const BenchResult & r)
+{
+    if (baseline == NULL) return -1;
+    char key[96];
+    wsprintfA(key, "\"name\": \"%s\", \"scale\": %d, \"ns\": ", r.m_szName, r.m_nScale);
+    int keylen = lstrlenA(key);
+    const char * p;
+    for (p = baseline; *p != '\0'; p++)
+    {
+        int i = 0;
+        while (i < keylen && p[i] == key[i]) i++;
+        if (i < keylen) continue;
+        p += keylen;
+        int value = 0;
+        while (*p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+        return value;
+    }
+    return -1;
+}
+
+static char * BenchReadFile(LPCTSTR szFile)
+{
+    HANDLE h = CreateFile(szFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return NULL;
+    char * buffer = new char[BENCH_BUFFERSIZE];
+    DWORD read = 0;
+    if (!ReadFile(h, buffer, BENCH_BUFFERSIZE - 1, &read, NULL)) read = 0;
+    buffer[read] = '\0';
+    CloseHandle(h);
+    return buffer;
+}
+
+int RunBenchmark()
+{
+    TCHAR szResults[MAX_PATH];
+    TCHAR szBaseline[MAX_PATH];
+    if (!BenchFileName(szResults, _T("bench.json")) || !BenchFileName(szBaseline, _T("baseline.json"))) {
+        return -1;
+    }
+    int threshold = GetPrivateProfileInt(_T("Benchmark"), _T("RegressionPercent"), 10,
+        InstanceData::g_Instance._SettingsFile);
+
+    s_NumResults = 0;
+    s_NumFailures = 0;
+    BenchTable(100);
+    BenchTable(1000);
+    BenchTable(10000);
+    int threads;
+    for (threads = 1; threads <= 16; threads *= 2) BenchCaptureThreads(threads);
+    BenchFeed(0);
+    for (threads = 1; threads <= 16; threads *= 4) BenchFeed(threads);
+    BenchDiagnostics();
+    BenchTraces();
+    BenchClassify();
+    BenchSavePass();
+    BenchEventPath("event_path", false);
+    BenchEventPath("event_path_locked", true);
+
+    char * baseline = BenchReadFile(szBaseline);
+    char * out = new char[BENCH_BUFFERSIZE];
+    int len = wsprintfA(out, "{\n  \"monitors\": %d,\n  \"results\": [\n", GetSystemMetrics(SM_CMONITORS));
+    int regressions = 0;
+    int i;
+    for (i = 0; i < s_NumResults; i++)
+    {
+        const BenchResult & r = s_Results[i];
+        int base = BenchBaseline(baseline, r);
+        BOOL regressed = base > 0 && r.m_nNanoseconds > base + base * threshold / 100;
+        if (regressed) regressions++;
+        len += wsprintfA(out + len, "    { \"name\": \"%s\", \"scale\": %d, \"ns\": %d, \"baseline\": %d, \"regressed\": %s, \"calls\": %d }%s\n",
+            r.m_szName, r.m_nScale, r.m_nNanoseconds, base, regressed ? "true" : "false", r.m_nCalls,
+            i + 1 < s_NumResults ? "," : "");
+    }
+    len += wsprintfA(out + len, "  ],\n  \"regressions\": %d,\n  \"failures\": %d\n}\n", regressions, s_NumFailures);
+
+    HANDLE h = CreateFile(szResults, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (h != INVALID_HANDLE_VALUE) {
+        DWORD written;
+        WriteFile(h, out, len, &written, NULL);
+        CloseHandle(h);
+    }
+    delete[] out;
+    if (baseline != NULL) delete[] baseline;
+    return regressions + s_NumFailures;
+}
@@ -0,0 +1,147 @@
+// MonitorKeeperClasses.h
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// Window classes of the shell and the system that are never tracked,
+// whatever their styles say: the desktop, the taskbars, the start menu and
+// input method windows. They are checked before anything else is asked
+// about a window.
+//
+// The names are put in a table with a perfect hash when we are compiled:
+// ExclusionSeed finds a seed for which no two of them share a slot, so
+// checking a name is one hash and one compare. The names are only looked
+// at once per class, though. Each class has an atom, which can be read
+// from the desktop heap without a call into the kernel, and the verdict
+// for each atom is remembered.
+//
+// An atom is only given to another class once every class with its name
+// has gone, which for these means the shell has exited, so MonitorKeeper
+// forgets its verdicts when the taskbar is created again.
+//
+// This header is included by the DLL, so it uses nothing but windows.h.
+//
+
+#pragma once
+
+#include <windows.h>
+
+#define EXCLUDED_SLOTS 128          // a power of two, big enough that a seed is found in a few tries
+#define CLASS_VERDICTS 256          // verdicts remembered, by class atom. A power of two
+
+static constexpr LPCWSTR s_szExcludedClasses[] = {
+    L"Progman",                     // the desktop
+    L"WorkerW",                     // behind the desktop icons, and wallpaper hosts
+    L"Shell_TrayWnd",               // the taskbar
+    L"Shell_SecondaryTrayWnd",      // the taskbar on other monitors
+    L"NotifyIconOverflowWindow",
+    L"TaskListThumbnailWnd",
+    L"MultitaskingViewFrame",       // alt tab
+    L"ForegroundStaging",
+    L"Windows.UI.Core.CoreWindow",  // start, search and the action center
+    L"XamlExplorerHostIslandWindow",
+    L"TopLevelWindowForOverflowXamlIsland",
+    L"Shell_InputSwitchTopLevelWindow",
+    L"EdgeUiInputTopWndClass",
+    L"EdgeUiInputWndClass",
+    L"DV2ControlHost",              // the Windows 7 start menu
+    L"IME",
+    L"MSCTFIME UI",
+    L"CiceroUIWndFrame",            // the language bar
+    L"tooltips_class32",
+    L"SysShadow",
+    L"#32768",                      // menus
+    L"#32769",                      // the desktop window
+};
+
+#define EXCLUDED_CLASSES (sizeof(s_szExcludedClasses) / sizeof(s_szExcludedClasses[0]))
+static_assert(EXCLUDED_CLASSES * 2 <= EXCLUDED_SLOTS, "EXCLUDED_SLOTS is too small");
+
+//
+// FNV-1a of the name in lower case, class names don't care. The seed picks
+// one of a family of hashes.
+//
+constexpr DWORD ClassNameHash(LPCWSTR sz, DWORD seed)
+{
+    DWORD h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (; *sz != '\0'; sz++)
+    {
+        WCHAR c = *sz;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr BOOL ExclusionSeedWorks(DWORD seed)
+{
+    BOOL used[EXCLUDED_SLOTS] = {};
+    int i = 0;
+    for (i = 0; i < (int)EXCLUDED_CLASSES; i++)
+    {
+        DWORD slot = ClassNameHash(s_szExcludedClasses[i], seed) & (EXCLUDED_SLOTS - 1);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr DWORD ExclusionSeed()
+{
+    DWORD seed = 0;
+    while (!ExclusionSeedWorks(seed)) seed++;
+    return seed;
+}
+
+struct ExclusionTable {
+    DWORD				m_dwSeed;
+    signed char			m_index[EXCLUDED_SLOTS];    // into s_szExcludedClasses, -1 for an empty slot
+
+    constexpr ExclusionTable() : m_dwSeed(ExclusionSeed()), m_index()
+    {
+        int i = 0;
+        for (i = 0; i < EXCLUDED_SLOTS; i++) m_index[i] = -1;
+        for (i = 0; i < (int)EXCLUDED_CLASSES; i++)
+        {
+            m_index[ClassNameHash(s_szExcludedClasses[i], m_dwSeed) & (EXCLUDED_SLOTS - 1)] = (signed char)i;
+        }
+    }
+};
+
+static constexpr ExclusionTable s_Exclusions;
+
+inline BOOL IsExcludedClassName(LPCWSTR szClass)
+{
+    int i = s_Exclusions.m_index[ClassNameHash(szClass, s_Exclusions.m_dwSeed) & (EXCLUDED_SLOTS - 1)];
+    if (i < 0) return false;
+    LPCWSTR p = s_szExcludedClasses[i];
+    for (; *szClass != '\0'; szClass++, p++)
+    {
+        WCHAR a = *szClass, b = *p;
+        if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+        if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+        if (a != b) return false;
+    }
+    return *p == '\0';
+}
+
+//
+// true for a window of an excluded class. verdicts is CLASS_VERDICTS
+// entries of the atom shifted left one, and 1 if the class is excluded;
+// each is written whole, so any number of threads can share them.
+//
+inline BOOL IsExcludedClass(HWND hwnd, LONG volatile * verdicts)
+{
+    ATOM atom = (ATOM)GetClassWord(hwnd, GCW_ATOM);
+    if (atom == 0) return false;
+    LONG volatile & entry = verdicts[atom & (CLASS_VERDICTS - 1)];
+    LONG verdict = entry;
+    if ((verdict >> 1) == (LONG)atom) return verdict & 1;
+
+    WCHAR szClass[64];
+    if (GetClassNameW(hwnd, szClass, 64) == 0) return false;
+    BOOL excluded = IsExcludedClassName(szClass);
+    InterlockedExchange(&entry, ((LONG)atom << 1) | (excluded ? 1 : 0));
+    return excluded;
+}
@@ -0,0 +1,442 @@
+// MonitorKeeperDiagnostics.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// Everything MonitorKeeper logs is also kept in MonitorKeeper.diag beside
+// the executable, with the window, process, monitor count and session it
+// was about, so "why did this window move" can be answered after the fact.
+// The file is a DiagHeader followed by a ring of DiagRecords, mapped into
+// memory. Writes are under _LogLock.
+//
+// Each record links back to the record before it with the same event, and
+// to the one before it with a window in the same hash bucket. The heads of
+// those chains are in the header, so the records for one window or one
+// kind of event are found without reading the others. Records are written
+// in time order, so a range of time is found by a binary search. A chain
+// ends at record 0, or at the first record that has been overwritten.
+//
+// "MonitorKeeper.exe /log window=1A2B3C event=restore minutes=30" writes
+// the records that match to MonitorKeeper.log.csv, see RunDiagnosticsQuery.
+//
+
+#include "MonitorKeeperEngine.h"
+
+#define DIAG_QUERYMAX 100000        // records /log writes unless max= says otherwise
+
+static const LPCTSTR s_szDiagEvents[DIAG_NUMEVENTS] = {
+    _T("message"), _T("save"), _T("pass"), _T("restore"), _T("monitors"),
+    _T("session"), _T("power"), _T("storm"), _T("enforce"), _T("settings")
+};
+
+LPCTSTR DiagEventName(int event)
+{
+    return event >= 0 && event < DIAG_NUMEVENTS ? s_szDiagEvents[event] : _T("?");
+}
+
+static BOOL DiagFileName(LPTSTR szFile, LPCTSTR szSuffix)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    int len = lstrlen(szSettings);
+    if (len < 4 || len - 3 + lstrlen(szSuffix) >= MAX_PATH) return false;
+    lstrcpyn(szFile, szSettings, len - 3 + 1);      // keeps the '.'
+    lstrcat(szFile, szSuffix);
+    return true;
+}
+
+static DWORD DiagBucket(DWORD hwnd)
+{
+    return (DWORD)(hwnd * 2654435761u) >> (32 - DIAG_BUCKETBITS);
+}
+
+static DiagRecord * DiagRecords(const DiagHeader * diag)
+{
+    return (DiagRecord *)(diag + 1);
+}
+
+static DWORD DiagSize(DWORD capacity)
+{
+    return sizeof(DiagHeader) + capacity * sizeof(DiagRecord);
+}
+
+//
+// map a diagnostics log of capacity records, starting it again if it isn't
+// one we wrote. hFile may be INVALID_HANDLE_VALUE for one in the pagefile.
+//
+DiagHeader * CreateDiagnostics(HANDLE hFile, DWORD capacity, HANDLE * phMapping)
+{
+    DWORD size = DiagSize(capacity);
+    HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE, 0, size, NULL);
+    if (hMapping == NULL) return NULL;
+    DiagHeader * diag = (DiagHeader *)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (diag == NULL) {
+        CloseHandle(hMapping);
+        return NULL;
+    }
+    if (diag->m_dwMagic != DIAG_MAGIC || diag->m_dwVersion != DIAG_VERSION ||
+        diag->m_dwCapacity != capacity || diag->m_dwRecordSize != sizeof(DiagRecord))
+    {
+        // records from another layout could look valid, so clear them all.
+        ZeroMemory(diag, size);
+        diag->m_dwVersion = DIAG_VERSION;
+        diag->m_dwCapacity = capacity;
+        diag->m_dwRecordSize = sizeof(DiagRecord);
+        diag->m_dwMagic = DIAG_MAGIC;
+    }
+    *phMapping = hMapping;
+    return diag;
+}
+
+//
+// the writer's side. Readers may be copying the slot being reused, so its
+// m_nSequence is 0 while it changes.
+//
+void AppendDiagnostic(DiagHeader * diag, DiagRecord & record)
+{
+    DWORD seq = (DWORD)diag->m_nLast + 1;
+    DiagRecord & r = DiagRecords(diag)[(seq - 1) % diag->m_dwCapacity];
+    InterlockedExchange(&r.m_nSequence, 0);
+
+    if (record.m_wEvent >= DIAG_NUMEVENTS) record.m_wEvent = DIAG_MESSAGE;
+    DWORD bucket = DiagBucket(record.m_dwHwnd);
+    record.m_nSequence = 0;
+    record.m_dwPrevEvent = diag->m_dwEventHeads[record.m_wEvent];
+    record.m_dwPrevWindow = record.m_dwHwnd != 0 ? diag->m_dwWindowHeads[bucket] : 0;
+    r = record;
+    InterlockedExchange(&r.m_nSequence, (LONG)seq);
+
+    diag->m_dwEventHeads[record.m_wEvent] = seq;
+    if (record.m_dwHwnd != 0) diag->m_dwWindowHeads[bucket] = seq;
+    InterlockedExchange(&diag->m_nLast, (LONG)seq);
+}
+
+void WriteDiagnostic(DiagHeader * diag, int event, HWND hwnd, DWORD pid, LPCTSTR str)
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    DiagRecord r;
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULARGE_INTEGER t;
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    r.m_ftTime = t.QuadPart;
+    r.m_wEvent = (WORD)event;
+    r.m_wMonitors = (WORD)inst._NumMonitors;
+    r.m_dwHwnd = (DWORD)(UINT_PTR)hwnd;
+    r.m_dwProcessId = pid;
+    r.m_dwSession = inst._Session;
+    lstrcpyn(r.m_szText, str, DIAG_TEXTLEN);
+    int len = lstrlen(r.m_szText);
+    while (len > 0 && (r.m_szText[len - 1] == '\n' || r.m_szText[len - 1] == '\r')) r.m_szText[--len] = '\0';
+    AppendDiagnostic(diag, r);
+}
+
+//
+// copy out record seq, or return false if it has been overwritten or is
+// being written.
+//
+static BOOL ReadDiagRecord(const DiagHeader * diag, DWORD seq, DiagRecord & out)
+{
+    if (seq == 0 || seq > (DWORD)diag->m_nLast) return false;
+    const DiagRecord & r = DiagRecords(diag)[(seq - 1) % diag->m_dwCapacity];
+    if ((DWORD)r.m_nSequence != seq) return false;
+    MemoryBarrier();
+    out = *(const DiagRecord *)&r;
+    MemoryBarrier();
+    return (DWORD)r.m_nSequence == seq;
+}
+
+static BOOL DiagMatches(const DiagRecord & r, const DiagQuery & query)
+{
+    return (query.m_dwHwnd == 0 || r.m_dwHwnd == query.m_dwHwnd) &&
+        (query.m_dwProcessId == 0 || r.m_dwProcessId == query.m_dwProcessId) &&
+        (query.m_nEvent < 0 || r.m_wEvent == query.m_nEvent) &&
+        (query.m_ftTo == 0 || r.m_ftTime <= query.m_ftTo);
+}
+
+//
+// the newest record not after ftTo, or 0. The oldest slot may be being
+// overwritten, which only moves the search towards newer records.
+//
+static DWORD FindDiagTime(const DiagHeader * diag, DWORD first, DWORD last, ULONGLONG ftTo)
+{
+    DWORD found = 0;
+    DiagRecord r;
+    while (first <= last)
+    {
+        DWORD mid = first + (last - first) / 2;
+        BOOL read = ReadDiagRecord(diag, mid, r);
+        if (!read || r.m_ftTime <= ftTo) {
+            if (read) found = mid;
+            first = mid + 1;
+        }
+        else {
+            last = mid - 1;
+        }
+    }
+    return found;
+}
+
+//
+// copy out up to max records that match, newest first. Returns the count.
+//
+int QueryDiagnostics(const DiagHeader * diag, const DiagQuery & query, DiagRecord * records, int max)
+{
+    DWORD last = (DWORD)diag->m_nLast;
+    if (last == 0 || max <= 0) return 0;
+    DWORD first = last > diag->m_dwCapacity ? last - diag->m_dwCapacity + 1 : 1;
+    int count = 0;
+    DiagRecord r;
+
+    if (query.m_dwHwnd != 0 || (query.m_nEvent >= 0 && query.m_nEvent < DIAG_NUMEVENTS)) {
+        // follow the window's chain, or the event's.
+        BOOL byWindow = query.m_dwHwnd != 0;
+        DWORD seq = byWindow ? diag->m_dwWindowHeads[DiagBucket(query.m_dwHwnd)] : diag->m_dwEventHeads[query.m_nEvent];
+        while (count < max && ReadDiagRecord(diag, seq, r) && r.m_ftTime >= query.m_ftFrom)
+        {
+            if (DiagMatches(r, query)) records[count++] = r;
+            DWORD prev = byWindow ? r.m_dwPrevWindow : r.m_dwPrevEvent;
+            if (prev >= seq) break;
+            seq = prev;
+        }
+        return count;
+    }
+
+    DWORD seq = query.m_ftTo != 0 ? FindDiagTime(diag, first, last, query.m_ftTo) : last;
+    while (seq >= first && count < max && ReadDiagRecord(diag, seq, r) && r.m_ftTime >= query.m_ftFrom)
+    {
+        if (DiagMatches(r, query)) records[count++] = r;
+        seq--;
+    }
+    return count;
+}
+
+//
+// open MonitorKeeper.diag. [Diagnostics] Records=0 turns it off.
+//
+void OpenDiagnostics()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    TCHAR szFile[MAX_PATH];
+    if (!DiagFileName(szFile, _T("diag"))) return;
+    UINT capacity = GetPrivateProfileInt(_T("Diagnostics"), _T("Records"), DIAG_CAPACITY, inst._SettingsFile);
+    if (capacity == 0) return;
+    capacity = min(max(capacity, (UINT)1024), (UINT)DIAG_MAXCAPACITY);
+
+    HANDLE h = CreateFile(szFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return;
+    HANDLE hMapping;
+    DiagHeader * diag = CreateDiagnostics(h, capacity, &hMapping);
+    if (diag == NULL) {
+        CloseHandle(h);
+        return;
+    }
+    AcquireSRWLockExclusive(&inst._LogLock);
+    inst._DiagFile = h;
+    inst._DiagMapping = hMapping;
+    inst._Diag = diag;
+    ReleaseSRWLockExclusive(&inst._LogLock);
+}
+
+void CloseDiagnostics()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    AcquireSRWLockExclusive(&inst._LogLock);
+    if (inst._Diag != NULL) {
+        UnmapViewOfFile(inst._Diag);
+        CloseHandle(inst._DiagMapping);
+        CloseHandle(inst._DiagFile);
+    }
+    inst._Diag = NULL;
+    inst._DiagMapping = NULL;
+    inst._DiagFile = INVALID_HANDLE_VALUE;
+    ReleaseSRWLockExclusive(&inst._LogLock);
+}
+
+static BOOL ParseNumber(LPCTSTR sz, int base, DWORD & value)
+{
+    value = 0;
+    if (*sz == '\0') return false;
+    for (; *sz != '\0'; sz++)
+    {
+        TCHAR c = *sz;
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else return false;
+        value = value * base + digit;
+    }
+    return true;
+}
+
+//
+// local time, YYYY-MM-DD with an optional THH:MM or THH:MM:SS, to UTC.
+//
+static BOOL ParseDiagTime(LPCTSTR sz, ULONGLONG & ft)
+{
+    TCHAR part[8];
+    int fields[6] = { 0, 0, 0, 0, 0, 0 };
+    static const int lengths[6] = { 4, 2, 2, 2, 2, 2 };
+    static const TCHAR separators[6] = { '-', '-', 'T', ':', ':', '\0' };
+    int i;
+    for (i = 0; i < 6; i++)
+    {
+        lstrcpyn(part, sz, lengths[i] + 1);
+        DWORD value;
+        if (lstrlen(part) != lengths[i] || !ParseNumber(part, 10, value)) return false;
+        fields[i] = (int)value;
+        sz += lengths[i];
+        if (*sz == '\0') break;
+        if (*sz != separators[i] && !(separators[i] == 'T' && *sz == ' ')) return false;
+        sz++;
+    }
+    if (i < 2) return false;
+    SYSTEMTIME st;
+    ZeroMemory(&st, sizeof(st));
+    st.wYear = (WORD)fields[0];
+    st.wMonth = (WORD)fields[1];
+    st.wDay = (WORD)fields[2];
+    st.wHour = (WORD)fields[3];
+    st.wMinute = (WORD)fields[4];
+    st.wSecond = (WORD)fields[5];
+    FILETIME local, utc;
+    if (!SystemTimeToFileTime(&st, &local) || !LocalFileTimeToFileTime(&local, &utc)) return false;
+    ULARGE_INTEGER t;
+    t.LowPart = utc.dwLowDateTime;
+    t.HighPart = utc.dwHighDateTime;
+    ft = t.QuadPart;
+    return true;
+}
+
+//
+// window=hex process=n event=name from=time to=time minutes=n max=n
+//
+static BOOL ParseDiagQuery(LPCTSTR szArgs, DiagQuery & query, int & max)
+{
+    ZeroMemory(&query, sizeof(query));
+    query.m_nEvent = -1;
+    max = DIAG_QUERYMAX;
+    TCHAR arg[64];
+    while (*szArgs != '\0')
+    {
+        while (*szArgs == ' ') szArgs++;
+        int len = 0;
+        while (szArgs[len] != '\0' && szArgs[len] != ' ') len++;
+        if (len == 0) break;
+        if (len >= 64) return false;
+        lstrcpyn(arg, szArgs, len + 1);
+        szArgs += len;
+
+        LPTSTR value = arg;
+        while (*value != '\0' && *value != '=') value++;
+        if (*value == '\0') return false;
+        *value++ = '\0';
+
+        DWORD n;
+        if (lstrcmpi(arg, _T("window")) == 0) {
+            if (!ParseNumber(value, 16, query.m_dwHwnd)) return false;
+        }
+        else if (lstrcmpi(arg, _T("process")) == 0) {
+            if (!ParseNumber(value, 10, query.m_dwProcessId)) return false;
+        }
+        else if (lstrcmpi(arg, _T("event")) == 0) {
+            int e;
+            for (e = 0; e < DIAG_NUMEVENTS && lstrcmpi(value, s_szDiagEvents[e]) != 0; e++);
+            if (e == DIAG_NUMEVENTS) return false;
+            query.m_nEvent = e;
+        }
+        else if (lstrcmpi(arg, _T("from")) == 0) {
+            if (!ParseDiagTime(value, query.m_ftFrom)) return false;
+        }
+        else if (lstrcmpi(arg, _T("to")) == 0) {
+            if (!ParseDiagTime(value, query.m_ftTo)) return false;
+        }
+        else if (lstrcmpi(arg, _T("minutes")) == 0) {
+            if (!ParseNumber(value, 10, n)) return false;
+            FILETIME ft;
+            GetSystemTimeAsFileTime(&ft);
+            ULARGE_INTEGER t;
+            t.LowPart = ft.dwLowDateTime;
+            t.HighPart = ft.dwHighDateTime;
+            query.m_ftFrom = t.QuadPart - (ULONGLONG)n * 600000000;
+        }
+        else if (lstrcmpi(arg, _T("max")) == 0) {
+            if (!ParseNumber(value, 10, n) || n == 0) return false;
+            max = (int)min(n, (DWORD)DIAG_MAXCAPACITY);
+        }
+        else return false;
+    }
+    return true;
+}
+
+static int WriteDiagLine(char * out, const DiagRecord & r)
+{
+    ULARGE_INTEGER t;
+    t.QuadPart = r.m_ftTime;
+    FILETIME utc, local;
+    utc.dwLowDateTime = t.LowPart;
+    utc.dwHighDateTime = t.HighPart;
+    FileTimeToLocalFileTime(&utc, &local);
+    SYSTEMTIME st;
+    FileTimeToSystemTime(&local, &st);
+
+    // the text is quoted, so a quote in a window class becomes an apostrophe.
+    WCHAR text[DIAG_TEXTLEN];
+    lstrcpynW(text, r.m_szText, DIAG_TEXTLEN);
+    int i;
+    for (i = 0; text[i] != '\0'; i++) if (text[i] == '"') text[i] = '\'';
+    return wsprintfA(out, "%04d-%02d-%02d %02d:%02d:%02d.%03d,%S,%08X,%u,%d,%s,\"%S\"\r\n",
+        st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+        DiagEventName(r.m_wEvent), r.m_dwHwnd, r.m_dwProcessId, r.m_wMonitors,
+        r.m_dwSession == SESSION_REMOTE ? "remote" : "console", text);
+}
+
+//
+// MonitorKeeper.exe /log [window=hex] [process=n] [event=name] [from=time]
+// [to=time] [minutes=n] [max=n], the records that match in
+// MonitorKeeper.log.csv, oldest first. Runs while MonitorKeeper does.
+// Returns the number of records, or -1.
+//
+int RunDiagnosticsQuery(LPCTSTR szArgs)
+{
+    DiagQuery query;
+    int max;
+    TCHAR szDiag[MAX_PATH];
+    TCHAR szOut[MAX_PATH];
+    if (!ParseDiagQuery(szArgs, query, max)) return -1;
+    if (!DiagFileName(szDiag, _T("diag")) || !DiagFileName(szOut, _T("log.csv"))) return -1;
+
+    HANDLE h = CreateFile(szDiag, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return -1;
+    HANDLE hMapping = CreateFileMapping(h, NULL, PAGE_READONLY, 0, 0, NULL);
+    const DiagHeader * diag = hMapping != NULL ? (const DiagHeader *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    DWORD size = GetFileSize(h, NULL);
+    int count = -1;
+    if (diag != NULL && size >= sizeof(DiagHeader) && diag->m_dwMagic == DIAG_MAGIC &&
+        diag->m_dwVersion == DIAG_VERSION && diag->m_dwRecordSize == sizeof(DiagRecord) &&
+        diag->m_dwCapacity != 0 && diag->m_dwCapacity <= DIAG_MAXCAPACITY && size >= DiagSize(diag->m_dwCapacity))
+    {
+        HANDLE hOut = CreateFile(szOut, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+        if (hOut != INVALID_HANDLE_VALUE) {
+            DiagRecord * records = new DiagRecord[min(max, (int)diag->m_dwCapacity)];
+            count = QueryDiagnostics(diag, query, records, min(max, (int)diag->m_dwCapacity));
+            char line[DIAG_TEXTLEN * 3 + 128];
+            DWORD written;
+            int len = wsprintfA(line, "time,event,window,process,monitors,session,text\r\n");
+            WriteFile(hOut, line, len, &written, NULL);
+            int i;
+            for (i = count - 1; i >= 0; i--)
+            {
+                WriteFile(hOut, line, WriteDiagLine(line, records[i]), &written, NULL);
+            }
+            delete[] records;
+            CloseHandle(hOut);
+        }
+    }
+    if (diag != NULL) UnmapViewOfFile(diag);
+    if (hMapping != NULL) CloseHandle(hMapping);
+    CloseHandle(h);
+    return count;
+}
@@ -0,0 +1,1500 @@
+// MonitorKeeperEngine.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// Saving and restoring window placements, see MonitorKeeperEngine.h.
+//
+
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperApi.h"
+#include "MonitorKeeperClasses.h"
+
+
+/*static*/ DWORD volatile SavedWindowData::s_dwStamp = 0;
+/*static*/ InstanceData  InstanceData::g_Instance;
+static LONG volatile s_ClassVerdicts[CLASS_VERDICTS];     // see IsExcludedClass
+
+
+//
+// SetWindowPlacement on each window in turn, without waiting for them.
+//
+class SequentialRestore : public RestoreStrategy {
+public:
+    virtual LPCTSTR Name() { return _T("sequential"); }
+
+    virtual int Restore(RestoreItem * items, int count)
+    {
+        int calls = 0;
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            calls += SavedWindowData::ApplyPlacement(items[i].m_hwnd, &items[i].m_place, WPF_ASYNCWINDOWPLACEMENT);
+        }
+        return calls;
+    }
+};
+
+//
+// windows that are going back to a normal (not maximized or minimized) state,
+// and are in one now, are moved together with DeferWindowPos. The rest are
+// done as in SequentialRestore.
+//
+class DeferredRestore : public RestoreStrategy {
+public:
+    virtual LPCTSTR Name() { return _T("deferred"); }
+
+    virtual int Restore(RestoreItem * items, int count)
+    {
+        int calls = 0;
+        int * batch = new int[count];
+        int numBatch = 0;
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            WINDOWPLACEMENT * place = &items[i].m_place;
+            if (place->showCmd != SW_MAXIMIZE && place->showCmd != SW_MINIMIZE &&
+                place->showCmd != SW_SHOWMINIMIZED) {
+                calls++;
+                DWORD dwStyle = (DWORD)GetWindowLong(items[i].m_hwnd, GWL_STYLE);
+                if ((dwStyle & (WS_MAXIMIZE | WS_MINIMIZE)) == 0) {
+                    batch[numBatch++] = i;
+                    continue;
+                }
+            }
+            calls += SavedWindowData::ApplyPlacement(items[i].m_hwnd, place, WPF_ASYNCWINDOWPLACEMENT);
+        }
+
+        if (numBatch > 0) {
+            HDWP hdwp = BeginDeferWindowPos(numBatch);
+            for (i = 0; i < numBatch && hdwp != NULL; i++)
+            {
+                //
+                // the placement is relative to the primary monitor's work area,
+                // DeferWindowPos wants screen coordinates. Tool windows' are
+                // already, see IndexSavedWindow.
+                HWND hwnd = items[batch[i]].m_hwnd;
+                RECT r = items[batch[i]].m_place.rcNormalPosition;
+                if ((GetWindowLong(hwnd, GWL_EXSTYLE) & WS_EX_TOOLWINDOW) == 0) {
+                    OffsetRect(&r, InstanceData::g_Instance._WorkOffset.x, InstanceData::g_Instance._WorkOffset.y);
+                }
+                hdwp = DeferWindowPos(hdwp, hwnd, NULL, r.left, r.top, r.right - r.left, r.bottom - r.top,
+                    SWP_NOZORDER | SWP_NOOWNERZORDER | SWP_NOACTIVATE);
+            }
+            if (hdwp != NULL) {
+                calls++;
+                EndDeferWindowPos(hdwp);
+            }
+            else {
+                // the batch is gone, do them one at a time.
+                for (i = 0; i < numBatch; i++)
+                {
+                    calls += SavedWindowData::ApplyPlacement(items[batch[i]].m_hwnd, &items[batch[i]].m_place, WPF_ASYNCWINDOWPLACEMENT);
+                }
+            }
+        }
+        delete[] batch;
+        return calls;
+    }
+};
+
+//
+// sequential, but with each application's windows one after the other, so
+// its message queue sees them together.
+//
+class ByProcessRestore : public RestoreStrategy {
+public:
+    virtual LPCTSTR Name() { return _T("byprocess"); }
+
+    static int __cdecl Compare(const void * a, const void * b)
+    {
+        DWORD pa = ((const RestoreItem *)a)->m_dwProcessId;
+        DWORD pb = ((const RestoreItem *)b)->m_dwProcessId;
+        return pa < pb ? -1 : (pa > pb ? 1 : 0);
+    }
+
+    virtual int Restore(RestoreItem * items, int count)
+    {
+        int calls = 0;
+        int i;
+        qsort(items, count, sizeof(RestoreItem), Compare);
+        for (i = 0; i < count; i++)
+        {
+            calls += SavedWindowData::ApplyPlacement(items[i].m_hwnd, &items[i].m_place, WPF_ASYNCWINDOWPLACEMENT);
+        }
+        return calls;
+    }
+};
+
+//
+// wait for each window to be placed, spread over RESTORE_THREADS threads so
+// one slow application only holds up its share. Hung windows, and our own,
+// are not waited for; the window thread is waiting here and can't answer.
+// Nor is a thread that takes longer than RESTORE_WAITTIME, it finishes on
+// its own.
+//
+class ParallelRestore : public RestoreStrategy {
+public:
+    virtual LPCTSTR Name() { return _T("parallel"); }
+
+    //
+    // shared by a thread and Restore, deleted by whichever is done with it
+    // last, so a thread given up on can still finish.
+    struct Work {
+        RestoreItem * m_items;          // a copy, the caller's go when Restore returns
+        int					m_nCount;
+        int					m_nCalls;
+        LONG volatile		m_nRefs;
+    };
+
+    static void Release(Work * work)
+    {
+        if (InterlockedDecrement(&work->m_nRefs) != 0) return;
+        delete[] work->m_items;
+        delete work;
+    }
+
+    static DWORD WINAPI ThreadProc(LPVOID param)
+    {
+        Work * work = (Work *)param;
+        DWORD self = GetCurrentProcessId();
+        int i;
+        for (i = 0; i < work->m_nCount; i++)
+        {
+            HWND hwnd = work->m_items[i].m_hwnd;
+            UINT flags = work->m_items[i].m_dwProcessId == self || IsHungAppWindow(hwnd) ? WPF_ASYNCWINDOWPLACEMENT : 0;
+            work->m_nCalls += 1 + SavedWindowData::ApplyPlacement(hwnd, &work->m_items[i].m_place, flags);
+        }
+        Release(work);
+        return 0;
+    }
+
+    virtual int Restore(RestoreItem * items, int count)
+    {
+        Work * work[RESTORE_THREADS];
+        HANDLE threads[RESTORE_THREADS];
+        Work * waiting[RESTORE_THREADS];
+        int numThreads = 0;
+        int calls = 0;
+        int per = (count + RESTORE_THREADS - 1) / RESTORE_THREADS;
+        int i;
+        for (i = 0; i < RESTORE_THREADS && i * per < count; i++)
+        {
+            work[i] = new Work;
+            work[i]->m_nCount = min(per, count - i * per);
+            work[i]->m_items = new RestoreItem[work[i]->m_nCount];
+            CopyMemory(work[i]->m_items, items + i * per, work[i]->m_nCount * sizeof(RestoreItem));
+            work[i]->m_nCalls = 0;
+            work[i]->m_nRefs = 2;
+            threads[numThreads] = CreateThread(NULL, 0, ThreadProc, work[i], 0, NULL);
+            if (threads[numThreads] == NULL) {
+                // do it ourselves
+                ThreadProc(work[i]);
+                calls += work[i]->m_nCalls;
+                Release(work[i]);
+            }
+            else {
+                waiting[numThreads++] = work[i];
+            }
+        }
+
+        //
+        // windows of other threads in our process send to them, which only
+        // gets through while we look at sent messages. Timers and posted
+        // messages wait, they may want the table lock we hold.
+        DWORD start = GetTickCount();
+        while (numThreads > 0)
+        {
+            DWORD elapsed = GetTickCount() - start;
+            if (elapsed >= RESTORE_WAITTIME) break;
+            DWORD result = MsgWaitForMultipleObjects(numThreads, threads, false, RESTORE_WAITTIME - elapsed, QS_SENDMESSAGE);
+            if (result >= WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + (DWORD)numThreads) {
+                int done = result - WAIT_OBJECT_0;
+                calls += waiting[done]->m_nCalls;
+                Release(waiting[done]);
+                CloseHandle(threads[done]);
+                numThreads--;
+                threads[done] = threads[numThreads];
+                waiting[done] = waiting[numThreads];
+            }
+            else if (result == WAIT_OBJECT_0 + (DWORD)numThreads) {
+                MSG msg;
+                PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE | PM_QS_SENDMESSAGE);
+            }
+            else {
+                break;
+            }
+        }
+        int j;
+        for (j = 0; j < numThreads; j++)
+        {
+            // still placing windows; its calls aren't counted.
+            Release(waiting[j]);
+            CloseHandle(threads[j]);
+        }
+        return calls;
+    }
+};
+
+static SequentialRestore s_SequentialRestore;
+static DeferredRestore s_DeferredRestore;
+static ByProcessRestore s_ByProcessRestore;
+static ParallelRestore s_ParallelRestore;
+
+//
+// indexed by RESTORE_ value
+//
+static RestoreStrategy * s_RestoreStrategies[NUM_RESTORESTRATEGIES] = {
+    &s_SequentialRestore,
+    &s_DeferredRestore,
+    &s_ByProcessRestore,
+    &s_ParallelRestore,
+};
+
+RestoreStrategy * GetRestoreStrategy(int strategy)
+{
+    if (strategy < 0 || strategy >= NUM_RESTORESTRATEGIES) strategy = RESTORE_SEQUENTIAL;
+    return s_RestoreStrategies[strategy];
+}
+
+int FindRestoreStrategy(LPCTSTR name)
+{
+    int i;
+    for (i = 0; i < NUM_RESTORESTRATEGIES; i++)
+    {
+        if (lstrcmpi(s_RestoreStrategies[i]->Name(), name) == 0) return i;
+    }
+    return -1;
+}
+
+//
+// restore all the top level windows using the selected strategy, then any
+// MDI children, and record how it went.
+//
+void InstanceData::RestoreWindowPositions(int monitors)
+{
+    int nStrategy = CurrentSettings()->m_nRestoreStrategy;
+    RestoreStrategy * strategy = GetRestoreStrategy(nStrategy);
+    RestoreItem * items = new RestoreItem[TotalSlots()];
+    int count = 0;
+    int calls = 0;
+    TraceRestore(monitors, _Session);
+
+    LARGE_INTEGER start, end, freq;
+    QueryPerformanceCounter(&start);
+    int s, i;
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        WindowTable & shard = _Shards[s];
+        for (i = 0; i < shard.m_nLength; i++)
+        {
+            // don't count to the point we rollover
+            if (shard.m_data[i].m_hwnd != NULL && shard.m_data[i].m_nUnusedCount <= 2)
+            {
+                WINDOWPLACEMENT * place = shard.m_data[i].RestoreTarget(monitors, _Session, calls);
+                if (place != NULL) {
+                    items[count].m_hwnd = shard.m_data[i].m_hwnd;
+                    items[count].m_dwProcessId = shard.m_data[i].m_dwProcessId;
+                    items[count].m_place = *place;
+                    count++;
+                }
+            }
+        }
+    }
+    calls += strategy->Restore(items, count);
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+
+    //
+    // MDI children go once all the frames have been placed.
+    for (i = 0; i < _MdiFramesLength; i++)
+    {
+        if (_MdiFrames[i].m_hwndFrame != NULL && _MdiFrames[i].m_nUnusedCount <= 2)
+        {
+            _MdiFrames[i].RestoreChildren(monitors, _Session);
+        }
+    }
+
+    //
+    // see if the windows are where we asked. Those placed asynchronously may
+    // not have got there yet.
+    int mismatched = 0;
+    for (i = 0; i < count; i++)
+    {
+        WINDOWPLACEMENT now;
+        now.length = sizeof(now);
+        if (!GetWindowPlacement(items[i].m_hwnd, &now)) continue;
+        const RECT & want = items[i].m_place.rcNormalPosition;
+        BOOL wrong = now.rcNormalPosition.left != want.left || now.rcNormalPosition.top != want.top ||
+            now.rcNormalPosition.right != want.right || now.rcNormalPosition.bottom != want.bottom ||
+            ((now.showCmd == SW_SHOWMAXIMIZED) != (items[i].m_place.showCmd == SW_SHOWMAXIMIZED));
+        if (wrong) mismatched++;
+        TCHAR sz[96];
+        wsprintf(sz, _T("Restore to x=%d, y=%d, show=%s%s\n"), want.left, want.top,
+            TranslateShowCommand(items[i].m_place.showCmd), wrong ? _T(", not there yet") : _T(""));
+        LogEvent(DIAG_RESTORE, items[i].m_hwnd, items[i].m_dwProcessId, sz);
+    }
+    StartAccuracySampling(items, count, _NumMonitors, monitors);
+    delete[] items;
+
+    RestoreMetrics & metrics = _RestoreMetrics[nStrategy];
+    metrics.m_nRestores++;
+    metrics.m_nWindows = count;
+    metrics.m_nMicroseconds = (int)((end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart);
+    metrics.m_nForeignCalls = calls;
+    metrics.m_nMismatched = mismatched;
+
+    MetricsRecord & minute = CurrentMinute();
+    if (minute.m_wRestores < 0xffff) minute.m_wRestores++;
+    minute.m_dwRestoreUs += (DWORD)metrics.m_nMicroseconds;
+    minute.m_dwRestoreMaxUs = max(minute.m_dwRestoreMaxUs, (DWORD)metrics.m_nMicroseconds);
+
+    TCHAR sz[160];
+    wsprintf(sz, _T("Restore strategy=%s monitors=%d windows=%d us=%d calls=%d mismatched=%d\n"),
+        strategy->Name(), monitors, count, metrics.m_nMicroseconds, calls, mismatched);
+    LogEvent(DIAG_RESTORE, NULL, 0, sz);
+}
+
+static int Distance(LONG a, LONG b)
+{
+    return a > b ? a - b : b - a;
+}
+
+//
+// pixels between where a window was sent and where it is, all four edges
+// added. Zero also needs the maximized and minimized state to match.
+//
+static int PlacementError(const WINDOWPLACEMENT & want, const WINDOWPLACEMENT & now, BOOL & showMismatch)
+{
+    BOOL wantMax = want.showCmd == SW_SHOWMAXIMIZED;
+    BOOL wantMin = want.showCmd == SW_MINIMIZE || want.showCmd == SW_SHOWMINIMIZED;
+    showMismatch = wantMax != (now.showCmd == SW_SHOWMAXIMIZED) ||
+        wantMin != (now.showCmd == SW_SHOWMINIMIZED);
+    return Distance(now.rcNormalPosition.left, want.rcNormalPosition.left) +
+        Distance(now.rcNormalPosition.top, want.rcNormalPosition.top) +
+        Distance(now.rcNormalPosition.right, want.rcNormalPosition.right) +
+        Distance(now.rcNormalPosition.bottom, want.rcNormalPosition.bottom);
+}
+
+//
+// the executable name, without the path, of the application owning hwnd.
+// "?" if we aren't allowed to look.
+//
+void WindowAppName(HWND hwnd, LPTSTR szName, int len)
+{
+    TCHAR szPath[MAX_PATH];
+    LPCTSTR szApp = _T("?");
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, pid);
+    if (hProcess != NULL) {
+        DWORD pathLen = MAX_PATH;
+        if (QueryFullProcessImageName(hProcess, 0, szPath, &pathLen)) {
+            szApp = szPath + pathLen;
+            while (szApp > szPath && szApp[-1] != '\\') szApp--;
+        }
+        CloseHandle(hProcess);
+    }
+    lstrcpyn(szName, szApp, len);
+}
+
+struct AccuracyProcess {
+    DWORD				m_dwProcessId;
+    TCHAR				m_szApp[40];
+};
+
+static AccuracyProcess s_AccuracyProcesses[ACCURACY_PROCESSES];
+
+//
+// looking up an executable name opens the process, so it is done once per
+// process rather than for every window of every restore. A process id that
+// is reused while its entry is still here keeps the old name. With the table
+// lock held exclusively.
+//
+static LPCTSTR AccuracyAppName(HWND hwnd, DWORD pid)
+{
+    AccuracyProcess & entry = s_AccuracyProcesses[(pid / 4) & (ACCURACY_PROCESSES - 1)];
+    if (entry.m_dwProcessId != pid || entry.m_szApp[0] == '\0') {
+        WindowAppName(hwnd, entry.m_szApp, 40);
+        entry.m_dwProcessId = pid;
+    }
+    return entry.m_szApp;
+}
+
+//
+// the entry for the application owning hwnd and this monitor change. Once
+// the table is full, the entry that has gone longest without a restore is
+// given up for it; -1 if every entry is in use by this restore.
+//
+int InstanceData::FindAccuracyEntry(HWND hwnd, DWORD pid, int from, int to)
+{
+    LPCTSTR szName = AccuracyAppName(hwnd, pid);
+
+    int i;
+    for (i = 0; i < _NumAccuracyEntries; i++)
+    {
+        AccuracyEntry & entry = _AccuracyEntries[i];
+        if (entry.m_nFromMonitors == from && entry.m_nToMonitors == to &&
+            lstrcmpi(entry.m_szApp, szName) == 0) {
+            entry.m_dwLastRestore = _AccuracyRestores;
+            return i;
+        }
+    }
+
+    int index = _NumAccuracyEntries;
+    if (index >= MAX_ACCURACYENTRIES) {
+        index = -1;
+        for (i = 0; i < _NumAccuracyEntries; i++)
+        {
+            if (_AccuracyEntries[i].m_dwLastRestore == _AccuracyRestores) continue;
+            if (index < 0 || (int)(_AccuracyEntries[i].m_dwLastRestore - _AccuracyEntries[index].m_dwLastRestore) < 0) index = i;
+        }
+        if (index < 0) return -1;
+    } else {
+        _NumAccuracyEntries++;
+    }
+
+    AccuracyEntry & entry = _AccuracyEntries[index];
+    ZeroMemory(&entry, sizeof(entry));
+    lstrcpy(entry.m_szApp, szName);
+    entry.m_nFromMonitors = from;
+    entry.m_nToMonitors = to;
+    entry.m_dwLastRestore = _AccuracyRestores;
+    return index;
+}
+
+//
+// start watching the windows a restore just sent. Anything still being
+// watched from the restore before is given up on.
+//
+void InstanceData::StartAccuracySampling(const RestoreItem * items, int count, int from, int to)
+{
+    FinishAccuracySampling();
+    if (count == 0) return;
+
+    _AccuracySamples = new AccuracySample[count];
+    _AccuracyRestores++;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        _AccuracySamples[i].m_hwnd = items[i].m_hwnd;
+        _AccuracySamples[i].m_place = items[i].m_place;
+        _AccuracySamples[i].m_nEntry = FindAccuracyEntry(items[i].m_hwnd, items[i].m_dwProcessId, from, to);
+        _AccuracySamples[i].m_bDone = false;
+        if (_AccuracySamples[i].m_nEntry >= 0) _AccuracyEntries[_AccuracySamples[i].m_nEntry].m_nWindows++;
+    }
+    _NumAccuracySamples = count;
+    _AccuracyStart = GetTickCount();
+}
+
+//
+// look at the windows still being watched. Returns FALSE once there are none.
+//
+BOOL InstanceData::SampleAccuracy()
+{
+    if (_NumAccuracySamples == 0) return false;
+
+    int elapsed = (int)(GetTickCount() - _AccuracyStart);
+    int waiting = 0;
+    int i;
+    for (i = 0; i < _NumAccuracySamples; i++)
+    {
+        AccuracySample & sample = _AccuracySamples[i];
+        if (sample.m_bDone) continue;
+
+        WINDOWPLACEMENT now;
+        now.length = sizeof(now);
+        if (!GetWindowPlacement(sample.m_hwnd, &now)) {
+            // closed, it doesn't count either way.
+            sample.m_bDone = true;
+            if (sample.m_nEntry >= 0) _AccuracyEntries[sample.m_nEntry].m_nWindows--;
+            continue;
+        }
+        BOOL showMismatch;
+        if (PlacementError(sample.m_place, now, showMismatch) == 0 && !showMismatch) {
+            sample.m_bDone = true;
+            if (sample.m_nEntry >= 0) {
+                _AccuracyEntries[sample.m_nEntry].m_nCorrected++;
+                _AccuracyEntries[sample.m_nEntry].m_nTotalCorrectMs += elapsed;
+            }
+            continue;
+        }
+        waiting++;
+    }
+
+    if (waiting > 0 && elapsed < ACCURACY_SAMPLETIME) return true;
+    FinishAccuracySampling();
+    return false;
+}
+
+//
+// anything not where it was sent by now is counted as wrong.
+//
+void InstanceData::FinishAccuracySampling()
+{
+    if (_AccuracySamples == NULL) return;
+
+    int wrong = 0;
+    int i;
+    for (i = 0; i < _NumAccuracySamples; i++)
+    {
+        AccuracySample & sample = _AccuracySamples[i];
+        if (sample.m_bDone) continue;
+
+        WINDOWPLACEMENT now;
+        now.length = sizeof(now);
+        if (!GetWindowPlacement(sample.m_hwnd, &now)) continue;
+        BOOL showMismatch;
+        int error = PlacementError(sample.m_place, now, showMismatch);
+        wrong++;
+        if (sample.m_nEntry < 0) continue;
+
+        AccuracyEntry & entry = _AccuracyEntries[sample.m_nEntry];
+        entry.m_nWrong++;
+        if (showMismatch) entry.m_nShowMismatched++;
+        entry.m_nTotalError += error;
+        entry.m_nMaxError = max(entry.m_nMaxError, error);
+    }
+
+    TCHAR sz[96];
+    wsprintf(sz, _T("Accuracy windows=%d wrong=%d ms=%d\n"), _NumAccuracySamples, wrong,
+        (int)(GetTickCount() - _AccuracyStart));
+    LogMessage(sz);
+
+    delete[] _AccuracySamples;
+    _AccuracySamples = NULL;
+    _NumAccuracySamples = 0;
+}
+
+//
+// lock or unlock every window we are tracking where it was last saved.
+// Windows that appear later aren't locked.
+//
+void InstanceData::LockLayout(BOOL lock)
+{
+    int s, i;
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        WindowTable & shard = _Shards[s];
+        for (i = 0; i < shard.m_nLength; i++)
+        {
+            SavedWindowData & data = shard.m_data[i];
+            data.m_bLocked = lock && data.m_hwnd != NULL && data.m_nUnusedCount <= 2;
+            data.m_bDrifted = false;
+            data.m_nEnforceCount = 0;
+        }
+    }
+    _LayoutLocked = lock;
+    _NumDrifted = 0;
+    _DriftOverflow = false;
+    ZeroMemory(&_EnforceMetrics, sizeof(_EnforceMetrics));
+}
+
+//
+// called for every window move, so it only does a lookup unless the window
+// is locked. Returns TRUE if a locked window is now out of place and
+// Enforce should be called once it has had a moment to settle.
+//
+BOOL InstanceData::WindowMoved(HWND hwnd)
+{
+    SavedWindowData * pData = FindSavedWindow(hwnd);
+    if (pData == NULL || !pData->m_bLocked) return false;
+
+    SavedWindowData & data = *pData;
+    WINDOWPLACEMENT * place = data.Placement(_NumMonitors, _Session);
+    if (place == NULL || place->length != sizeof(WINDOWPLACEMENT)) return false;
+    WINDOWPLACEMENT now;
+    now.length = sizeof(now);
+    if (!GetWindowPlacement(hwnd, &now)) return false;
+    BOOL showMismatch;
+    if (PlacementError(*place, now, showMismatch) == 0 && !showMismatch) return false;
+
+    _EnforceMetrics.m_nEvents++;
+    if (!data.m_bDrifted) {
+        data.m_bDrifted = true;
+        if (_NumDrifted < MAX_DRIFTED) {
+            _Drifted[_NumDrifted++] = hwnd;
+        }
+        else {
+            _DriftOverflow = true;
+        }
+    }
+    return true;
+}
+
+//
+// put back the locked windows that have drifted, no more than
+// ENFORCE_MAXPERMINUTE times a minute each so we don't fight an application
+// that insists.
+//
+void InstanceData::Enforce()
+{
+    int corrected = 0;
+    int limited = 0;
+    int calls = 0;
+    DWORD now = GetTickCount();
+    int s, i;
+    int n = _NumDrifted;
+    HWND * drifted = _Drifted;
+    if (_DriftOverflow) {
+        // too many to list, find them all.
+        n = 0;
+        drifted = new HWND[TotalSlots()];
+        for (s = 0; s < WINDOW_SHARDS; s++)
+        {
+            for (i = 0; i < _Shards[s].m_nLength; i++)
+            {
+                if (_Shards[s].m_data[i].m_hwnd != NULL && _Shards[s].m_data[i].m_bDrifted) {
+                    drifted[n++] = _Shards[s].m_data[i].m_hwnd;
+                }
+            }
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        SavedWindowData * pData = FindSavedWindow(drifted[i]);
+        if (pData == NULL) continue;
+        SavedWindowData & data = *pData;
+        if (!data.m_bDrifted) continue;
+        data.m_bDrifted = false;
+        if (!data.m_bLocked) continue;
+
+        if (now - data.m_dwEnforceStart > 60000) {
+            data.m_dwEnforceStart = now;
+            data.m_nEnforceCount = 0;
+        }
+        if (data.m_nEnforceCount >= ENFORCE_MAXPERMINUTE) {
+            limited++;
+            continue;
+        }
+        WINDOWPLACEMENT * place = data.RestoreTarget(_NumMonitors, _Session, calls);
+        if (place == NULL) continue;
+        calls += SavedWindowData::ApplyPlacement(data.m_hwnd, place, WPF_ASYNCWINDOWPLACEMENT);
+        data.m_nEnforceCount++;
+        corrected++;
+        TCHAR sz[96];
+        wsprintf(sz, _T("Enforce %s back to x=%d, y=%d\n"), data.m_wndClass,
+            place->rcNormalPosition.left, place->rcNormalPosition.top);
+        LogEvent(DIAG_ENFORCE, data.m_hwnd, data.m_dwProcessId, sz);
+    }
+    if (drifted != _Drifted) delete[] drifted;
+    _NumDrifted = 0;
+    _DriftOverflow = false;
+    _EnforceMetrics.m_nCorrections += corrected;
+    _EnforceMetrics.m_nRateLimited += limited;
+
+    TCHAR sz[96];
+    wsprintf(sz, _T("Enforce corrected=%d limited=%d calls=%d\n"), corrected, limited, calls);
+    LogEvent(DIAG_ENFORCE, NULL, 0, sz);
+}
+
+//
+// tracked windows not where they were last saved for the current monitors.
+//
+int InstanceData::WindowsOutOfPlace()
+{
+    int moved = 0;
+    int s, i;
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        WindowTable & shard = _Shards[s];
+        for (i = 0; i < shard.m_nLength; i++)
+        {
+            SavedWindowData & data = shard.m_data[i];
+            if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+            WINDOWPLACEMENT * place = data.Placement(_NumMonitors, _Session);
+            if (place == NULL || place->length != sizeof(WINDOWPLACEMENT)) continue;
+            WINDOWPLACEMENT now;
+            now.length = sizeof(now);
+            if (!GetWindowPlacement(data.m_hwnd, &now)) continue;
+            BOOL showMismatch;
+            if (PlacementError(*place, now, showMismatch) > 0 || showMismatch) moved++;
+        }
+    }
+    return moved;
+}
+
+LPCTSTR TranslateShowCommand(int nShowCmd)
+{
+    switch (nShowCmd)
+    {
+    case SW_RESTORE:
+    case SW_SHOWNORMAL:
+        return _T("SW_SHOWNORMAL");
+    case SW_MAXIMIZE:
+        return _T("SW_MAXIMIZE");
+    case SW_MINIMIZE:
+    case SW_SHOWMINIMIZED:
+        return _T("SW_MINIMIZE");
+    case SW_SHOWNOACTIVATE:
+        return _T("SW_SHOWNOACTIVATE");
+    case SW_SHOWMINNOACTIVE:
+        return _T("SW_SHOWMINNOACTIVE");
+    default:
+        return _T("Unknown");
+    }
+}
+
+//
+// called by EnumDisplayMonitors, lParam is the list of GDI device names
+// of the fixed monitors, ending with an empty string.
+//
+BOOL CALLBACK ClassifyMonitorCallback(HMONITOR hMonitor, HDC hdc, LPRECT lprc, LPARAM lParam)
+{
+    WCHAR (*fixed)[32] = (WCHAR (*)[32])lParam;
+    MONITORINFOEX info;
+    info.cbSize = sizeof(info);
+    if (!GetMonitorInfo(hMonitor, &info)) return true;
+
+    int i;
+    for (i = 0; fixed[i][0] != '\0'; i++)
+    {
+        if (lstrcmpi(fixed[i], info.szDevice) == 0) return true;
+    }
+    InstanceData & inst = InstanceData::g_Instance;
+    if (inst._NumRemovableMonitors < MAX_MONITORS) {
+        inst._RemovableMonitors[inst._NumRemovableMonitors++] = info.rcMonitor;
+    }
+    return true;
+}
+
+//
+// Built in laptop panels are connected as an internal (or embedded) output,
+// anything else can be unplugged. Fill in the rectangles of the removable
+// monitors. If we can't tell, treat them all as removable.
+//
+void ClassifyMonitors()
+{
+    WCHAR fixed[MAX_MONITORS + 1][32];
+    int numFixed = 0;
+
+    UINT32 numPaths = 0, numModes = 0;
+    if (GetDisplayConfigBufferSizes(QDC_ONLY_ACTIVE_PATHS, &numPaths, &numModes) == ERROR_SUCCESS) {
+        DISPLAYCONFIG_PATH_INFO * paths = new DISPLAYCONFIG_PATH_INFO[numPaths];
+        DISPLAYCONFIG_MODE_INFO * modes = new DISPLAYCONFIG_MODE_INFO[numModes];
+        if (QueryDisplayConfig(QDC_ONLY_ACTIVE_PATHS, &numPaths, paths, &numModes, modes, NULL) == ERROR_SUCCESS) {
+            UINT32 i;
+            for (i = 0; i < numPaths && numFixed < MAX_MONITORS; i++)
+            {
+                DISPLAYCONFIG_VIDEO_OUTPUT_TECHNOLOGY tech = paths[i].targetInfo.outputTechnology;
+                if (tech != DISPLAYCONFIG_OUTPUT_TECHNOLOGY_INTERNAL &&
+                    tech != DISPLAYCONFIG_OUTPUT_TECHNOLOGY_DISPLAYPORT_EMBEDDED &&
+                    tech != DISPLAYCONFIG_OUTPUT_TECHNOLOGY_UDI_EMBEDDED) {
+                    continue;
+                }
+                DISPLAYCONFIG_SOURCE_DEVICE_NAME source;
+                source.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME;
+                source.header.size = sizeof(source);
+                source.header.adapterId = paths[i].sourceInfo.adapterId;
+                source.header.id = paths[i].sourceInfo.id;
+                if (DisplayConfigGetDeviceInfo(&source.header) == ERROR_SUCCESS) {
+                    lstrcpyn(fixed[numFixed++], source.viewGdiDeviceName, 32);
+                }
+            }
+        }
+        delete[] paths;
+        delete[] modes;
+    }
+
+    fixed[numFixed][0] = '\0';
+
+    InstanceData::g_Instance.LockTable();
+    InstanceData::g_Instance._NumRemovableMonitors = 0;
+    EnumDisplayMonitors(NULL, NULL, ClassifyMonitorCallback, (LPARAM)fixed);
+    InstanceData::g_Instance.UnlockTable();
+
+    TCHAR sz[64];
+    wsprintf(sz, _T("Monitors: %d fixed, %d removable\n"), numFixed, InstanceData::g_Instance._NumRemovableMonitors);
+    InstanceData::g_Instance.LogEvent(DIAG_MONITORS, NULL, 0, sz);
+}
+
+struct MonitorList {
+    MONITORINFOEX		m_info[MAX_MONITORS];
+    int					m_nCount;
+};
+
+//
+// called by EnumDisplayMonitors, lParam is a MonitorList.
+//
+static BOOL CALLBACK ListMonitorCallback(HMONITOR hMonitor, HDC hdc, LPRECT lprc, LPARAM lParam)
+{
+    MonitorList * list = (MonitorList *)lParam;
+    if (list->m_nCount >= MAX_MONITORS) return false;
+    MONITORINFOEX & info = list->m_info[list->m_nCount];
+    info.cbSize = sizeof(info);
+    if (GetMonitorInfo(hMonitor, &info)) list->m_nCount++;
+    return true;
+}
+
+//
+// see which of the monitors we know are here now, and where. Placements
+// saved from now on are filed under these, see InstanceData::FindMonitor.
+// Once MAX_MONITORS have been seen, a new monitor takes the entry of one
+// that isn't here, and what was filed under that is forgotten. The caller
+// holds the table exclusively.
+//
+void UpdateKnownMonitors(InstanceData & inst)
+{
+    MonitorList list;
+    list.m_nCount = 0;
+    EnumDisplayMonitors(NULL, NULL, ListMonitorCallback, (LPARAM)&list);
+
+    //
+    // mark every known monitor that is here before any entry is taken back.
+    int known[MAX_MONITORS];
+    int i, j, s;
+    for (i = 0; i < inst._NumKnownMonitors; i++) inst._KnownMonitors[i].m_bPresent = false;
+    for (j = 0; j < list.m_nCount; j++)
+    {
+        known[j] = inst.FindKnownMonitor(list.m_info[j].szDevice);
+        if (known[j] >= 0) inst._KnownMonitors[known[j]].m_bPresent = true;
+    }
+    for (j = 0; j < list.m_nCount; j++)
+    {
+        const MONITORINFOEX & info = list.m_info[j];
+        i = known[j];
+        if (i < 0 && inst._NumKnownMonitors < MAX_MONITORS) {
+            i = inst._NumKnownMonitors++;
+        }
+        else if (i < 0) {
+            // fewer than MAX_MONITORS are here, so one entry is free.
+            for (i = 0; inst._KnownMonitors[i].m_bPresent; i++);
+            for (s = 0; s < WINDOW_SHARDS; s++) inst._Shards[s].UnindexMonitor(i);
+        }
+        KnownMonitor & monitor = inst._KnownMonitors[i];
+        lstrcpyn(monitor.m_szDevice, info.szDevice, 32);
+        monitor.m_rcMonitor = info.rcMonitor;
+        monitor.m_bPresent = true;
+        if (info.dwFlags & MONITORINFOF_PRIMARY) {
+            inst._WorkOffset.x = info.rcWork.left - info.rcMonitor.left;
+            inst._WorkOffset.y = info.rcWork.top - info.rcMonitor.top;
+        }
+    }
+}
+
+//
+// how many windows each monitor has in this configuration, found from the
+// monitor lists rather than by going through the table.
+//
+static void LogMonitorWindows(InstanceData & inst, int monitors)
+{
+    if (monitors < MIN_MONITORTORESTORE || monitors > MAX_MONITORS) return;
+    int i;
+    for (i = 0; i < inst._NumKnownMonitors; i++)
+    {
+        if (!inst._KnownMonitors[i].m_bPresent) continue;
+        TCHAR sz[96];
+        wsprintf(sz, _T("Monitor %s: %d windows saved with %d monitors\n"), inst._KnownMonitors[i].m_szDevice,
+            inst.WindowsOnMonitor(i, monitors, inst._Session, NULL, 0), monitors);
+        inst.LogEvent(DIAG_MONITORS, NULL, 0, sz);
+    }
+}
+
+//
+// only track windows that are visible, don't have a parent, 
+// have at least one style that is in the OVERLAPPEDWINDOW style and
+// do not have the WS_EX_NOACTIVE style.
+//
+// we include WS_EX_TOOLBAR because they sometimes are useful and get
+// moved as well.
+//
+// the shell's own windows are left out first, by class, see
+// MonitorKeeperClasses.h.
+//
+BOOL IsTrackedWindow(HWND hwnd)
+{
+    if (IsExcludedClass(hwnd, s_ClassVerdicts)) return false;
+    if (!IsWindowVisible(hwnd) || GetParent(hwnd) != NULL) return false;
+    DWORD dwStyle = (DWORD)GetWindowLong(hwnd, GWL_STYLE);
+    DWORD dwExStyle = (DWORD)GetWindowLong(hwnd, GWL_EXSTYLE);
+    return ((dwStyle & (WS_OVERLAPPEDWINDOW)) != 0 ||
+        (dwExStyle & WS_EX_APPWINDOW) != 0)
+        &&
+        (dwExStyle & (WS_EX_NOACTIVATE)) == 0;
+}
+
+//
+// the shell has started again, and its classes may have new atoms.
+//
+void ForgetClassVerdicts()
+{
+    int i;
+    for (i = 0; i < CLASS_VERDICTS; i++) InterlockedExchange(&s_ClassVerdicts[i], 0);
+}
+
+//
+// Called by EnumDesktopWindows whenever a window changes state.
+// This will capture a lot of events.
+//
+BOOL CALLBACK SaveWindowsCallback(
+    _In_ HWND   hwnd,
+    _In_ LPARAM lParam
+)
+{
+    int monitors = (int)lParam;
+    if (IsTrackedWindow(hwnd))
+    {
+        if (InstanceData::g_Instance._ExternalOnly &&
+            !InstanceData::g_Instance.IsOnRemovableMonitor(hwnd)) {
+            // not saved here, but a window we already know is still open;
+            // unplugging the external monitor puts its windows on the panel,
+            // and their placements are wanted when it comes back.
+            SavedWindowData * pKnown = InstanceData::g_Instance.FindSavedWindow(hwnd);
+            if (pKnown != NULL) pKnown->m_nUnusedCount = 0;
+            return true;
+        }
+        int session = InstanceData::g_Instance._Session;
+        SavedWindowData * pData = InstanceData::g_Instance.FindWindowSlot(hwnd);
+        if (pData->m_bLocked && pData->Placement(monitors, session) != NULL) {
+            // keep the locked placement, whatever the window did.
+            pData->m_nUnusedCount = 0;
+            return true;
+        }
+        // most passes find most windows where they were, and those aren't logged.
+        WINDOWPLACEMENT before;
+        WINDOWPLACEMENT * old = pData->m_hwnd == hwnd ? pData->Placement(monitors, session) : NULL;
+        if (old != NULL) before = *old;
+        if (pData->SetData(hwnd, monitors, session, InstanceData::g_Instance._PassCalls))
+        {
+            InstanceData::g_Instance._PassSaved++;
+            InstanceData::g_Instance.IndexSavedWindow(pData, monitors, session);
+            PublishPlacement(*pData, monitors, session);
+            TraceWindowSaved(*pData, monitors, session);
+            Settings * settings = InstanceData::g_Instance.CurrentSettings();
+            if (settings->m_nMdiFrameClasses > 0 &&
+                settings->IsMdiFrameClass(pData->m_wndClass)) {
+                InstanceData::g_Instance.SaveMdiChildren(hwnd, monitors, session);
+            }
+            WINDOWPLACEMENT * place = pData->Placement(monitors, session);
+            BOOL showMismatch = false;
+            if (old != NULL && PlacementError(before, *place, showMismatch) == 0 &&
+                !showMismatch && before.showCmd == place->showCmd) {
+                return true;
+            }
+            TCHAR sz[128];
+            wsprintf(sz, _T("Save Position for %s, monitors %d, x=%d, y=%d, show=%s\n"),
+                pData->m_wndClass, monitors, place->rcNormalPosition.left,
+                place->rcNormalPosition.top,
+                TranslateShowCommand(place->showCmd));
+            InstanceData::g_Instance.LogEvent(DIAG_SAVE, hwnd, pData->m_dwProcessId, sz);
+        }
+    }
+    return true;
+}
+
+//
+// call every ACCURACY_SAMPLEINTERVAL ms after a restore until it returns FALSE.
+//
+BOOL SampleRestoreAccuracy()
+{
+    InstanceData::g_Instance.LockTable();
+    BOOL more = InstanceData::g_Instance.SampleAccuracy();
+    InstanceData::g_Instance.UnlockTable();
+    return more;
+}
+
+//
+// applications are about to start in bulk (we've just started, or the user
+// logged on), don't wait for the rate to tell us.
+//
+void InstanceData::BeginStorm()
+{
+    InterlockedExchange((LONG volatile *)&_StormStart, (LONG)GetTickCount());
+    if (InterlockedExchange(&_InStorm, 1) == 0) {
+        InterlockedIncrement((LONG volatile *)&_StormMetrics.m_nStorms);
+        LogEvent(DIAG_STORM, NULL, 0, _T("Storm started\n"));
+    }
+}
+
+//
+// a window moved, how long to wait before saving. Normally that's SaveDelay
+// after the last move, so each burst of moves costs a save pass. When moves
+// come faster than [Storm] Events a second we wait for QuietDelay instead,
+// and the whole storm is saved in one pass; but a desktop that never goes
+// quiet is still saved STORM_MAXDEFER after the first move not saved.
+//
+// This runs for every move, so it doesn't take the table lock; the storm
+// state is only changed with interlocked operations.
+//
+int InstanceData::SaveDelayForEvent()
+{
+    Settings * settings = CurrentSettings();
+    DWORD now = GetTickCount();
+    DWORD rateStart = _RateStart;
+    if (now - rateStart >= 1000 &&
+        (DWORD)InterlockedCompareExchange((LONG volatile *)&_RateStart, (LONG)now, (LONG)rateStart) == rateStart) {
+        InterlockedExchange(&_RateEvents, 0);
+    }
+    LONG events = InterlockedIncrement(&_RateEvents);
+    DWORD last = (DWORD)InterlockedExchange((LONG volatile *)&_LastEventTick, (LONG)now);
+    InterlockedCompareExchange((LONG volatile *)&_FirstEventTick, (LONG)now, 0);
+    InterlockedIncrement(&_EventsCounted);
+    if (_InStorm && last == 0 && now - _StormStart >= STORM_STARTUPTIME) {
+        // saved since the last move and the startup time is over.
+        EndStorm();
+    }
+    if (!_InStorm && events >= settings->m_nStormEvents) {
+        BeginStorm();
+    }
+    if (!_InStorm) return settings->m_nSaveDelay;
+
+    InterlockedIncrement((LONG volatile *)&_StormMetrics.m_nEvents);
+    // the timer would have gone off since the last move.
+    if (last != 0 && now - last > (DWORD)settings->m_nSaveDelay) {
+        InterlockedIncrement((LONG volatile *)&_StormMetrics.m_nPassesAvoided);
+    }
+    DWORD waited = now - _FirstEventTick;
+    if (waited >= STORM_MAXDEFER) return 0;
+    return min(settings->m_nStormQuietDelay, (int)(STORM_MAXDEFER - waited));
+}
+
+//
+// called as a save pass starts. Moves went quiet, but a storm at startup
+// lasts at least STORM_STARTUPTIME in case more applications are coming.
+//
+void InstanceData::StormSaved()
+{
+    InterlockedExchange((LONG volatile *)&_LastEventTick, 0);
+    InterlockedExchange((LONG volatile *)&_FirstEventTick, 0);
+    if (!_InStorm) return;
+    InterlockedIncrement((LONG volatile *)&_StormMetrics.m_nPasses);
+    if (GetTickCount() - _StormStart >= STORM_STARTUPTIME) EndStorm();
+}
+
+void InstanceData::EndStorm()
+{
+    if (InterlockedExchange(&_InStorm, 0) == 0) return;
+
+    TCHAR sz[128];
+    wsprintf(sz, _T("Storm ended: %d moves, %d save passes, %d avoided\n"), _StormMetrics.m_nEvents,
+        _StormMetrics.m_nPasses, _StormMetrics.m_nPassesAvoided);
+    LogEvent(DIAG_STORM, NULL, 0, sz);
+}
+
+void BeginWindowStorm()
+{
+    InstanceData::g_Instance.BeginStorm();
+}
+
+//
+// a window moved, returns the ms to wait before calling ProcessDesktopWindows.
+// Kept for MKSnapshotDelay.
+//
+int WindowMovedSaveDelay()
+{
+    int delay = InstanceData::g_Instance.SaveDelayForEvent();
+    InterlockedExchange(&InstanceData::g_Instance._LastSaveDelay, delay);
+    return delay;
+}
+
+static LONGLONG EnforceStart()
+{
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    return start.QuadPart;
+}
+
+static void EnforceEnd(LONGLONG start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    InstanceData::g_Instance._EnforceMetrics.m_nMicroseconds += (int)((end.QuadPart - start) * 1000000 / freq.QuadPart);
+}
+
+void SetLayoutLocked(BOOL lock)
+{
+    InstanceData::g_Instance.LockTable();
+    InstanceData::g_Instance.LockLayout(lock);
+    InstanceData::g_Instance.UnlockTable();
+    InstanceData::g_Instance.LogEvent(DIAG_ENFORCE, NULL, 0, lock ? _T("Layout locked\n") : _T("Layout unlocked\n"));
+}
+
+//
+// a window moved. Returns TRUE if EnforceLayout should be called after the
+// [Enforce] GraceDelay.
+//
+BOOL CheckWindowDrift(HWND hwnd)
+{
+    if (!InstanceData::g_Instance._LayoutLocked || InstanceData::g_Instance.InChangingState) return false;
+    LONGLONG start = EnforceStart();
+    InstanceData::g_Instance.LockTable();
+    BOOL drifted = InstanceData::g_Instance.WindowMoved(hwnd);
+    EnforceEnd(start);
+    InstanceData::g_Instance.UnlockTable();
+    return drifted;
+}
+
+void EnforceLayout()
+{
+    if (InstanceData::g_Instance.InChangingState) return;
+    LONGLONG start = EnforceStart();
+    InstanceData::g_Instance.LockTable();
+    InstanceData::g_Instance.Enforce();
+    EnforceEnd(start);
+    InstanceData::g_Instance.UnlockTable();
+}
+
+//
+// Process when the number of monitors changes. If we have changed monitor count
+// we attempt to restore /
+//
+// Called once the monitors have settled after a display or session change.
+// Returns false if the displays have just woken and not all their monitors
+// are back yet; call it again after another delay.
+//
+BOOL ProcessMonitors()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    int monitors = GetSystemMetrics(SM_CMONITORS);
+    BOOL restored = false;
+    InstanceData::g_Instance.LockTable();
+    if (inst._DisplayAsleep) {
+        // monitors dropping off as they power down. Leave everything, including
+        // the changing state, as it is until they wake.
+        inst._SleepChanges++;
+        inst._PowerMetrics.m_nDisplayChanges++;
+        inst.UnlockTable();
+        return true;
+    }
+    if (inst._Waking) {
+        if (monitors < inst._NumMonitors && GetTickCount() - inst._WakeTick < DISPLAY_WAKETIME) {
+            inst.UnlockTable();
+            return false;
+        }
+        inst._Waking = false;
+        if (monitors > 1 && monitors == inst._NumMonitors && !inst._SessionSwitched) {
+            //
+            // the same monitors as before they slept. Only put windows back if
+            // something moved them.
+            int moved = inst.WindowsOutOfPlace();
+            if (moved > 0) {
+                inst._PowerMetrics.m_nRestoresNeeded++;
+                inst.RestoreWindowPositions(monitors);
+                restored = true;
+            }
+            else if (inst._SleepChanges > 0) {
+                inst._PowerMetrics.m_nRestoresAvoided++;
+            }
+            TCHAR sz[96];
+            wsprintf(sz, _T("Displays woke, %d display changes, %d windows moved\n"), inst._SleepChanges, moved);
+            inst.LogEvent(DIAG_POWER, NULL, 0, sz);
+        }
+        inst._SleepChanges = 0;
+    }
+    UpdateKnownMonitors(inst);
+    if (monitors > 1 &&
+        (InstanceData::g_Instance._NumMonitors != monitors || InstanceData::g_Instance._SessionSwitched))
+    {
+        // restore windows.
+        InstanceData::g_Instance.RestoreWindowPositions(monitors);
+        restored = true;
+    }
+    LogMonitorWindows(inst, monitors);
+    InstanceData::g_Instance._NumMonitors = monitors;
+    InstanceData::g_Instance._SessionSwitched = false;
+    InstanceData::g_Instance.UnlockTable();
+
+    PublishTopology(MK_EVENT_DISPLAYCHANGE);
+    if (restored) PublishTopology(MK_EVENT_RESTORED);
+
+    if (InstanceData::g_Instance._ExternalOnly) {
+        ClassifyMonitors();
+    }
+    InstanceData::g_Instance.SetChangingState(false);
+    return true;
+}
+
+
+//
+// The displays were turned off or back on. While they are off nothing is
+// saved and display changes are left alone, so monitors that disconnect
+// when they sleep don't cost a collapse and a full restore. Returns TRUE
+// when they come back on, and ProcessMonitors should be called after the
+// usual display change delay to see what they came back as.
+//
+BOOL DisplayPowerChanged(BOOL on)
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    BOOL changed = false;
+    inst.LockTable();
+    if (!on && !inst._DisplayAsleep) {
+        changed = true;
+        inst._DisplayAsleep = true;
+        inst._Waking = false;
+        inst._SleepChanges = 0;
+        inst._PowerMetrics.m_nSleeps++;
+        inst.SetChangingState(true);
+    }
+    else if (on && inst._DisplayAsleep) {
+        changed = true;
+        inst._DisplayAsleep = false;
+        inst._Waking = true;
+        inst._WakeTick = GetTickCount();
+    }
+    inst.UnlockTable();
+
+    if (changed) {
+        inst.LogEvent(DIAG_POWER, NULL, 0, on ? _T("Displays on\n") : _T("Displays off\n"));
+        PublishTopology(on ? MK_EVENT_DISPLAYON : MK_EVENT_DISPLAYOFF);
+    }
+    return changed && on;
+}
+
+
+//
+// Switch to the layout set for a console or remote session. We only flip
+// which set is active; the windows are put back by the usual delayed
+// ProcessMonitors once the new monitor configuration has settled, and
+// saving is suspended until then so the old session's layout is not
+// overwritten. Returns false if that set was already active.
+//
+BOOL SwitchSession(int session)
+{
+    InstanceData::g_Instance.LockTable();
+    if (session == InstanceData::g_Instance._Session) {
+        InstanceData::g_Instance.UnlockTable();
+        return false;
+    }
+    InstanceData::g_Instance._Session = session;
+    InstanceData::g_Instance._SessionSwitched = true;
+    InstanceData::g_Instance.SetChangingState(true);
+    InstanceData::g_Instance.UnlockTable();
+    PublishTopology(session == SESSION_REMOTE ? MK_EVENT_REMOTESESSION : MK_EVENT_CONSOLESESSION);
+
+    TCHAR sz[64];
+    wsprintf(sz, _T("Session switched to %s\n"), session == SESSION_REMOTE ? _T("remote") : _T("console"));
+    InstanceData::g_Instance.LogEvent(DIAG_SESSION, NULL, 0, sz);
+    return true;
+}
+
+
+//
+// called by hook for window changes
+//
+void ProcessDesktopWindows()
+{
+    TCHAR sz[128];
+    int monitors = GetSystemMetrics(SM_CMONITORS);
+    if (monitors != InstanceData::g_Instance._NumMonitors)
+    {
+        // we haven't completed our switch to change of monitors yet.
+        // so don't save positions until we've repositioned things.
+        return;
+    }
+    wsprintf(sz, _T("Monitors: %d\n"), monitors);
+    InstanceData::g_Instance.LogEvent(DIAG_PASS, NULL, 0, sz);
+
+    LARGE_INTEGER start, end, freq;
+    InstanceData::g_Instance.LockTable();
+    InstanceData::g_Instance.StormSaved();
+    TracePass(monitors, InstanceData::g_Instance._Session);
+    QueryPerformanceCounter(&start);
+    InstanceData::g_Instance._PassSaved = 0;
+    InstanceData::g_Instance._PassCalls = 0;
+    InstanceData::g_Instance.TagWindowsUnused();
+    EnumDesktopWindows(NULL, SaveWindowsCallback, monitors);
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+
+    InstanceData::g_Instance._PassCount++;
+    InstanceData::g_Instance._LastPassMicroseconds = (int)((end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart);
+    wsprintf(sz, _T("Save pass %d: %d us, %d windows saved, %d calls, %d slots\n"), InstanceData::g_Instance._PassCount,
+        InstanceData::g_Instance._LastPassMicroseconds, InstanceData::g_Instance._PassSaved,
+        InstanceData::g_Instance._PassCalls, InstanceData::g_Instance.TotalSlots());
+
+    MetricsRecord & minute = InstanceData::g_Instance.CurrentMinute();
+    DWORD us = (DWORD)InstanceData::g_Instance._LastPassMicroseconds;
+    if (minute.m_wPasses < 0xffff) minute.m_wPasses++;
+    minute.m_dwPassUs += us;
+    minute.m_dwPassMaxUs = max(minute.m_dwPassMaxUs, us);
+    minute.m_wTracked = (WORD)min(InstanceData::g_Instance._PassSaved, 0xffff);
+    minute.m_wSlots = (WORD)min(InstanceData::g_Instance.TotalSlots(), 0xffff);
+#ifdef _DEBUG
+    InstanceData::g_Instance.VerifyWindowTable();
+#endif
+    InstanceData::g_Instance.UnlockTable();
+    InstanceData::g_Instance.LogEvent(DIAG_PASS, NULL, 0, sz);
+}
+
+//
+// save one window that moved, without a pass over the whole desktop. Only
+// the window's shard is locked, so threads saving windows in different
+// shards don't wait for each other. Returns TRUE if it was saved.
+//
+BOOL CaptureWindow(HWND hwnd)
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    if (inst.InChangingState || !IsTrackedWindow(hwnd)) return false;
+
+    BOOL saved = false;
+    inst.LockTableShared();
+    int monitors = inst._NumMonitors;
+    int session = inst._Session;
+    WindowTable & shard = inst.ShardFor(hwnd);
+    shard.Lock();
+    if (inst._ExternalOnly && !inst.IsOnRemovableMonitor(hwnd)) {
+        // keep a window we already know, see SaveWindowsCallback.
+        int i = shard.HashFind(hwnd);
+        if (i >= 0) shard.m_data[i].m_nUnusedCount = 0;
+    }
+    else {
+        SavedWindowData * pData = shard.FindWindowSlot(hwnd);
+        if (pData->m_bLocked && pData->Placement(monitors, session) != NULL) {
+            pData->m_nUnusedCount = 0;
+        }
+        else {
+            int calls = 0;
+            saved = pData->SetData(hwnd, monitors, session, calls);
+            if (saved) {
+                // as SaveWindowsCallback; both take their own locks, after ours.
+                inst.IndexSavedWindow(pData, monitors, session);
+                PublishPlacement(*pData, monitors, session);
+                TraceWindowSaved(*pData, monitors, session);
+            }
+        }
+    }
+    shard.Unlock();
+    inst.UnlockTableShared();
+    return saved;
+}
+
+
+//
+// read a settings file. Settings:
+//
+//  [Tracking]
+//  MdiFrameClasses=class;class...   frame window classes whose MDI children are tracked.
+//  SaveDelay=200                    ms after windows stop moving before saving them.
+//  [Restore]
+//  Strategy=sequential|deferred|byprocess|parallel
+//  DisplayChangeDelay=500           ms after the display changes before restoring.
+//  [Enforce]
+//  GraceDelay=250                   ms a locked window may be out of place before it is put back.
+//  [Storm]
+//  Events=40                        moves in a second that start a storm.
+//  QuietDelay=2000                  ms after windows stop moving before saving them, during a storm.
+//
+Settings * ReadSettings(LPCTSTR szFile)
+{
+    Settings * settings = new Settings();
+    TCHAR szValue[MAX_MDIFRAMECLASSES * 40];
+
+    GetPrivateProfileString(_T("Tracking"), _T("MdiFrameClasses"), _T(""), szValue, sizeof(szValue) / sizeof(TCHAR), szFile);
+    LPTSTR p = szValue;
+    while (*p != '\0' && settings->m_nMdiFrameClasses < MAX_MDIFRAMECLASSES)
+    {
+        LPTSTR end = p;
+        while (*end != '\0' && *end != ';') end++;
+        int n = (int)(end - p);
+        if (n > 0 && n < 40) {
+            lstrcpyn(settings->m_MdiFrameClasses[settings->m_nMdiFrameClasses++], p, n + 1);
+        }
+        p = (*end == ';') ? end + 1 : end;
+    }
+    settings->m_nSaveDelay = GetPrivateProfileInt(_T("Tracking"), _T("SaveDelay"), settings->m_nSaveDelay, szFile);
+
+    GetPrivateProfileString(_T("Restore"), _T("Strategy"), _T("sequential"), szValue, sizeof(szValue) / sizeof(TCHAR), szFile);
+    int strategy = FindRestoreStrategy(szValue);
+    settings->m_nRestoreStrategy = strategy >= 0 ? strategy : RESTORE_SEQUENTIAL;
+    settings->m_nDisplayChangeDelay = GetPrivateProfileInt(_T("Restore"), _T("DisplayChangeDelay"), settings->m_nDisplayChangeDelay, szFile);
+    settings->m_nEnforceDelay = GetPrivateProfileInt(_T("Enforce"), _T("GraceDelay"), settings->m_nEnforceDelay, szFile);
+    settings->m_nStormEvents = GetPrivateProfileInt(_T("Storm"), _T("Events"), settings->m_nStormEvents, szFile);
+    settings->m_nStormQuietDelay = GetPrivateProfileInt(_T("Storm"), _T("QuietDelay"), settings->m_nStormQuietDelay, szFile);
+
+    // keep the timers sane whatever is in the file.
+    settings->m_nSaveDelay = max(10, min(settings->m_nSaveDelay, 60000));
+    settings->m_nDisplayChangeDelay = max(10, min(settings->m_nDisplayChangeDelay, 60000));
+    settings->m_nEnforceDelay = max(10, min(settings->m_nEnforceDelay, 60000));
+    settings->m_nStormEvents = max(2, settings->m_nStormEvents);
+    settings->m_nStormQuietDelay = max(settings->m_nSaveDelay, min(settings->m_nStormQuietDelay, 60000));
+    return settings;
+}
+
+//
+// read MonitorKeeper.ini from beside the executable.
+//
+void LoadSettings()
+{
+    TCHAR * szFile = InstanceData::g_Instance._SettingsFile;
+    int len = GetModuleFileName(NULL, szFile, MAX_PATH);
+    while (len > 0 && szFile[len - 1] != '.' && szFile[len - 1] != '\\') len--;
+    if (len == 0 || szFile[len - 1] != '.' || len + 3 >= MAX_PATH) {
+        szFile[0] = '\0';
+        return;
+    }
+    lstrcpy(szFile + len, _T("ini"));
+
+    InstanceData::g_Instance.SwapSettings(ReadSettings(szFile));
+}
+
+
+static HANDLE s_hSettingsThread = NULL;
+static HANDLE s_hStopSettingsThread = NULL;
+
+static BOOL GetLastWriteTime(LPCTSTR szFile, FILETIME * time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(szFile, GetFileExInfoStandard, &data)) {
+        ZeroMemory(time, sizeof(FILETIME));
+        return false;
+    }
+    *time = data.ftLastWriteTime;
+    return true;
+}
+
+//
+// wait for something in the settings file's folder to change, and if it was
+// the settings file read it again.
+//
+static DWORD WINAPI SettingsWatcherThread(LPVOID param)
+{
+    UNREFERENCED_PARAMETER(param);
+    InstanceData & inst = InstanceData::g_Instance;
+
+    TCHAR szDir[MAX_PATH];
+    lstrcpy(szDir, inst._SettingsFile);
+    int len = lstrlen(szDir);
+    while (len > 0 && szDir[len - 1] != '\\') len--;
+    szDir[len] = '\0';
+
+    HANDLE handles[2];
+    handles[0] = s_hStopSettingsThread;
+    handles[1] = FindFirstChangeNotification(szDir, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (handles[1] == INVALID_HANDLE_VALUE) return 0;
+
+    FILETIME last;
+    GetLastWriteTime(inst._SettingsFile, &last);
+    while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+    {
+        FILETIME now;
+        GetLastWriteTime(inst._SettingsFile, &now);
+        if (now.dwLowDateTime != last.dwLowDateTime || now.dwHighDateTime != last.dwHighDateTime) {
+            last = now;
+            inst.SwapSettings(ReadSettings(inst._SettingsFile));
+            inst.LogEvent(DIAG_SETTINGS, NULL, 0, _T("Settings reloaded\n"));
+        }
+        if (!FindNextChangeNotification(handles[1])) break;
+    }
+    FindCloseChangeNotification(handles[1]);
+    return 0;
+}
+
+void StartSettingsWatcher()
+{
+    if (s_hSettingsThread != NULL || InstanceData::g_Instance._SettingsFile[0] == '\0') return;
+    s_hStopSettingsThread = CreateEvent(NULL, TRUE, FALSE, NULL);
+    s_hSettingsThread = CreateThread(NULL, 0, SettingsWatcherThread, NULL, 0, NULL);
+}
+
+void StopSettingsWatcher()
+{
+    if (s_hSettingsThread == NULL) return;
+    SetEvent(s_hStopSettingsThread);
+    WaitForSingleObject(s_hSettingsThread, INFINITE);
+    CloseHandle(s_hSettingsThread);
+    CloseHandle(s_hStopSettingsThread);
+    s_hSettingsThread = NULL;
+    s_hStopSettingsThread = NULL;
+}
@@ -0,0 +1,1612 @@
+// MonitorKeeperEngine.h
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// The window tracking and restore engine. Everything that saves and puts back
+// window placements lives here; MonitorKeeper.cpp is the tray application that
+// drives it from window messages and hooks, and MonitorKeeperApi.h exposes it
+// to other programs.
+//
+
+#pragma once
+
+#include "MonitorKeeper.h"
+
+#define MAX_MONITORS 64
+#define MIN_MONITORTORESTORE 2
+#define MAX_LAYOUTS 6               // monitor configurations remembered per window
+
+//
+// a remote desktop session sees the client's monitors rather than the ones
+// on the desk, so console and remote sessions each keep their own layouts.
+//
+#define SESSION_CONSOLE 0
+#define SESSION_REMOTE 1
+#define NUM_SESSIONKINDS 2
+
+#define WINDOW_SHARDS 8             // the window table is split so threads saving different windows don't wait
+#define WINDOW_SHARDSHIFT 24
+
+#define MAX_MDIFRAMECLASSES 16       // applications that opt in to MDI child tracking
+
+//
+// ways of putting windows back, chosen with [Restore] Strategy in the
+// settings file or MKSetRestoreStrategy.
+//
+#define RESTORE_SEQUENTIAL 0        // SetWindowPlacement on each window in turn
+#define RESTORE_DEFERRED 1          // move normal windows in one DeferWindowPos batch
+#define RESTORE_BYPROCESS 2         // sequential, but each application's windows together
+#define RESTORE_PARALLEL 3          // wait for each window, RESTORE_THREADS at a time
+#define NUM_RESTORESTRATEGIES 4
+#define RESTORE_THREADS 4
+#define RESTORE_WAITTIME 5000      // ms a parallel restore waits for its threads
+
+//
+// after a restore the windows are looked at again every
+// ACCURACY_SAMPLEINTERVAL ms, for up to ACCURACY_SAMPLETIME ms, to see
+// whether they got where they were sent. See SampleRestoreAccuracy.
+//
+#define ACCURACY_SAMPLEINTERVAL 100
+#define ACCURACY_SAMPLETIME 2000
+#define MAX_ACCURACYENTRIES 64      // application and monitor change combinations kept
+#define ACCURACY_PROCESSES 256      // executable names remembered by process id, a power of two
+
+//
+// with the layout locked, windows that move themselves are put back. See
+// CheckWindowDrift.
+//
+#define ENFORCE_MAXPERMINUTE 10     // corrections per window before we give up on it for a while
+#define MAX_DRIFTED 64              // windows waiting to be put back, more and we search the table
+
+#define STORM_STARTUPTIME 30000     // ms after startup or logon that are always treated as a storm
+#define STORM_MAXDEFER 10000        // ms a storm may put off saving a move
+
+#define DISPLAY_WAKETIME 15000      // ms we wait after the displays wake for their monitors to come back
+
+struct MKFeedHeader;                // the event feed, see MonitorKeeperApi.h
+struct MKFeedRecord;
+
+//
+// MonitorKeeper.metrics, see MonitorKeeperMetrics.cpp. Change the version
+// if the records change.
+//
+#define METRICS_MAGIC 0x524d4b4d    // "MKMR"
+#define METRICS_VERSION 2
+#define METRICS_CAPACITY 131072     // active minutes kept, 6MB
+
+//
+// MonitorKeeper.diag, the diagnostics log, see MonitorKeeperDiagnostics.cpp.
+//
+#define DIAG_MAGIC 0x4c444b4d       // "MKDL"
+#define DIAG_VERSION 1
+#define DIAG_CAPACITY 262144        // records kept unless [Diagnostics] Records says otherwise, 48MB
+#define DIAG_MAXCAPACITY 4194304
+#define DIAG_BUCKETBITS 16          // the window index has 1 << DIAG_BUCKETBITS chains
+#define DIAG_TEXTLEN 78             // so a record is 192 bytes
+
+//
+// what a diagnostics record is about, each has its own index chain.
+//
+#define DIAG_MESSAGE 0              // anything else
+#define DIAG_SAVE 1                 // a window's position saved
+#define DIAG_PASS 2                 // a save pass
+#define DIAG_RESTORE 3
+#define DIAG_MONITORS 4             // the monitors changed or were classified
+#define DIAG_SESSION 5
+#define DIAG_POWER 6
+#define DIAG_STORM 7
+#define DIAG_ENFORCE 8
+#define DIAG_SETTINGS 9
+#define DIAG_NUMEVENTS 10
+
+//
+// MonitorKeeper.trace, a capture the benchmark can replay, see
+// MonitorKeeperTrace.cpp.
+//
+#define TRACE_MAGIC 0x52544b4d      // "MKTR"
+#define TRACE_VERSION 1
+#define TRACE_MAXRECORDS 4194304    // 160MB, then capture stops
+#define TRACE_BUFFERED 256          // records written to the file at once
+
+#define TRACE_MOVE 1                // a window moved
+#define TRACE_PASS 2                // a save pass started
+#define TRACE_SAVE 3                // the pass saved a window
+#define TRACE_RESTORE 4             // windows restored for m_wMonitors
+
+#define LOGBUFFERSIZE  (32*1024)
+
+#define WM_SETTINGSRETIRED (WM_USER + 101)   // lParam is a Settings the main window should delete
+
+
+//
+// placement of a window for one monitor configuration.
+//
+struct SavedPlacement {
+    int					m_nMonitors;    // 0 if this entry is unused
+    int					m_nSession;
+    DWORD				m_dwLastUsed;   // stamp used to pick an entry to discard
+    WINDOWPLACEMENT		m_place;
+    int					m_nOnMonitor;       // known monitor plus one, 0 if not indexed, see WindowTable::IndexPlacement
+    int					m_nNextOnMonitor;   // nodes plus one on the same monitor's list
+    int					m_nPrevOnMonitor;
+};
+
+//
+// a monitor we have seen. Its GDI device name is what identifies it, so a
+// monitor that comes back gets the same index in InstanceData::_KnownMonitors.
+//
+struct KnownMonitor {
+    WCHAR				m_szDevice[32];
+    RECT				m_rcMonitor;        // where it was last seen
+    BOOL				m_bPresent;
+};
+
+//
+// class representing the data we save for each top level window.
+//
+class SavedWindowData {
+public:
+    SavedWindowData() {
+        m_wndClass[0] = '\0';
+        m_hwnd = NULL;
+        m_nUnusedCount = 1;
+        m_bOnFreeList = false;
+        m_bLocked = false;
+        m_bDrifted = false;
+        m_dwEnforceStart = 0;
+        m_nEnforceCount = 0;
+        m_hwndAttributes = NULL;
+        m_atomClass = 0;
+        m_dwThreadId = 0;
+        m_dwProcessId = 0;
+        m_dwHookKey = 0;
+        m_dwHookCheck = 0;
+        ZeroMemory(m_layouts, sizeof(m_layouts));
+    }
+
+    int					m_nUnusedCount;
+    BOOL				m_bOnFreeList;
+    BOOL				m_bLocked;          // layout locked, put back if it moves
+    BOOL				m_bDrifted;         // moved while locked, waiting to be put back
+    DWORD				m_dwEnforceStart;   // tick count the current minute of corrections started
+    int					m_nEnforceCount;    // corrections in that minute
+    HWND				m_hwndAttributes;   // the window the attributes below were read for, see ReadAttributes
+    ATOM				m_atomClass;
+    DWORD				m_dwThreadId;
+    DWORD				m_dwProcessId;
+    DWORD				m_dwHookKey;        // 0 until PublishPlacement works it out
+    DWORD				m_dwHookCheck;
+    SavedPlacement		m_layouts[MAX_LAYOUTS];
+    HWND				m_hwnd;
+    TCHAR				m_wndClass[40];  // window class, for verification.
+
+    static DWORD volatile s_dwStamp;
+
+    //
+    // the layout saved for this monitor configuration, -1 if we've never seen
+    // the window in it.
+    //
+    int FindLayout(int NumMonitors, int Session)
+    {
+        int i;
+        for (i = 0; i < MAX_LAYOUTS; i++)
+        {
+            if (m_layouts[i].m_nMonitors == NumMonitors && m_layouts[i].m_nSession == Session) return i;
+        }
+        return -1;
+    }
+
+    //
+    // placement saved for this monitor configuration, or NULL if we've never
+    // seen the window in it.
+    //
+    WINDOWPLACEMENT * Placement(int NumMonitors, int Session)
+    {
+        int i = FindLayout(NumMonitors, Session);
+        return i >= 0 ? &(m_layouts[i].m_place) : NULL;
+    }
+
+    //
+    // placement to save into for this monitor configuration. With a wall of
+    // monitors we can't keep every possible count for every window, so
+    // the configuration used least recently is given up.
+    //
+    WINDOWPLACEMENT * PlacementForSave(int NumMonitors, int Session)
+    {
+        int i;
+        int oldest = 0;
+        for (i = 0; i < MAX_LAYOUTS; i++)
+        {
+            if (m_layouts[i].m_nMonitors == NumMonitors && m_layouts[i].m_nSession == Session) {
+                oldest = i;
+                break;
+            }
+            if (m_layouts[i].m_nMonitors == 0) {
+                oldest = i;
+                break;
+            }
+            if (m_layouts[i].m_dwLastUsed - m_layouts[oldest].m_dwLastUsed > 0x80000000) {
+                oldest = i;
+            }
+        }
+        m_layouts[oldest].m_nMonitors = NumMonitors;
+        m_layouts[oldest].m_nSession = Session;
+        // windows in different shards can be saved at once.
+        m_layouts[oldest].m_dwLastUsed = (DWORD)InterlockedIncrement((LONG volatile *)&s_dwStamp);
+        return &(m_layouts[oldest].m_place);
+    }
+
+    //
+    // true if hwnd is still the window the attributes were read for. The
+    // thread and class are read from the desktop heap, which every GUI
+    // process has mapped, so this is no call into the kernel. A destroyed
+    // window has thread 0.
+    //
+    BOOL SameWindow(HWND hwnd)
+    {
+        return m_hwndAttributes == hwnd && m_dwThreadId != 0 &&
+            GetWindowThreadProcessId(hwnd, NULL) == m_dwThreadId &&
+            (ATOM)GetClassWord(hwnd, GCW_ATOM) == m_atomClass;
+    }
+
+    //
+    // a window's class, thread and process never change, so they are only
+    // read when the window is first seen, or its HWND has been given to
+    // another window. Returns the calls made into the kernel.
+    //
+    int ReadAttributes(HWND hwnd)
+    {
+        if (SameWindow(hwnd)) return 0;
+        m_hwndAttributes = hwnd;
+        m_dwThreadId = GetWindowThreadProcessId(hwnd, &m_dwProcessId);
+        m_atomClass = (ATOM)GetClassWord(hwnd, GCW_ATOM);
+        RealGetWindowClass(hwnd, m_wndClass, sizeof(m_wndClass) / sizeof(TCHAR));
+        m_dwHookKey = 0;
+        return 1;
+    }
+
+    //
+    // adds the calls made into the kernel to calls.
+    //
+    BOOL SetData(HWND hwnd, int NumMonitors, int Session, int & calls)
+    {
+        m_hwnd = hwnd;
+        m_nUnusedCount = 0;
+        calls += ReadAttributes(hwnd);
+
+        if (NumMonitors < MIN_MONITORTORESTORE || NumMonitors > MAX_MONITORS) return false;  // too many monitors or not enought
+        WINDOWPLACEMENT * place = PlacementForSave(NumMonitors, Session);
+        place->length = sizeof(WINDOWPLACEMENT);
+        GetWindowPlacement(hwnd, place);
+        calls++;
+        return true;
+    }
+
+    //
+    // the placement to put the window back to, or NULL if we don't have one or
+    // the HWND now belongs to a different window. Adds the calls made into the
+    // kernel to calls; checking the window makes none.
+    //
+    WINDOWPLACEMENT * RestoreTarget(int NumMonitors, int Session, int & calls)
+    {
+        if (NumMonitors < MIN_MONITORTORESTORE || NumMonitors > MAX_MONITORS) return NULL;
+
+        WINDOWPLACEMENT * place = Placement(NumMonitors, Session);
+        if (place == NULL || place->length != sizeof(WINDOWPLACEMENT)) return NULL;
+
+        if (!SameWindow(m_hwnd)) return NULL;
+        return place;
+    }
+
+    //
+    // move a window to a saved placement. flags is WPF_ASYNCWINDOWPLACEMENT
+    // unless the caller wants to wait for the window to be moved. Returns the
+    // number of calls made on the window.
+    //
+    static int ApplyPlacement(HWND hwnd, const WINDOWPLACEMENT * saved, UINT flags)
+    {
+        WINDOWPLACEMENT place = *saved;
+        int calls = 1;
+
+        // don't worry about "minimized position", it is a concept from Windows 3.0.
+        place.flags = flags;
+
+        if (place.showCmd == SW_MAXIMIZE) {
+            // we need to treat this special, first restore it to the correct position,
+            // then maximize. Otherwise, it will just maximize it on the current screen
+            // and ingore the coordinates.
+            place.showCmd = SW_SHOWNOACTIVATE;
+            SetWindowPlacement(hwnd, &place);
+            place.showCmd = SW_MAXIMIZE;
+            calls++;
+        }
+        else if (place.showCmd == SW_MINIMIZE || place.showCmd == SW_SHOWMINIMIZED) {
+            place.showCmd = SW_SHOWMINNOACTIVE;
+        }
+        else if (place.showCmd == SW_NORMAL) {
+            place.showCmd = SW_SHOWNOACTIVATE;
+        }
+        SetWindowPlacement(hwnd, &place);
+        return calls;
+    }
+
+    void RestoreWindow(int NumMonitors, int Session)
+    {
+        int calls = 0;
+        WINDOWPLACEMENT * place = RestoreTarget(NumMonitors, Session, calls);
+        if (place != NULL) {
+            ApplyPlacement(m_hwnd, place, WPF_ASYNCWINDOWPLACEMENT);
+        }
+    }
+};
+
+
+//
+// a window to put back, as handed to a RestoreStrategy.
+//
+struct RestoreItem {
+    HWND				m_hwnd;
+    DWORD				m_dwProcessId;  // from the window's attributes, see ReadAttributes
+    WINDOWPLACEMENT		m_place;
+};
+
+//
+// the same measurements are kept for each strategy so they can be compared.
+//
+struct RestoreMetrics {
+    int					m_nRestores;        // times this strategy was used
+    int					m_nWindows;         // windows placed by the last restore
+    int					m_nMicroseconds;    // time the last restore took
+    int					m_nForeignCalls;    // calls into the kernel on other applications' windows in the last restore
+    int					m_nMismatched;      // windows not where we put them, checked right after
+};
+
+//
+// window storms, when applications are starting at login and windows are
+// created and moved faster than it is worth saving them. See SaveDelayForEvent.
+//
+struct StormMetrics {
+    int					m_nStorms;
+    int					m_nEvents;          // window moves during storms
+    int					m_nPasses;          // save passes run for storms
+    int					m_nPassesAvoided;   // passes the normal SaveDelay would have run instead
+};
+
+//
+// display sleep. Some monitors drop off when they power down, which looks
+// the same as unplugging them. See DisplayPowerChanged.
+//
+struct PowerMetrics {
+    int					m_nSleeps;          // times the displays went off
+    int					m_nDisplayChanges;  // display changes while they were off, not acted on
+    int					m_nRestoresAvoided; // woke to the same monitors with the windows still in place
+    int					m_nRestoresNeeded;  // woke to the same monitors, but windows had been moved
+};
+
+//
+// the start of MonitorKeeper.metrics, followed by m_dwCapacity records.
+//
+struct MetricsHeader {
+    DWORD				m_dwMagic;          // METRICS_MAGIC
+    DWORD				m_dwVersion;
+    DWORD				m_dwCapacity;
+    DWORD				m_dwRecordSize;     // sizeof(MetricsRecord)
+    DWORD				m_dwNext;           // record written next
+    DWORD				m_dwCount;          // records written, up to m_dwCapacity
+    DWORD				m_dwReserved[2];
+};
+
+//
+// one minute in MonitorKeeper.metrics, only minutes where something happened
+// are written.
+//
+struct MetricsRecord {
+    DWORD				m_dwMinute;         // minutes since 1601 UTC, as FILETIME
+    WORD				m_wPasses;          // save passes
+    WORD				m_wRestores;
+    DWORD				m_dwEvents;         // window moves
+    DWORD				m_dwPassUs;         // time of all the save passes
+    DWORD				m_dwPassMaxUs;
+    DWORD				m_dwRestoreUs;
+    DWORD				m_dwRestoreMaxUs;
+    WORD				m_wTracked;         // windows saved by the last pass
+    WORD				m_wSlots;           // window table size
+    DWORD				m_dwDelivered;      // window events our hook was called for
+    DWORD				m_dwFiltered;       // dropped by applications instead, see StartEventFilter
+    DWORD				m_dwCpuMs;          // our CPU time, user and kernel
+};
+
+//
+// the start of MonitorKeeper.diag, followed by m_dwCapacity records. Record
+// numbers start at 1 so a chain can end with 0; record n is in slot
+// (n - 1) % m_dwCapacity, and is only still there if its m_nSequence is n.
+//
+struct DiagHeader {
+    DWORD				m_dwMagic;          // DIAG_MAGIC
+    DWORD				m_dwVersion;
+    DWORD				m_dwCapacity;
+    DWORD				m_dwRecordSize;     // sizeof(DiagRecord)
+    LONG volatile		m_nLast;            // the newest record, 0 if none
+    DWORD				m_dwReserved[3];
+    DWORD				m_dwEventHeads[DIAG_NUMEVENTS];
+    DWORD				m_dwWindowHeads[1 << DIAG_BUCKETBITS];  // by a hash of the window
+};
+
+struct DiagRecord {
+    LONG volatile		m_nSequence;        // 0 while being written
+    DWORD				m_dwPrevEvent;      // the record before with the same event
+    DWORD				m_dwPrevWindow;     // the record before with a window in the same bucket
+    WORD				m_wEvent;
+    WORD				m_wMonitors;
+    ULONGLONG			m_ftTime;           // UTC, as FILETIME
+    DWORD				m_dwHwnd;           // 0 if not about a window
+    DWORD				m_dwProcessId;
+    DWORD				m_dwSession;
+    WCHAR				m_szText[DIAG_TEXTLEN];
+};
+
+//
+// what QueryDiagnostics looks for. Zeros match anything.
+//
+struct DiagQuery {
+    DWORD				m_dwHwnd;
+    DWORD				m_dwProcessId;
+    int					m_nEvent;           // -1 for any
+    ULONGLONG			m_ftFrom;
+    ULONGLONG			m_ftTo;
+};
+
+void WriteDiagnostic(DiagHeader * diag, int event, HWND hwnd, DWORD pid, LPCTSTR str);
+
+//
+// the start of MonitorKeeper.trace, followed by the records to the end of
+// the file.
+//
+struct TraceHeader {
+    DWORD				m_dwMagic;          // TRACE_MAGIC
+    DWORD				m_dwVersion;
+    DWORD				m_dwRecordSize;     // sizeof(TraceRecord)
+    DWORD				m_dwReserved;
+};
+
+//
+// names are never written, only hashes that can't be looked up without the
+// capture's salt, which isn't kept.
+//
+struct TraceRecord {
+    DWORD				m_dwTime;           // ms since the capture started
+    WORD				m_wEvent;           // TRACE_*
+    WORD				m_wMonitors;
+    DWORD				m_dwWindow;         // the HWND, 0 if not about a window
+    DWORD				m_dwClass;          // hash of the window class
+    DWORD				m_dwProcess;        // hash of the executable name
+    WORD				m_wSession;
+    WORD				m_wShowCmd;
+    RECT				m_rcNormal;         // TRACE_SAVE's placement
+};
+
+//
+// what keeping a locked layout in place has cost, since it was locked.
+//
+struct EnforceMetrics {
+    int					m_nEvents;          // moves of locked windows away from their placement
+    int					m_nCorrections;     // windows put back
+    int					m_nRateLimited;     // corrections skipped for ENFORCE_MAXPERMINUTE
+    int					m_nMicroseconds;    // time spent checking and putting back
+};
+
+//
+// how well restores worked for one application (executable name) going
+// from one monitor count to another, added up over every restore.
+//
+struct AccuracyEntry {
+    TCHAR				m_szApp[40];
+    int					m_nFromMonitors;
+    int					m_nToMonitors;
+    int					m_nWindows;         // windows restored and checked
+    int					m_nCorrected;       // got there within ACCURACY_SAMPLETIME
+    int					m_nTotalCorrectMs;  // time the corrected ones took, after the restore
+    int					m_nWrong;           // still not there at the end
+    int					m_nShowMismatched;  // of those, maximized or minimized when they shouldn't be
+    int					m_nTotalError;      // of those, pixels off, all four edges added
+    int					m_nMaxError;
+    DWORD				m_dwLastRestore;    // _AccuracyRestores when it was last used, see FindAccuracyEntry
+};
+
+//
+// a restored window still being watched.
+//
+struct AccuracySample {
+    HWND				m_hwnd;
+    WINDOWPLACEMENT		m_place;            // where it was sent
+    int					m_nEntry;           // its AccuracyEntry, -1 if the table is full
+    BOOL				m_bDone;
+};
+
+class RestoreStrategy {
+public:
+    virtual LPCTSTR Name() = 0;
+
+    //
+    // place every item, returning the number of calls made on the windows.
+    //
+    virtual int Restore(RestoreItem * items, int count) = 0;
+};
+
+RestoreStrategy * GetRestoreStrategy(int strategy);
+int FindRestoreStrategy(LPCTSTR name);
+
+//
+// MDI children of a frame window whose application opted in to having them
+// tracked. The children are placed relative to the MDICLIENT window, so they
+// are saved with the frame and put back after it.
+//
+class MdiFrameData {
+public:
+    MdiFrameData() {
+        m_hwndFrame = NULL;
+        m_hwndClient = NULL;
+        m_nUnusedCount = 1;
+        m_children = NULL;
+        m_nChildrenLength = 0;
+    }
+
+    HWND				m_hwndFrame;
+    HWND				m_hwndClient;
+    int					m_nUnusedCount;
+    SavedWindowData * m_children;
+    int					m_nChildrenLength;
+
+    void Free()
+    {
+        if (m_children != NULL) {
+            delete[] m_children;
+        }
+        m_children = NULL;
+        m_nChildrenLength = 0;
+    }
+
+    SavedWindowData * FindChildSlot(HWND hwnd)
+    {
+        int i;
+        for (i = 0; i < m_nChildrenLength; i++)
+        {
+            if (m_children[i].m_hwnd == hwnd) {
+                return &(m_children[i]);
+            }
+        }
+        for (i = 0; i < m_nChildrenLength; i++)
+        {
+            // gone for a whole pass before this one.
+            if (m_children[i].m_hwnd == NULL || m_children[i].m_nUnusedCount > 1) {
+                m_children[i] = SavedWindowData();
+                return &(m_children[i]);
+            }
+        }
+        int newlength = m_nChildrenLength + 8;
+        SavedWindowData * newdata = new SavedWindowData[newlength];
+        for (i = 0; i < m_nChildrenLength; i++) {
+            newdata[i] = m_children[i];
+        }
+        if (m_children != NULL) {
+            delete[] m_children;
+        }
+        m_children = newdata;
+        i = m_nChildrenLength;
+        m_nChildrenLength = newlength;
+        return &(m_children[i]);
+    }
+
+    //
+    // only the direct children of the MDICLIENT are documents, so walk that
+    // one level rather than enumerating every control in the application.
+    //
+    void SaveChildren(int NumMonitors, int Session)
+    {
+        int i;
+        for (i = 0; i < m_nChildrenLength; i++)
+        {
+            if (m_children[i].m_hwnd != NULL && m_children[i].m_nUnusedCount < 100) m_children[i].m_nUnusedCount++;
+        }
+        HWND child = GetWindow(m_hwndClient, GW_CHILD);
+        int calls = 0;
+        while (child != NULL)
+        {
+            FindChildSlot(child)->SetData(child, NumMonitors, Session, calls);
+            child = GetWindow(child, GW_HWNDNEXT);
+        }
+    }
+
+    void RestoreChildren(int NumMonitors, int Session)
+    {
+        if (!IsWindow(m_hwndClient)) return;
+        int i;
+        for (i = 0; i < m_nChildrenLength; i++)
+        {
+            if (m_children[i].m_hwnd != NULL && m_children[i].m_nUnusedCount == 0) {
+                m_children[i].RestoreWindow(NumMonitors, Session);
+            }
+        }
+    }
+};
+
+
+//
+// tuning read from MonitorKeeper.ini. A Settings is never changed once it has
+// been published; when the file changes a new one is read on the watcher
+// thread and swapped in, so the hook callback and save pass just read the
+// current pointer without taking a lock.
+//
+class Settings {
+public:
+    Settings() {
+        m_nSaveDelay = 200;
+        m_nDisplayChangeDelay = 500;
+        m_nRestoreStrategy = RESTORE_SEQUENTIAL;
+        m_nEnforceDelay = 250;
+        m_nStormEvents = 40;
+        m_nStormQuietDelay = 2000;
+        m_nMdiFrameClasses = 0;
+        m_pNextRetired = NULL;
+    }
+
+    int					m_nSaveDelay;           // ms after the last window move before saving
+    int					m_nDisplayChangeDelay;  // ms after a display change before restoring
+    int					m_nRestoreStrategy;     // RESTORE_ value
+    int					m_nEnforceDelay;        // ms a locked window may be out of place before it is put back
+    int					m_nStormEvents;         // window moves in a second that start a storm
+    int					m_nStormQuietDelay;     // ms without moves that end one
+    TCHAR				m_MdiFrameClasses[MAX_MDIFRAMECLASSES][40];
+    int					m_nMdiFrameClasses;
+    Settings * m_pNextRetired;              // see InstanceData::SwapSettings
+
+    //
+    // is this the class of a frame whose application asked for its MDI
+    // children to be tracked?
+    //
+    BOOL IsMdiFrameClass(LPCTSTR wndClass)
+    {
+        int i;
+        for (i = 0; i < m_nMdiFrameClasses; i++)
+        {
+            if (lstrcmpi(m_MdiFrameClasses[i], wndClass) == 0) return true;
+        }
+        return false;
+    }
+};
+
+
+//
+// mixes the bits of a window handle, the low bits pick a hash bucket and
+// bits WINDOW_SHARDSHIFT and up pick the shard.
+//
+inline UINT_PTR WindowHash(HWND hwnd)
+{
+    UINT_PTR h = (UINT_PTR)hwnd;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6d;
+    h ^= h >> 12;
+    return h;
+}
+
+//
+// one shard of the saved windows, see InstanceData::ShardFor. The table lock
+// held exclusively covers every shard; threads holding it shared, like
+// CaptureWindow, take the shard's own lock as well. m_nVersion changes each
+// time the shard lock is released after a change, so a reader can copy the
+// shards one at a time and check nothing changed underneath it.
+//
+// Each saved placement is also on a list for the monitor it lies on, see
+// IndexPlacement, so finding the windows on a monitor only visits those.
+//
+class WindowTable {
+public:
+    WindowTable() {
+        ZeroMemory(m_monitorHeads, sizeof(m_monitorHeads));
+        m_nLength = 8;
+        m_data = new SavedWindowData[m_nLength];
+        m_freeSlots = new int[m_nLength];
+        m_nFreeSlots = 0;
+        int i;
+        for (i = m_nLength - 1; i >= 0; i--) {
+            m_data[i].m_bOnFreeList = true;
+            m_freeSlots[m_nFreeSlots++] = i;
+        }
+        m_hashTable = NULL;
+        m_nHashSize = 0;
+        RebuildHash();
+        m_nVersion = 0;
+        InitializeSRWLock(&m_lock);
+    }
+
+    ~WindowTable()
+    {
+        Free();
+    }
+
+    void Free()
+    {
+        if (m_data != NULL) {
+            delete[] m_data;
+        }
+        m_data = NULL;
+        if (m_freeSlots != NULL) {
+            delete[] m_freeSlots;
+        }
+        m_freeSlots = NULL;
+        if (m_hashTable != NULL) {
+            delete[] m_hashTable;
+        }
+        m_hashTable = NULL;
+        m_nLength = 0;
+        m_nFreeSlots = 0;
+        m_nHashSize = 0;
+        ZeroMemory(m_monitorHeads, sizeof(m_monitorHeads));
+    }
+
+    void Lock() { AcquireSRWLockExclusive(&m_lock); }
+    void Unlock()
+    {
+        InterlockedIncrement(&m_nVersion);
+        ReleaseSRWLockExclusive(&m_lock);
+    }
+    void LockShared() { AcquireSRWLockShared(&m_lock); }
+    void UnlockShared() { ReleaseSRWLockShared(&m_lock); }
+
+    //
+    // we are not notified on a window destroy, so we marked windows
+    // if we haven't seen them. If we don't see it 3 times in a row,
+    // we will reuse it's position in the array.
+    //
+    void TagUnused()
+    {
+        int i;
+        for (i = 0; i < m_nLength; i++)
+        {
+            // don't count to the point we rollover
+            if (m_data[i].m_hwnd != NULL && m_data[i].m_nUnusedCount < 100)
+            {
+                m_data[i].m_nUnusedCount++;
+                if (m_data[i].m_nUnusedCount > 2 && !m_data[i].m_bOnFreeList) {
+                    m_data[i].m_bOnFreeList = true;
+                    m_freeSlots[m_nFreeSlots++] = i;
+                }
+            }
+        }
+    }
+
+    //
+    // the HWND lookup is an open addressed hash of slot numbers (plus one, so
+    // zero is empty), kept at most half full. With thousands of windows a
+    // linear search of the array on every save dominates the pass.
+    //
+    int HashBucket(HWND hwnd)
+    {
+        return (int)(WindowHash(hwnd) & (UINT_PTR)(m_nHashSize - 1));
+    }
+
+    int HashFind(HWND hwnd)
+    {
+        int b = HashBucket(hwnd);
+        while (m_hashTable[b] != 0) {
+            if (m_data[m_hashTable[b] - 1].m_hwnd == hwnd) {
+                return m_hashTable[b] - 1;
+            }
+            b = (b + 1) & (m_nHashSize - 1);
+        }
+        return -1;
+    }
+
+    void HashInsert(int slot)
+    {
+        int b = HashBucket(m_data[slot].m_hwnd);
+        while (m_hashTable[b] != 0) {
+            b = (b + 1) & (m_nHashSize - 1);
+        }
+        m_hashTable[b] = slot + 1;
+    }
+
+    void HashRemove(HWND hwnd)
+    {
+        int b = HashBucket(hwnd);
+        while (m_hashTable[b] != 0 && m_data[m_hashTable[b] - 1].m_hwnd != hwnd) {
+            b = (b + 1) & (m_nHashSize - 1);
+        }
+        if (m_hashTable[b] == 0) return;
+
+        //
+        // shift later entries of the run back so lookups don't stop early.
+        int hole = b;
+        m_hashTable[hole] = 0;
+        b = (b + 1) & (m_nHashSize - 1);
+        while (m_hashTable[b] != 0) {
+            int home = HashBucket(m_data[m_hashTable[b] - 1].m_hwnd);
+            if (((b - home) & (m_nHashSize - 1)) >= ((b - hole) & (m_nHashSize - 1))) {
+                m_hashTable[hole] = m_hashTable[b];
+                m_hashTable[b] = 0;
+                hole = b;
+            }
+            b = (b + 1) & (m_nHashSize - 1);
+        }
+    }
+
+    void RebuildHash()
+    {
+        int size = 64;
+        while (size < m_nLength * 2) size *= 2;
+        if (m_hashTable != NULL) {
+            delete[] m_hashTable;
+        }
+        m_nHashSize = size;
+        m_hashTable = new int[m_nHashSize];
+        ZeroMemory(m_hashTable, sizeof(int) * m_nHashSize);
+        int i;
+        for (i = 0; i < m_nLength; i++)
+        {
+            if (m_data[i].m_hwnd != NULL) HashInsert(i);
+        }
+    }
+
+    //
+    // the monitor lists are doubly linked through the placements themselves.
+    // A node is a slot's layout, slot * MAX_LAYOUTS + layout; like the hash,
+    // they are stored plus one so zero is the end of a list. Being indexes,
+    // they survive the array being reallocated.
+    //
+    SavedPlacement & PlacementNode(int node)
+    {
+        return m_data[node / MAX_LAYOUTS].m_layouts[node % MAX_LAYOUTS];
+    }
+
+    void UnindexPlacement(int node)
+    {
+        SavedPlacement & p = PlacementNode(node);
+        if (p.m_nOnMonitor == 0) return;
+        if (p.m_nPrevOnMonitor != 0) PlacementNode(p.m_nPrevOnMonitor - 1).m_nNextOnMonitor = p.m_nNextOnMonitor;
+        else m_monitorHeads[p.m_nOnMonitor - 1] = p.m_nNextOnMonitor;
+        if (p.m_nNextOnMonitor != 0) PlacementNode(p.m_nNextOnMonitor - 1).m_nPrevOnMonitor = p.m_nPrevOnMonitor;
+        p.m_nOnMonitor = 0;
+        p.m_nNextOnMonitor = 0;
+        p.m_nPrevOnMonitor = 0;
+    }
+
+    //
+    // put a slot's layout on the list of the known monitor it was saved on,
+    // taking it off the one it was on. monitor is -1 to leave it off them all.
+    //
+    void IndexPlacement(int slot, int layout, int monitor)
+    {
+        int node = slot * MAX_LAYOUTS + layout;
+        SavedPlacement & p = PlacementNode(node);
+        if (p.m_nOnMonitor == monitor + 1) return;
+        UnindexPlacement(node);
+        if (monitor < 0 || monitor >= MAX_MONITORS) return;
+        p.m_nOnMonitor = monitor + 1;
+        p.m_nNextOnMonitor = m_monitorHeads[monitor];
+        if (p.m_nNextOnMonitor != 0) PlacementNode(p.m_nNextOnMonitor - 1).m_nPrevOnMonitor = node + 1;
+        m_monitorHeads[monitor] = node + 1;
+    }
+
+    void UnindexMonitor(int monitor)
+    {
+        while (m_monitorHeads[monitor] != 0) UnindexPlacement(m_monitorHeads[monitor] - 1);
+    }
+
+    void UnindexWindow(int slot)
+    {
+        int i;
+        for (i = 0; i < MAX_LAYOUTS; i++) UnindexPlacement(slot * MAX_LAYOUTS + i);
+    }
+
+    //
+    // find slot for the window we found.
+    SavedWindowData * FindWindowSlot(HWND hwnd)
+    {
+        //
+        // find existing HWND in array
+        int i = HashFind(hwnd);
+        if (i >= 0) {
+            return &(m_data[i]);
+        }
+
+        //
+        // find an unused slot. Slots go on the free list when they are tagged
+        // unused, but the window may have been seen again since.
+        while (m_nFreeSlots > 0)
+        {
+            i = m_freeSlots[--m_nFreeSlots];
+            m_data[i].m_bOnFreeList = false;
+            if (m_data[i].m_hwnd == NULL ||
+                m_data[i].m_nUnusedCount > 2) {
+                if (m_data[i].m_hwnd != NULL) HashRemove(m_data[i].m_hwnd);
+                // a different window, don't let it inherit the old placements.
+                UnindexWindow(i);
+                m_data[i] = SavedWindowData();
+                m_data[i].m_hwnd = hwnd;
+                HashInsert(i);
+                return &(m_data[i]);
+            }
+        }
+
+        //
+        // hmmm, all used, need to reallocate. Double the size so a wall full of
+        // windows doesn't reallocate every 32.
+        int newlength = m_nLength * 2;
+        SavedWindowData * newdata = new SavedWindowData[newlength];
+        for (i = 0; i < m_nLength; i++) {
+            newdata[i] = m_data[i];
+        }
+        delete[] m_data;
+        m_data = newdata;
+
+        int * newfree = new int[newlength];
+        for (i = 0; i < m_nFreeSlots; i++) {
+            newfree[i] = m_freeSlots[i];
+        }
+        delete[] m_freeSlots;
+        m_freeSlots = newfree;
+
+        //
+        // the new slots, except the one we return, are free.
+        i = m_nLength;
+        m_nLength = newlength;
+        int j;
+        for (j = newlength - 1; j > i; j--) {
+            m_data[j].m_bOnFreeList = true;
+            m_freeSlots[m_nFreeSlots++] = j;
+        }
+        RebuildHash();
+
+        // i === old m_nLength
+        m_data[i].m_hwnd = hwnd;
+        HashInsert(i);
+        return &(m_data[i]);
+    }
+
+
+    SavedWindowData * m_data;
+    int					m_nLength;
+    int * m_freeSlots;                      // slots that may be reused, see TagUnused
+    int					m_nFreeSlots;
+    int * m_hashTable;                      // HWND lookup, see HashBucket
+    int					m_nHashSize;
+    int					m_monitorHeads[MAX_MONITORS];   // first node plus one on each known monitor, see IndexPlacement
+    LONG volatile		m_nVersion;
+    SRWLOCK				m_lock;
+};
+
+
+//
+// Other global information we need for our application in this class, as
+// well as methods that operate on the saved data.
+//
+class InstanceData {
+public:
+    InstanceData() {
+        _Hook = NULL;
+#ifdef _DEBUG
+        _LogInfo[0] = '\0';
+#endif
+        _NumMonitors = 1;
+        _Session = SESSION_CONSOLE;
+        _SessionSwitched = false;
+        _PassCount = 0;
+        _PassSaved = 0;
+        _PassCalls = 0;
+        _LastPassMicroseconds = 0;
+        _ExternalOnly = false;
+        _NumRemovableMonitors = 0;
+        _NumKnownMonitors = 0;
+        _WorkOffset.x = 0;
+        _WorkOffset.y = 0;
+        _Settings = new Settings();
+        _RetiredSettings = NULL;
+        _SettingsFile[0] = '\0';
+        _MdiFrames = NULL;
+        _MdiFramesLength = 0;
+        ZeroMemory(_RestoreMetrics, sizeof(_RestoreMetrics));
+        _AccuracySamples = NULL;
+        _NumAccuracySamples = 0;
+        _AccuracyStart = 0;
+        _NumAccuracyEntries = 0;
+        _AccuracyRestores = 0;
+        _LayoutLocked = false;
+        _NumDrifted = 0;
+        _DriftOverflow = false;
+        ZeroMemory(&_EnforceMetrics, sizeof(_EnforceMetrics));
+        _InStorm = false;
+        _StormStart = 0;
+        _LastEventTick = 0;
+        _FirstEventTick = 0;
+        _EventsCounted = 0;
+        _LastSaveDelay = -1;
+        _RateStart = 0;
+        _RateEvents = 0;
+        ZeroMemory(&_StormMetrics, sizeof(_StormMetrics));
+        _DisplayAsleep = false;
+        _Waking = false;
+        _WakeTick = 0;
+        _SleepChanges = 0;
+        ZeroMemory(&_PowerMetrics, sizeof(_PowerMetrics));
+        _MetricsFile = INVALID_HANDLE_VALUE;
+        ZeroMemory(&_MetricsHeader, sizeof(_MetricsHeader));
+        ZeroMemory(&_MetricsMinute, sizeof(_MetricsMinute));
+        _MetricsCpuMs = 0;
+        _EventsDelivered = 0;
+        _DiagFile = INVALID_HANDLE_VALUE;
+        _DiagMapping = NULL;
+        _Diag = NULL;
+        _MainWnd = NULL;
+        InChangingState = false;
+        InitializeSRWLock(&_TableLock);
+        InitializeSRWLock(&_LogLock);
+    }
+
+    ~InstanceData()
+    {
+        Shutdown();
+    }
+
+    void Shutdown() {
+        if (_Hook != NULL) UnhookWinEvent(_Hook);
+        _Hook = NULL;
+
+        int i;
+        for (i = 0; i < WINDOW_SHARDS; i++) _Shards[i].Free();
+        if (_MdiFrames != NULL) {
+            for (i = 0; i < _MdiFramesLength; i++) _MdiFrames[i].Free();
+            delete[] _MdiFrames;
+        }
+        _MdiFrames = NULL;
+        _MdiFramesLength = 0;
+        if (_AccuracySamples != NULL) {
+            delete[] _AccuracySamples;
+        }
+        _AccuracySamples = NULL;
+        _NumAccuracySamples = 0;
+        while (_RetiredSettings != NULL) {
+            Settings * next = _RetiredSettings->m_pNextRetired;
+            delete _RetiredSettings;
+            _RetiredSettings = next;
+        }
+        if (_Settings != NULL) {
+            delete _Settings;
+        }
+        _Settings = NULL;
+    }
+
+    static InstanceData  g_Instance;
+
+    Settings * CurrentSettings()
+    {
+        return _Settings;
+    }
+
+    //
+    // publish new settings. Someone may still be reading the old ones, so
+    // they go to the main window to be deleted once it is back in its
+    // message loop. Without a main window (the engine in someone else's
+    // program) they are kept until Shutdown.
+    //
+    void SwapSettings(Settings * settings)
+    {
+        Settings * old = (Settings *)InterlockedExchangePointer((PVOID volatile *)&_Settings, settings);
+        if (old == NULL) return;
+        if (_MainWnd != NULL && PostMessage(_MainWnd, WM_SETTINGSRETIRED, 0, (LPARAM)old)) return;
+
+        Settings * head;
+        do {
+            head = _RetiredSettings;
+            old->m_pNextRetired = head;
+        } while (InterlockedCompareExchangePointer((PVOID volatile *)&_RetiredSettings, old, head) != head);
+    }
+
+    void LogMessage(LPCTSTR str)
+    {
+        LogEvent(DIAG_MESSAGE, NULL, 0, str);
+    }
+
+    //
+    // everything logged goes to the diagnostics log, see OpenDiagnostics.
+    // There is a primiative log window in debug mode as well. pid is the
+    // window's process id from its attributes, 0 without a window.
+    //
+    void LogEvent(int event, HWND hwnd, DWORD pid, LPCTSTR str)
+    {
+        AcquireSRWLockExclusive(&_LogLock);
+        if (_Diag != NULL) WriteDiagnostic(_Diag, event, hwnd, pid, str);
+#ifdef _DEBUG
+        int len = lstrlen(_LogInfo);
+        int newlen = lstrlen(str);
+        if (len + newlen >= LOGBUFFERSIZE)
+        {
+            len = 0;
+        }
+        lstrcpy(_LogInfo + len, str);
+#endif
+        ReleaseSRWLockExclusive(&_LogLock);
+#ifdef _DEBUG
+        if (_MainWnd != NULL) {
+            // other threads log too, and SetScrollPos would wait for ours.
+            if (GetWindowThreadProcessId(_MainWnd, NULL) == GetCurrentThreadId()) {
+                SetScrollPos(_MainWnd, SB_VERT, 10000, true);
+            }
+            InvalidateRect(_MainWnd, NULL, TRUE);
+        }
+#endif
+    }
+
+    //
+    // the settings watcher and programs using MonitorKeeperApi.h may call in
+    // from other threads. Anything that reads or changes the window table,
+    // the monitor classification or the session takes this lock; a save pass
+    // or restore holds it exclusively for the whole pass.
+    //
+    void LockTable() { AcquireSRWLockExclusive(&_TableLock); }
+    void UnlockTable() { ReleaseSRWLockExclusive(&_TableLock); }
+    void LockTableShared() { AcquireSRWLockShared(&_TableLock); }
+    void UnlockTableShared() { ReleaseSRWLockShared(&_TableLock); }
+
+    //
+    // set while the monitors are changing, saving is suspended until the
+    // restore has run. Read without the lock by the hook callback.
+    //
+    void SetChangingState(BOOL changing)
+    {
+        InterlockedExchange(&InChangingState, changing ? 1 : 0);
+    }
+
+    //
+    // see WindowTable::TagUnused, MDI frames are aged the same way.
+    //
+    void TagWindowsUnused()
+    {
+        int i;
+        for (i = 0; i < WINDOW_SHARDS; i++) _Shards[i].TagUnused();
+        for (i = 0; i < _MdiFramesLength; i++)
+        {
+            if (_MdiFrames[i].m_hwndFrame != NULL && _MdiFrames[i].m_nUnusedCount < 100)
+            {
+                _MdiFrames[i].m_nUnusedCount++;
+            }
+        }
+    }
+
+    //
+    // restore all the top level windows, see MonitorKeeperEngine.cpp
+    //
+    void RestoreWindowPositions(int monitors);
+
+    //
+    // watching windows after a restore, see MonitorKeeperEngine.cpp
+    //
+    void StartAccuracySampling(const RestoreItem * items, int count, int from, int to);
+    BOOL SampleAccuracy();
+    void FinishAccuracySampling();
+    int FindAccuracyEntry(HWND hwnd, DWORD pid, int from, int to);
+
+    //
+    // locked layouts, see MonitorKeeperEngine.cpp
+    //
+    void LockLayout(BOOL lock);
+    BOOL WindowMoved(HWND hwnd);
+    void Enforce();
+
+    //
+    // storms, see MonitorKeeperEngine.cpp
+    //
+    void BeginStorm();
+    int SaveDelayForEvent();
+    void StormSaved();
+    void EndStorm();
+
+    //
+    // display sleep, see MonitorKeeperEngine.cpp
+    //
+    int WindowsOutOfPlace();
+
+    //
+    // the minute by minute metrics, see MonitorKeeperMetrics.cpp
+    //
+    MetricsRecord & CurrentMinute();
+    void WriteMetricsMinute();
+
+    //
+    // save the MDI children of a frame. Most frames with that class name have
+    // an MDICLIENT; any that don't cost us just the one lookup.
+    //
+    void SaveMdiChildren(HWND hwndFrame, int NumMonitors, int Session)
+    {
+        HWND hwndClient = FindWindowEx(hwndFrame, NULL, _T("MDIClient"), NULL);
+        if (hwndClient == NULL) return;
+
+        MdiFrameData * frame = NULL;
+        MdiFrameData * unused = NULL;
+        int i;
+        for (i = 0; i < _MdiFramesLength; i++)
+        {
+            if (_MdiFrames[i].m_hwndFrame == hwndFrame) {
+                frame = &(_MdiFrames[i]);
+                break;
+            }
+            if (unused == NULL &&
+                (_MdiFrames[i].m_hwndFrame == NULL || _MdiFrames[i].m_nUnusedCount > 2)) {
+                unused = &(_MdiFrames[i]);
+            }
+        }
+        if (frame == NULL) {
+            if (unused == NULL) {
+                int newlength = _MdiFramesLength + 4;
+                MdiFrameData * newdata = new MdiFrameData[newlength];
+                for (i = 0; i < _MdiFramesLength; i++) {
+                    newdata[i] = _MdiFrames[i];
+                }
+                if (_MdiFrames != NULL) {
+                    delete[] _MdiFrames;
+                }
+                _MdiFrames = newdata;
+                unused = &(_MdiFrames[_MdiFramesLength]);
+                _MdiFramesLength = newlength;
+            }
+            frame = unused;
+            frame->Free();
+            frame->m_hwndFrame = hwndFrame;
+        }
+        frame->m_hwndClient = hwndClient;
+        frame->m_nUnusedCount = 0;
+        frame->SaveChildren(NumMonitors, Session);
+    }
+
+#ifdef _DEBUG
+    //
+    // check each shard's hash and free list against a plain search of its
+    // array, which is how FindWindowSlot used to work, that every window
+    // is in the shard it hashes to, and that the monitor lists hold every
+    // indexed placement once. Returns the number of problems found, each one
+    // is logged.
+    //
+    int VerifyWindowTable()
+    {
+        TCHAR sz[128];
+        int problems = 0;
+        int s, i, j;
+        for (s = 0; s < WINDOW_SHARDS; s++)
+        {
+            WindowTable & shard = _Shards[s];
+            int hashed = 0;
+            for (i = 0; i < shard.m_nHashSize; i++)
+            {
+                if (shard.m_hashTable[i] != 0) hashed++;
+            }
+            int used = 0;
+            for (i = 0; i < shard.m_nLength; i++)
+            {
+                HWND hwnd = shard.m_data[i].m_hwnd;
+                if (hwnd == NULL) continue;
+                used++;
+
+                // the first slot with this HWND is the one a search would find.
+                for (j = 0; j < i && shard.m_data[j].m_hwnd != hwnd; j++);
+                if (&ShardFor(hwnd) != &shard) {
+                    wsprintf(sz, _T("Table check: %p in shard %d\n"), hwnd, s);
+                    LogMessage(sz);
+                    problems++;
+                }
+                else if (j < i) {
+                    wsprintf(sz, _T("Table check: shard %d slots %d and %d both hold %p\n"), s, j, i, hwnd);
+                    LogMessage(sz);
+                    problems++;
+                }
+                else if (shard.HashFind(hwnd) != i) {
+                    wsprintf(sz, _T("Table check: shard %d hash finds %d for slot %d\n"), s, shard.HashFind(hwnd), i);
+                    LogMessage(sz);
+                    problems++;
+                }
+            }
+            if (hashed != used) {
+                wsprintf(sz, _T("Table check: shard %d %d hashed, %d slots used\n"), s, hashed, used);
+                LogMessage(sz);
+                problems++;
+            }
+            for (i = 0; i < shard.m_nFreeSlots; i++)
+            {
+                if (!shard.m_data[shard.m_freeSlots[i]].m_bOnFreeList) {
+                    wsprintf(sz, _T("Table check: shard %d free slot %d not marked\n"), s, shard.m_freeSlots[i]);
+                    LogMessage(sz);
+                    problems++;
+                }
+            }
+            int indexed = 0;
+            for (i = 0; i < shard.m_nLength * MAX_LAYOUTS; i++)
+            {
+                if (shard.PlacementNode(i).m_nOnMonitor != 0) indexed++;
+            }
+            int listed = 0;
+            for (i = 0; i < MAX_MONITORS; i++)
+            {
+                int prev = 0;
+                for (j = shard.m_monitorHeads[i]; j != 0 && listed <= indexed; j = shard.PlacementNode(j - 1).m_nNextOnMonitor)
+                {
+                    SavedPlacement & p = shard.PlacementNode(j - 1);
+                    if (p.m_nOnMonitor != i + 1 || p.m_nPrevOnMonitor != prev) {
+                        wsprintf(sz, _T("Table check: shard %d node %d misfiled on monitor %d\n"), s, j - 1, i);
+                        LogMessage(sz);
+                        problems++;
+                    }
+                    prev = j;
+                    listed++;
+                }
+            }
+            if (listed != indexed) {
+                wsprintf(sz, _T("Table check: shard %d %d placements indexed, %d listed\n"), s, indexed, listed);
+                LogMessage(sz);
+                problems++;
+            }
+        }
+        return problems;
+    }
+#endif
+
+    WindowTable & ShardFor(HWND hwnd)
+    {
+        return _Shards[(WindowHash(hwnd) >> WINDOW_SHARDSHIFT) & (WINDOW_SHARDS - 1)];
+    }
+
+    //
+    // the saved data for a window, NULL if we aren't tracking it.
+    //
+    SavedWindowData * FindSavedWindow(HWND hwnd)
+    {
+        WindowTable & shard = ShardFor(hwnd);
+        int i = shard.HashFind(hwnd);
+        return i >= 0 ? &(shard.m_data[i]) : NULL;
+    }
+
+    //
+    // find slot for the window we found.
+    SavedWindowData * FindWindowSlot(HWND hwnd)
+    {
+        return ShardFor(hwnd).FindWindowSlot(hwnd);
+    }
+
+    int TotalSlots()
+    {
+        int total = 0;
+        int i;
+        for (i = 0; i < WINDOW_SHARDS; i++) total += _Shards[i].m_nLength;
+        return total;
+    }
+
+    //
+    // in external only mode we skip windows that are only on the built in
+    // panel, it never goes away so there is nothing to put back.
+    //
+    BOOL IsOnRemovableMonitor(HWND hwnd)
+    {
+        if (IsIconic(hwnd)) {
+            // no useful rectangle, keep tracking it if we were before it was minimized.
+            return FindSavedWindow(hwnd) != NULL;
+        }
+        RECT r, overlap;
+        GetWindowRect(hwnd, &r);
+        int i;
+        for (i = 0; i < _NumRemovableMonitors; i++)
+        {
+            if (IntersectRect(&overlap, &r, &_RemovableMonitors[i])) return true;
+        }
+        return false;
+    }
+
+    //
+    // the index in _KnownMonitors of a monitor, -1 if we've never seen it.
+    //
+    int FindKnownMonitor(LPCWSTR szDevice)
+    {
+        int i;
+        for (i = 0; i < _NumKnownMonitors; i++)
+        {
+            if (lstrcmpi(_KnownMonitors[i].m_szDevice, szDevice) == 0) return i;
+        }
+        return -1;
+    }
+
+    //
+    // the present monitor a rectangle in screen coordinates is on: the one
+    // holding its middle, or failing that the nearest, as MonitorFromRect
+    // would pick. This is a look at our own list rather than a call into the
+    // kernel, so it costs nothing on a save. -1 if we don't know the monitors.
+    //
+    int FindMonitor(const RECT & r)
+    {
+        LONG x = r.left + (r.right - r.left) / 2;
+        LONG y = r.top + (r.bottom - r.top) / 2;
+        int nearest = -1;
+        LONGLONG nearestDistance = 0;
+        int i;
+        for (i = 0; i < _NumKnownMonitors; i++)
+        {
+            if (!_KnownMonitors[i].m_bPresent) continue;
+            const RECT & m = _KnownMonitors[i].m_rcMonitor;
+            LONGLONG dx = x < m.left ? m.left - x : (x >= m.right ? x - m.right + 1 : 0);
+            LONGLONG dy = y < m.top ? m.top - y : (y >= m.bottom ? y - m.bottom + 1 : 0);
+            if (dx == 0 && dy == 0) return i;
+            if (nearest < 0 || dx * dx + dy * dy < nearestDistance) {
+                nearest = i;
+                nearestDistance = dx * dx + dy * dy;
+            }
+        }
+        return nearest;
+    }
+
+    //
+    // after a window is saved for a monitor configuration, file the placement
+    // under the monitor it lies on. The caller holds the window's shard.
+    //
+    void IndexSavedWindow(SavedWindowData * data, int NumMonitors, int Session)
+    {
+        WindowTable & shard = ShardFor(data->m_hwnd);
+        int layout = data->FindLayout(NumMonitors, Session);
+        if (layout < 0) return;
+        // rcNormalPosition is relative to the primary monitor's work area, as
+        // in PublishPlacement.
+        RECT r = data->m_layouts[layout].m_place.rcNormalPosition;
+        if ((GetWindowLong(data->m_hwnd, GWL_EXSTYLE) & WS_EX_TOOLWINDOW) == 0) OffsetRect(&r, _WorkOffset.x, _WorkOffset.y);
+        shard.IndexPlacement((int)(data - shard.m_data), layout, FindMonitor(r));
+    }
+
+    //
+    // the windows whose placement for a monitor configuration is on a known
+    // monitor, NumMonitors 0 for any configuration. Only the placements on
+    // that monitor are visited. Fills in up to max of them and returns how
+    // many there are; they stay valid while the caller holds the table.
+    //
+    int WindowsOnMonitor(int monitor, int NumMonitors, int Session, SavedWindowData ** found, int max)
+    {
+        if (monitor < 0 || monitor >= MAX_MONITORS) return 0;
+        int count = 0;
+        int s;
+        for (s = 0; s < WINDOW_SHARDS; s++)
+        {
+            WindowTable & shard = _Shards[s];
+            int node = shard.m_monitorHeads[monitor];
+            while (node != 0)
+            {
+                SavedPlacement & p = shard.PlacementNode(node - 1);
+                SavedWindowData & data = shard.m_data[(node - 1) / MAX_LAYOUTS];
+                node = p.m_nNextOnMonitor;
+                if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+                if (NumMonitors != 0 && (p.m_nMonitors != NumMonitors || p.m_nSession != Session)) continue;
+                if (count < max) found[count] = &data;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    HWINEVENTHOOK		_Hook;
+    WindowTable			_Shards[WINDOW_SHARDS]; // see ShardFor
+    int					_PassCount;             // number of save passes
+    int					_PassSaved;             // windows saved in the current pass
+    int					_PassCalls;             // calls into the kernel on other windows by the current pass
+    int					_LastPassMicroseconds;  // time the last save pass took
+    int					_NumMonitors;
+    int					_Session;           // SESSION_CONSOLE or SESSION_REMOTE, selects the layout set
+    BOOL				_SessionSwitched;   // layout set changed since the last restore
+    BOOL				_ExternalOnly;          // only track windows on removable monitors
+    RECT				_RemovableMonitors[MAX_MONITORS];
+    int					_NumRemovableMonitors;
+    KnownMonitor		_KnownMonitors[MAX_MONITORS];   // every monitor seen, see UpdateKnownMonitors
+    int					_NumKnownMonitors;
+    POINT				_WorkOffset;            // the primary work area from its monitor's corner, see IndexSavedWindow
+    Settings * volatile _Settings;         // see CurrentSettings
+    Settings * volatile _RetiredSettings;
+    TCHAR				_SettingsFile[MAX_PATH];
+    MdiFrameData * _MdiFrames;
+    int					_MdiFramesLength;
+    RestoreMetrics		_RestoreMetrics[NUM_RESTORESTRATEGIES];
+    AccuracySample * _AccuracySamples;      // windows from the last restore still being watched
+    int					_NumAccuracySamples;
+    DWORD				_AccuracyStart;         // tick count when the last restore finished
+    AccuracyEntry		_AccuracyEntries[MAX_ACCURACYENTRIES];
+    int					_NumAccuracyEntries;
+    DWORD				_AccuracyRestores;      // restores sampled so far
+    BOOL				_LayoutLocked;
+    HWND				_Drifted[MAX_DRIFTED];  // locked windows that moved, see WindowMoved
+    int					_NumDrifted;
+    BOOL				_DriftOverflow;         // some drifted windows aren't in _Drifted
+    EnforceMetrics		_EnforceMetrics;
+    LONG volatile		_InStorm;               // see SaveDelayForEvent
+    DWORD volatile		_StormStart;
+    DWORD volatile		_LastEventTick;
+    DWORD volatile		_FirstEventTick;        // first move since the last save pass, 0 if none
+    DWORD volatile		_RateStart;             // window moves counted since this tick
+    LONG volatile		_RateEvents;
+    LONG volatile		_EventsCounted;         // moves since the last minute was written
+    LONG volatile		_LastSaveDelay;         // from the last WindowMovedSaveDelay, -1 before any
+    StormMetrics		_StormMetrics;
+    BOOL				_DisplayAsleep;         // see DisplayPowerChanged
+    BOOL				_Waking;                // displays are back on, monitors may not be yet
+    DWORD				_WakeTick;
+    int					_SleepChanges;          // display changes while asleep
+    PowerMetrics		_PowerMetrics;
+    HANDLE				_MetricsFile;           // MonitorKeeper.metrics, see OpenMetrics
+    MetricsHeader		_MetricsHeader;
+    MetricsRecord		_MetricsMinute;         // this minute so far
+    ULONGLONG			_MetricsCpuMs;          // process CPU time when the last minute was written
+    LONG volatile		_EventsDelivered;       // since the last minute was written
+    HWND				_MainWnd;
+    LONG volatile		InChangingState;        // see SetChangingState
+    SRWLOCK				_TableLock;             // see LockTable
+    HANDLE				_DiagFile;              // MonitorKeeper.diag, see OpenDiagnostics
+    HANDLE				_DiagMapping;
+    DiagHeader *		_Diag;
+    SRWLOCK				_LogLock;               // the diagnostics log and _LogInfo
+#ifdef _DEBUG
+    TCHAR				_LogInfo[LOGBUFFERSIZE];
+#endif
+};
+
+
+LPCTSTR TranslateShowCommand(int nShowCmd);
+void ClassifyMonitors();
+void UpdateKnownMonitors(InstanceData & inst);
+void WindowAppName(HWND hwnd, LPTSTR szName, int len);
+BOOL ProcessMonitors();
+BOOL SwitchSession(int session);
+BOOL DisplayPowerChanged(BOOL on);
+void ProcessDesktopWindows();
+BOOL CaptureWindow(HWND hwnd);
+BOOL IsTrackedWindow(HWND hwnd);
+void ForgetClassVerdicts();
+BOOL SampleRestoreAccuracy();
+void SetLayoutLocked(BOOL lock);
+BOOL CheckWindowDrift(HWND hwnd);
+void EnforceLayout();
+void BeginWindowStorm();
+int WindowMovedSaveDelay();
+Settings * ReadSettings(LPCTSTR szFile);
+void LoadSettings();
+void StartSettingsWatcher();
+void StopSettingsWatcher();
+int RunBenchmark();
+int RunFuzz(LPCTSTR szArgs);
+int RunStress(LPCTSTR szArgs);
+void OpenMetrics();
+void FlushMetrics();
+void CloseMetrics();
+int RunMetricsReport();
+DiagHeader * CreateDiagnostics(HANDLE hFile, DWORD capacity, HANDLE * phMapping);
+void AppendDiagnostic(DiagHeader * diag, DiagRecord & record);
+int QueryDiagnostics(const DiagHeader * diag, const DiagQuery & query, DiagRecord * records, int max);
+LPCTSTR DiagEventName(int event);
+void OpenDiagnostics();
+void CloseDiagnostics();
+int RunDiagnosticsQuery(LPCTSTR szArgs);
+void OpenTrace();
+void FlushTrace();
+void CloseTrace();
+void TraceWindowMoved(HWND hwnd);
+void TracePass(int monitors, int session);
+void TraceWindowSaved(SavedWindowData & data, int monitors, int session);
+void TraceRestore(int monitors, int session);
+TraceRecord * ReadTrace(LPCTSTR szFile, int & count);
+int ReplayTrace(InstanceData * inst, const TraceRecord * records, int count);
+MKFeedHeader * CreateFeedRing(LPCTSTR szName, HANDLE * phMapping);
+void PublishFeedRecord(MKFeedHeader * feed, DWORD dwEvent, HWND hwnd, const RECT & rc, int monitors, int session);
+int ReadFeedRing(const MKFeedHeader * feed, LONG & next, MKFeedRecord * records, int max, int & lost);
+void OpenEventFeed();
+void CloseEventFeed();
+void PublishWindowMoved(HWND hwnd);
+void PublishTopology(DWORD dwEvent);
+void StartCreationHook();
+void StopCreationHook();
+void PublishPlacement(SavedWindowData & data, int monitors, int session);
+int RunCreationHookHelper();
+HWINEVENTHOOK StartEventFilter(HWND hwndNotify);
+void StopEventFilter();
+int TakeHookEvents(HWND * hwnds, int max, BOOL & lost, BOOL & stalled);
+int TakeFilteredEvents();
+void ShowInspector(HINSTANCE hInstance, HWND hwndParent);
+BOOL IsInspectorMessage(MSG * msg);
@@ -0,0 +1,157 @@
+// MonitorKeeperFeed.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// The event feed, a ring of MKFeedRecords in a named file mapping that
+// other programs read while we write. See MonitorKeeperApi.h for the layout.
+//
+// Only MonitorKeeper.exe's window thread publishes, so the writer needs no
+// lock. A record's dwSequence is set to a number no reader can be waiting
+// for while the record is written, and to its own number once it is done;
+// a reader copies the record and checks dwSequence before and after, so
+// one overwritten under it is counted as lost instead of read half changed.
+//
+
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperApi.h"
+
+#define FEED_WRITING 0x80000000     // added to the sequence while a record is written
+
+static HANDLE s_hFeedMapping = NULL;
+static MKFeedHeader * s_pFeed = NULL;
+
+static MKFeedRecord * FeedRecords(const MKFeedHeader * feed)
+{
+    return (MKFeedRecord *)(feed + 1);
+}
+
+//
+// create the ring, or pick up where the last one left off if a reader kept
+// it open while we restarted. szName NULL makes a private one.
+//
+MKFeedHeader * CreateFeedRing(LPCTSTR szName, HANDLE * phMapping)
+{
+    DWORD size = sizeof(MKFeedHeader) + MK_FEED_CAPACITY * sizeof(MKFeedRecord);
+    HANDLE h = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, szName);
+    if (h == NULL) return NULL;
+    MKFeedHeader * feed = (MKFeedHeader *)MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (feed == NULL) {
+        CloseHandle(h);
+        return NULL;
+    }
+    if (feed->dwMagic != MK_FEED_MAGIC || feed->dwVersion != MK_FEED_VERSION ||
+        feed->dwCapacity != MK_FEED_CAPACITY || feed->cbRecord != sizeof(MKFeedRecord))
+    {
+        ZeroMemory(feed, size);
+        feed->dwCapacity = MK_FEED_CAPACITY;
+        feed->cbRecord = sizeof(MKFeedRecord);
+        feed->dwVersion = MK_FEED_VERSION;
+        // so no record looks complete until it is written
+        int i;
+        for (i = 0; i < MK_FEED_CAPACITY; i++) FeedRecords(feed)[i].dwSequence = FEED_WRITING;
+        InterlockedExchange((LONG volatile *)&feed->dwMagic, MK_FEED_MAGIC);
+    }
+    feed->dwProducerId = GetCurrentProcessId();
+    *phMapping = h;
+    return feed;
+}
+
+void PublishFeedRecord(MKFeedHeader * feed, DWORD dwEvent, HWND hwnd, const RECT & rc, int monitors, int session)
+{
+    LONG seq = feed->dwNext;
+    MKFeedRecord & r = FeedRecords(feed)[(DWORD)seq & (MK_FEED_CAPACITY - 1)];
+    InterlockedExchange(&r.dwSequence, (LONG)((DWORD)seq + FEED_WRITING));
+    r.dwEvent = dwEvent;
+    r.dwTime = GetTickCount();
+    r.nMonitors = monitors;
+    r.hwnd = (ULONGLONG)(UINT_PTR)hwnd;
+    r.rcWindow = rc;
+    r.nSession = session;
+    InterlockedExchange(&r.dwSequence, seq);
+    InterlockedExchange(&feed->dwNext, (LONG)((DWORD)seq + 1));
+}
+
+//
+// copy out the records from next on, moving next past them. Sequence
+// numbers wrap, so they are only ever compared by their difference.
+//
+int ReadFeedRing(const MKFeedHeader * feed, LONG & next, MKFeedRecord * records, int max, int & lost)
+{
+    LONG head = feed->dwNext;
+    MemoryBarrier();
+    lost = 0;
+    LONG behind = (LONG)((DWORD)head - (DWORD)next);
+    if (behind < 0) {
+        // the writer started again with a new ring
+        next = head;
+        return 0;
+    }
+    if (behind > MK_FEED_CAPACITY) {
+        lost = behind - MK_FEED_CAPACITY;
+        next = (LONG)((DWORD)head - MK_FEED_CAPACITY);
+    }
+
+    int count = 0;
+    while (next != head && count < max)
+    {
+        const MKFeedRecord & r = FeedRecords(feed)[(DWORD)next & (MK_FEED_CAPACITY - 1)];
+        LONG before = r.dwSequence;
+        MemoryBarrier();
+        records[count] = r;
+        MemoryBarrier();
+        if (before == next && r.dwSequence == next) {
+            count++;
+        }
+        else {
+            lost++;
+        }
+        next = (LONG)((DWORD)next + 1);
+    }
+    return count;
+}
+
+//
+// MonitorKeeper.exe's own feed, see MK_FEED_NAME.
+//
+void OpenEventFeed()
+{
+    s_pFeed = CreateFeedRing(MK_FEED_NAME, &s_hFeedMapping);
+}
+
+void CloseEventFeed()
+{
+    if (s_pFeed == NULL) return;
+    UnmapViewOfFile(s_pFeed);
+    CloseHandle(s_hFeedMapping);
+    s_pFeed = NULL;
+    s_hFeedMapping = NULL;
+}
+
+//
+// only top level windows, which is what readers can do anything with.
+//
+void PublishWindowMoved(HWND hwnd)
+{
+    if (s_pFeed == NULL || GetAncestor(hwnd, GA_ROOT) != hwnd) return;
+    RECT rc;
+    if (!GetWindowRect(hwnd, &rc)) return;
+    PublishFeedRecord(s_pFeed, MK_EVENT_WINDOWMOVED, hwnd, rc,
+        InstanceData::g_Instance._NumMonitors, InstanceData::g_Instance._Session);
+}
+
+//
+// a monitor or session change, with the virtual screen it left us.
+//
+void PublishTopology(DWORD dwEvent)
+{
+    if (s_pFeed == NULL) return;
+    RECT rc;
+    rc.left = GetSystemMetrics(SM_XVIRTUALSCREEN);
+    rc.top = GetSystemMetrics(SM_YVIRTUALSCREEN);
+    rc.right = rc.left + GetSystemMetrics(SM_CXVIRTUALSCREEN);
+    rc.bottom = rc.top + GetSystemMetrics(SM_CYVIRTUALSCREEN);
+    PublishFeedRecord(s_pFeed, dwEvent, NULL, rc,
+        GetSystemMetrics(SM_CMONITORS), InstanceData::g_Instance._Session);
+}
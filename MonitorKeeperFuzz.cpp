@@ -0,0 +1,381 @@
+// MonitorKeeperFuzz.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// Random window histories against the window table, run with
+// "MonitorKeeper.exe /fuzz [seed]". Windows are created, moved and
+// destroyed, their handles are reused, save passes run and the monitor
+// configuration changes, all on a private InstanceData with made up HWNDs.
+// The same history is kept in a plain array searched from the start, and
+// after every pass the two are compared: which windows are tracked, the
+// placements kept for each configuration, which windows a restore would
+// put back and where, and which are filed under each monitor.
+//
+// Any difference is written to MonitorKeeper.fuzz.txt beside the
+// executable, with the seed that repeats it. The exit code is the number
+// of differences.
+//
+
+#include "MonitorKeeperEngine.h"
+
+#define FUZZ_STEPS          200000
+#define FUZZ_HANDLES        512         // made up HWNDs, reused once their window is destroyed
+#define FUZZ_MONITORS       4
+#define FUZZ_MAXREPORTED    50
+#define FUZZ_BUFFERSIZE     16384
+
+struct FuzzLayout {
+    int					m_nMonitors;
+    int					m_nSession;
+    DWORD				m_dwLastUsed;
+    RECT				m_rc;
+};
+
+//
+// the model of one slot. An entry stays after its window has been unused
+// for three passes, because the table may still hold the slot until another
+// window needs it; see FuzzSave.
+//
+struct FuzzWindow {
+    HWND				m_hwnd;
+    int					m_nUnusedCount;
+    FuzzLayout			m_layouts[MAX_LAYOUTS];
+    int					m_nLayouts;
+};
+
+struct FuzzState {
+    InstanceData *		m_pInst;
+    FuzzWindow			m_model[FUZZ_HANDLES];
+    int					m_nModel;
+    BOOL				m_bAlive[FUZZ_HANDLES];     // indexed like BenchHwnd
+    RECT				m_rcWindow[FUZZ_HANDLES];   // where each live window is now
+    int					m_nMonitors;
+    int					m_nSession;
+    DWORD				m_dwStamp;
+    DWORD				m_dwRandom;
+    int					m_nStep;
+    int					m_nDifferences;
+    char *				m_szOut;
+    int					m_nOut;
+};
+
+static DWORD FuzzRandom(FuzzState & state, DWORD range)
+{
+    // xorshift32, never 0 once seeded with anything else.
+    DWORD x = state.m_dwRandom;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state.m_dwRandom = x;
+    return x % range;
+}
+
+static HWND FuzzHwnd(int n)
+{
+    return (HWND)(UINT_PTR)(0x10000 + n * 2);
+}
+
+static void FuzzDifference(FuzzState & state, const char * what, HWND hwnd)
+{
+    state.m_nDifferences++;
+    if (state.m_nDifferences > FUZZ_MAXREPORTED || state.m_nOut > FUZZ_BUFFERSIZE - 128) return;
+    state.m_nOut += wsprintfA(state.m_szOut + state.m_nOut, "step %d: %s, window %p, %d monitors, session %d\r\n",
+        state.m_nStep, what, hwnd, state.m_nMonitors, state.m_nSession);
+}
+
+static FuzzWindow * FuzzFind(FuzzState & state, HWND hwnd)
+{
+    int i;
+    for (i = 0; i < state.m_nModel; i++)
+    {
+        if (state.m_model[i].m_hwnd == hwnd) return &state.m_model[i];
+    }
+    return NULL;
+}
+
+//
+// monitors side by side, as in BenchTable.
+//
+static void FuzzRect(FuzzState & state, RECT & r)
+{
+    r.left = (LONG)FuzzRandom(state, FUZZ_MONITORS * 1920 - 400);
+    r.top = (LONG)FuzzRandom(state, 1080 - 300);
+    r.right = r.left + 100 + (LONG)FuzzRandom(state, 300);
+    r.bottom = r.top + 100 + (LONG)FuzzRandom(state, 200);
+}
+
+static int FuzzMonitor(const RECT & r)
+{
+    int x = r.left + (r.right - r.left) / 2;
+    return min(x / 1920, FUZZ_MONITORS - 1);
+}
+
+//
+// save one live window, in the table the way SaveWindowsCallback does
+// without asking the window, and in the model.
+//
+static void FuzzSave(FuzzState & state, int n)
+{
+    HWND hwnd = FuzzHwnd(n);
+    InstanceData * inst = state.m_pInst;
+    FuzzWindow * model = FuzzFind(state, hwnd);
+
+    //
+    // a window unused for three passes may or may not have lost its slot
+    // to another window yet; both are right, so follow the table.
+    if (model != NULL && model->m_nUnusedCount > 2 && inst->FindSavedWindow(hwnd) == NULL) {
+        model->m_nLayouts = 0;
+    }
+    if (model == NULL) {
+        if (state.m_nModel >= FUZZ_HANDLES) return;
+        model = &state.m_model[state.m_nModel++];
+        model->m_hwnd = hwnd;
+        model->m_nLayouts = 0;
+    }
+    model->m_nUnusedCount = 0;
+
+    int i;
+    int oldest = -1;
+    for (i = 0; i < model->m_nLayouts; i++)
+    {
+        if (model->m_layouts[i].m_nMonitors == state.m_nMonitors && model->m_layouts[i].m_nSession == state.m_nSession) break;
+        if (oldest < 0 || model->m_layouts[i].m_dwLastUsed < model->m_layouts[oldest].m_dwLastUsed) oldest = i;
+    }
+    if (i == model->m_nLayouts) {
+        if (model->m_nLayouts < MAX_LAYOUTS) model->m_nLayouts++;
+        else i = oldest;
+    }
+    FuzzLayout & layout = model->m_layouts[i];
+    layout.m_nMonitors = state.m_nMonitors;
+    layout.m_nSession = state.m_nSession;
+    layout.m_dwLastUsed = ++state.m_dwStamp;
+    layout.m_rc = state.m_rcWindow[n];
+
+    SavedWindowData * pData = inst->FindWindowSlot(hwnd);
+    pData->m_nUnusedCount = 0;
+    WINDOWPLACEMENT * place = pData->PlacementForSave(state.m_nMonitors, state.m_nSession);
+    ZeroMemory(place, sizeof(WINDOWPLACEMENT));
+    place->length = sizeof(WINDOWPLACEMENT);
+    place->showCmd = SW_SHOWNORMAL;
+    place->rcNormalPosition = state.m_rcWindow[n];
+    inst->IndexSavedWindow(pData, state.m_nMonitors, state.m_nSession);
+}
+
+//
+// a save pass, as in ProcessDesktopWindows: everything ages, then the live
+// windows are saved again.
+//
+static void FuzzPass(FuzzState & state)
+{
+    state.m_pInst->TagWindowsUnused();
+    int i;
+    for (i = 0; i < state.m_nModel; i++)
+    {
+        if (state.m_model[i].m_nUnusedCount < 100) state.m_model[i].m_nUnusedCount++;
+    }
+    for (i = 0; i < FUZZ_HANDLES; i++)
+    {
+        if (state.m_bAlive[i]) FuzzSave(state, i);
+    }
+}
+
+static BOOL FuzzSameRect(const RECT & a, const RECT & b)
+{
+    return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+//
+// the model against the table.
+//
+static void FuzzCompare(FuzzState & state)
+{
+    InstanceData * inst = state.m_pInst;
+    int i, j;
+
+    //
+    // every window in use has its placements, and nothing else.
+    for (i = 0; i < state.m_nModel; i++)
+    {
+        FuzzWindow & model = state.m_model[i];
+        SavedWindowData * pData = inst->FindSavedWindow(model.m_hwnd);
+        if (model.m_nUnusedCount > 2) {
+            if (pData != NULL && pData->m_nUnusedCount <= 2) FuzzDifference(state, "unused window still in use", model.m_hwnd);
+            continue;
+        }
+        if (pData == NULL) {
+            FuzzDifference(state, "window lost", model.m_hwnd);
+            continue;
+        }
+        if (pData->m_nUnusedCount != model.m_nUnusedCount) FuzzDifference(state, "unused count", model.m_hwnd);
+        int layouts = 0;
+        for (j = 0; j < MAX_LAYOUTS; j++)
+        {
+            if (pData->m_layouts[j].m_nMonitors != 0) layouts++;
+        }
+        if (layouts != model.m_nLayouts) FuzzDifference(state, "layout count", model.m_hwnd);
+        for (j = 0; j < model.m_nLayouts; j++)
+        {
+            WINDOWPLACEMENT * place = pData->Placement(model.m_layouts[j].m_nMonitors, model.m_layouts[j].m_nSession);
+            if (place == NULL) FuzzDifference(state, "layout lost", model.m_hwnd);
+            else if (!FuzzSameRect(place->rcNormalPosition, model.m_layouts[j].m_rc)) FuzzDifference(state, "placement", model.m_hwnd);
+        }
+    }
+
+    //
+    // a restore puts back the same windows, as RestoreWindowPositions
+    // chooses them, to the same places.
+    int planned = 0;
+    int s;
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        WindowTable & shard = inst->_Shards[s];
+        for (i = 0; i < shard.m_nLength; i++)
+        {
+            SavedWindowData & data = shard.m_data[i];
+            if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+            WINDOWPLACEMENT * place = data.Placement(state.m_nMonitors, state.m_nSession);
+            if (place == NULL || place->length != sizeof(WINDOWPLACEMENT)) continue;
+            planned++;
+            FuzzWindow * model = FuzzFind(state, data.m_hwnd);
+            if (model == NULL || model->m_nUnusedCount > 2) {
+                FuzzDifference(state, "restores an unused window", data.m_hwnd);
+                continue;
+            }
+            for (j = 0; j < model->m_nLayouts; j++)
+            {
+                if (model->m_layouts[j].m_nMonitors == state.m_nMonitors && model->m_layouts[j].m_nSession == state.m_nSession) break;
+            }
+            if (j == model->m_nLayouts || !FuzzSameRect(place->rcNormalPosition, model->m_layouts[j].m_rc)) {
+                FuzzDifference(state, "restore placement", data.m_hwnd);
+            }
+        }
+    }
+    int expected = 0;
+    int onMonitor[FUZZ_MONITORS];
+    ZeroMemory(onMonitor, sizeof(onMonitor));
+    for (i = 0; i < state.m_nModel; i++)
+    {
+        FuzzWindow & model = state.m_model[i];
+        if (model.m_nUnusedCount > 2) continue;
+        for (j = 0; j < model.m_nLayouts; j++)
+        {
+            if (model.m_layouts[j].m_nMonitors != state.m_nMonitors || model.m_layouts[j].m_nSession != state.m_nSession) continue;
+            expected++;
+            onMonitor[FuzzMonitor(model.m_layouts[j].m_rc)]++;
+        }
+    }
+    if (planned != expected) FuzzDifference(state, "restore count", NULL);
+
+    //
+    // and the monitor lists agree with a search.
+    SavedWindowData * found[1];
+    for (i = 0; i < FUZZ_MONITORS; i++)
+    {
+        if (inst->WindowsOnMonitor(i, state.m_nMonitors, state.m_nSession, found, 0) != onMonitor[i]) {
+            FuzzDifference(state, "windows on monitor", NULL);
+        }
+    }
+#ifdef _DEBUG
+    state.m_nDifferences += inst->VerifyWindowTable();
+#endif
+}
+
+static void FuzzStep(FuzzState & state)
+{
+    int n = (int)FuzzRandom(state, FUZZ_HANDLES);
+    DWORD op = FuzzRandom(state, 100);
+    if (op < 30) {
+        // a window opens, with a handle a destroyed one had if it is free.
+        if (!state.m_bAlive[n]) {
+            state.m_bAlive[n] = true;
+            FuzzRect(state, state.m_rcWindow[n]);
+        }
+    }
+    else if (op < 60) {
+        if (state.m_bAlive[n]) FuzzRect(state, state.m_rcWindow[n]);
+    }
+    else if (op < 80) {
+        state.m_bAlive[n] = false;
+    }
+    else if (op < 85) {
+        // MKCaptureWindow saves one window between passes.
+        if (state.m_bAlive[n]) FuzzSave(state, n);
+    }
+    else if (op < 98) {
+        FuzzPass(state);
+        FuzzCompare(state);
+    }
+    else {
+        state.m_nMonitors = 2 + (int)FuzzRandom(state, MAX_LAYOUTS + 2);
+        state.m_nSession = (int)FuzzRandom(state, 2);
+    }
+}
+
+static BOOL FuzzFileName(LPTSTR szFile, LPCTSTR szSuffix)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    int len = lstrlen(szSettings);
+    if (len < 4 || len - 3 + lstrlen(szSuffix) >= MAX_PATH) return false;
+    lstrcpyn(szFile, szSettings, len - 3 + 1);      // keeps the '.'
+    lstrcat(szFile, szSuffix);
+    return true;
+}
+
+//
+// szArgs is the rest of the command line, a decimal seed or nothing for
+// one from the clock.
+//
+int RunFuzz(LPCTSTR szArgs)
+{
+    TCHAR szResults[MAX_PATH];
+    if (!FuzzFileName(szResults, _T("fuzz.txt"))) return -1;
+
+    DWORD seed = 0;
+    while (*szArgs == ' ') szArgs++;
+    for (; *szArgs >= '0' && *szArgs <= '9'; szArgs++) seed = seed * 10 + (*szArgs - '0');
+    if (*szArgs != '\0') return -1;
+    if (seed == 0) seed = GetTickCount() | 1;
+
+    FuzzState * state = new FuzzState;
+    ZeroMemory(state, sizeof(FuzzState));
+    state->m_pInst = new InstanceData();
+    state->m_dwRandom = seed;
+    state->m_nMonitors = 2;
+    state->m_nSession = SESSION_CONSOLE;
+    state->m_szOut = new char[FUZZ_BUFFERSIZE];
+    state->m_nOut = wsprintfA(state->m_szOut, "seed %u\r\n", seed);
+
+    InstanceData * inst = state->m_pInst;
+    inst->_NumKnownMonitors = FUZZ_MONITORS;
+    int i;
+    for (i = 0; i < FUZZ_MONITORS; i++)
+    {
+        KnownMonitor & monitor = inst->_KnownMonitors[i];
+        wsprintf(monitor.m_szDevice, _T("\\\\.\\DISPLAY%d"), i + 1);
+        monitor.m_rcMonitor.left = i * 1920;
+        monitor.m_rcMonitor.top = 0;
+        monitor.m_rcMonitor.right = (i + 1) * 1920;
+        monitor.m_rcMonitor.bottom = 1080;
+        monitor.m_bPresent = true;
+    }
+
+    for (state->m_nStep = 0; state->m_nStep < FUZZ_STEPS; state->m_nStep++) FuzzStep(*state);
+    FuzzPass(*state);
+    FuzzCompare(*state);
+
+    state->m_nOut += wsprintfA(state->m_szOut + state->m_nOut, "%d steps, %d differences\r\n",
+        FUZZ_STEPS, state->m_nDifferences);
+    HANDLE h = CreateFile(szResults, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (h != INVALID_HANDLE_VALUE) {
+        DWORD written;
+        WriteFile(h, state->m_szOut, state->m_nOut, &written, NULL);
+        CloseHandle(h);
+    }
+    int differences = state->m_nDifferences;
+    delete[] state->m_szOut;
+    delete state->m_pInst;
+    delete state;
+    return differences;
+}
@@ -0,0 +1,203 @@
+// MonitorKeeperHook.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// MonitorKeeperHook.dll, loaded into other applications by the WH_CBT hook
+// MonitorKeeper.exe sets when [Hook] Enabled=1, and by the in context event
+// hook it sets when [Hook] Events=1. See MonitorKeeperHook.h.
+// It runs inside every application that creates or moves a window, so it
+// does as little as it can: the table and ring are opened once when the DLL
+// loads, each new window costs a class name and a lookup, and each move
+// a few style checks.
+//
+
+#include "MonitorKeeperHook.h"
+#include "MonitorKeeperClasses.h"
+
+static HANDLE s_hTable = NULL;
+static const HookPlacementTable * s_pTable = NULL;
+static WCHAR s_szExe[MAX_PATH];         // this process's executable, no path
+static HANDLE s_hRing = NULL;
+static HookEventRing * s_pRing = NULL;
+static HWND s_hwndNotify = NULL;        // from the HookNotify, read once
+
+//
+// this application's side of the event filter. The hook can be called on
+// any of its threads, and these are only ever a reason to forward an event
+// or not, so they aren't locked; the worst a race does is forward a move
+// twice or count one filtered event too few.
+//
+static HWND s_hwndPending = NULL;       // the last window forwarded
+static LONG volatile s_ClassVerdicts[CLASS_VERDICTS];     // see IsExcludedClass
+static LONG s_nPendingPosition = 0;     // and where it went in the ring
+static LONG s_nFiltered = 0;            // not yet added to m_nFiltered
+
+static void OpenTable()
+{
+    WCHAR szPath[MAX_PATH];
+    DWORD len = GetModuleFileNameW(NULL, szPath, MAX_PATH);
+    if (len == 0 || len >= MAX_PATH) return;
+    LPCWSTR szName = szPath + len;
+    while (szName > szPath && szName[-1] != '\\') szName--;
+    lstrcpyW(s_szExe, szName);
+
+    s_hTable = OpenFileMappingW(FILE_MAP_READ, false, HOOK_TABLENAME);
+    if (s_hTable == NULL) return;
+    s_pTable = (const HookPlacementTable *)MapViewOfFile(s_hTable, FILE_MAP_READ, 0, 0, sizeof(HookPlacementTable));
+    if (s_pTable != NULL &&
+        (s_pTable->m_dwMagic != HOOK_MAGIC || s_pTable->m_dwVersion != HOOK_VERSION || s_pTable->m_dwSize != HOOK_TABLESIZE)) {
+        UnmapViewOfFile(s_pTable);
+        s_pTable = NULL;
+    }
+}
+
+static void OpenRing()
+{
+    HANDLE hNotify = OpenFileMappingW(FILE_MAP_READ, false, HOOK_NOTIFYNAME);
+    if (hNotify == NULL) return;
+    const HookNotify * notify = (const HookNotify *)MapViewOfFile(hNotify, FILE_MAP_READ, 0, 0, sizeof(HookNotify));
+    if (notify != NULL && notify->m_dwMagic == HOOK_NOTIFYMAGIC && notify->m_dwVersion == HOOK_VERSION) {
+        s_hwndNotify = (HWND)(UINT_PTR)notify->m_hwndNotify;
+    }
+    if (notify != NULL) UnmapViewOfFile(notify);
+    CloseHandle(hNotify);
+    if (s_hwndNotify == NULL) return;
+
+    s_hRing = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, false, HOOK_EVENTSNAME);
+    if (s_hRing == NULL) return;
+    s_pRing = (HookEventRing *)MapViewOfFile(s_hRing, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(HookEventRing));
+    if (s_pRing != NULL &&
+        (s_pRing->m_dwMagic != HOOK_EVENTMAGIC || s_pRing->m_dwVersion != HOOK_VERSION || s_pRing->m_dwSize != HOOK_EVENTSIZE)) {
+        UnmapViewOfFile(s_pRing);
+        s_pRing = NULL;
+    }
+}
+
+static void CloseTable()
+{
+    if (s_pTable != NULL) UnmapViewOfFile(s_pTable);
+    if (s_hTable != NULL) CloseHandle(s_hTable);
+    if (s_pRing != NULL) UnmapViewOfFile(s_pRing);
+    if (s_hRing != NULL) CloseHandle(s_hRing);
+    s_pTable = NULL;
+    s_hTable = NULL;
+    s_pRing = NULL;
+    s_hRing = NULL;
+}
+
+//
+// true if a window of the class, other than hwnd, is already at rc. The
+// table only has one entry for an application's windows of a class, so
+// the second one opened would be put on top of the first.
+//
+static BOOL PlacementTaken(HWND hwnd, LPCWSTR szClass, const RECT & rc)
+{
+    HWND other = NULL;
+    while ((other = FindWindowExW(NULL, other, szClass, NULL)) != NULL)
+    {
+        RECT rcOther;
+        if (other != hwnd && GetWindowRect(other, &rcOther) && EqualRect(&rcOther, &rc)) return true;
+    }
+    return false;
+}
+
+//
+// only titled top level windows, the ones MonitorKeeper saves. The saved
+// position is only used if it is for the monitors and session we have now,
+// is still on one of them, and isn't where a window like it already is.
+//
+static void PlaceNewWindow(HWND hwnd, CREATESTRUCTW * cs)
+{
+    if (cs->hwndParent != NULL || (cs->style & WS_CHILD) != 0 || (cs->style & WS_CAPTION) != WS_CAPTION) return;
+
+    WCHAR szClass[40];
+    if (RealGetWindowClassW(hwnd, szClass, 40) == 0) return;
+    HookPlacement found;
+    if (!HookFind(s_pTable, HookKey(s_szExe, szClass), HookCheck(s_szExe, szClass), found)) return;
+    if (found.m_nMonitors != GetSystemMetrics(SM_CMONITORS)) return;
+    if (found.m_nSession != (GetSystemMetrics(SM_REMOTESESSION) ? 1 : 0)) return;
+    if (MonitorFromRect(&found.m_rcWindow, MONITOR_DEFAULTTONULL) == NULL) return;
+    if (PlacementTaken(hwnd, szClass, found.m_rcWindow)) return;
+
+    cs->x = found.m_rcWindow.left;
+    cs->y = found.m_rcWindow.top;
+    cs->cx = found.m_rcWindow.right - found.m_rcWindow.left;
+    cs->cy = found.m_rcWindow.bottom - found.m_rcWindow.top;
+}
+
+extern "C" LRESULT CALLBACK MKCreationHookProc(int nCode, WPARAM wParam, LPARAM lParam)
+{
+    if (nCode == HCBT_CREATEWND && s_pTable != NULL) {
+        PlaceNewWindow((HWND)wParam, ((CBT_CREATEWNDW *)lParam)->lpcs);
+    }
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
+}
+
+//
+// the same test as IsTrackedWindow in MonitorKeeperEngine.cpp, MonitorKeeper
+// does nothing with moves of any other window.
+//
+static BOOL IsTrackedWindow(HWND hwnd)
+{
+    if (IsExcludedClass(hwnd, s_ClassVerdicts)) return false;
+    if (!IsWindowVisible(hwnd) || GetParent(hwnd) != NULL) return false;
+    DWORD dwStyle = (DWORD)GetWindowLong(hwnd, GWL_STYLE);
+    DWORD dwExStyle = (DWORD)GetWindowLong(hwnd, GWL_EXSTYLE);
+    return ((dwStyle & (WS_OVERLAPPEDWINDOW)) != 0 ||
+        (dwExStyle & WS_EX_APPWINDOW) != 0)
+        &&
+        (dwExStyle & (WS_EX_NOACTIVATE)) == 0;
+}
+
+static void FilterEvent()
+{
+    if (++s_nFiltered >= HOOK_FILTERBATCH) {
+        InterlockedExchangeAdd(&s_pRing->m_nFiltered, s_nFiltered);
+        s_nFiltered = 0;
+    }
+}
+
+//
+// moves of anything but a tracked window are dropped, and so is a move of
+// the window we last forwarded if MonitorKeeper hasn't read that yet: it
+// looks at where the window is when it gets to it, so one is enough.
+//
+extern "C" void CALLBACK MKEventHookProc(HWINEVENTHOOK hWinEventHook, DWORD dwEvent, HWND hwnd, LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime)
+{
+    if (s_pRing == NULL) return;
+    if (hwnd == NULL || idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !IsTrackedWindow(hwnd)) {
+        FilterEvent();
+        return;
+    }
+    if (hwnd == s_hwndPending && HookEventPending(s_pRing, s_nPendingPosition)) {
+        FilterEvent();
+        return;
+    }
+    LONG position;
+    if (HookPostEvent(s_pRing, s_hwndNotify, dwEvent, hwnd, position)) {
+        s_hwndPending = hwnd;
+        s_nPendingPosition = position;
+    }
+    if (s_nFiltered > 0) {
+        InterlockedExchangeAdd(&s_pRing->m_nFiltered, s_nFiltered);
+        s_nFiltered = 0;
+    }
+}
+
+BOOL APIENTRY DllMain(HMODULE hModule, DWORD dwReason, LPVOID lpReserved)
+{
+    switch (dwReason)
+    {
+    case DLL_PROCESS_ATTACH:
+        DisableThreadLibraryCalls(hModule);
+        OpenTable();
+        OpenRing();
+        break;
+    case DLL_PROCESS_DETACH:
+        CloseTable();
+        break;
+    }
+    return TRUE;
+}
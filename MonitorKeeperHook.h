@@ -0,0 +1,273 @@
+// MonitorKeeperHook.h
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// The placement table MonitorKeeper.exe shares with MonitorKeeperHook.dll.
+// The DLL is loaded into every application by a WH_CBT hook, and when a
+// titled top level window is created it looks up where that application's
+// window of that class was last saved and changes the CREATESTRUCT, so the
+// window is created there instead of being moved after it shows.
+//
+// Windows are looked up by a hash of the executable name and window class.
+// The table is open addressed, probing at most HOOK_MAXPROBE entries, and
+// readers take no lock: an entry's m_nVersion is odd while MonitorKeeper is
+// writing it, and a reader that sees it change while copying ignores the
+// entry. Only MonitorKeeper writes, one thread at a time.
+//
+// With [Hook] Events=1 the DLL also filters window move events inside the
+// application that raised them, see HookEventRing, so MonitorKeeper isn't
+// sent every caret and child window move on the desktop.
+//
+// This header is included by the DLL, so it uses nothing but windows.h.
+//
+
+#pragma once
+
+#include <windows.h>
+
+#define HOOK_TABLENAME L"Local\\MonitorKeeperPlacements"
+#define HOOK_MAGIC 0x504b4d4d       // "MMKP"
+#define HOOK_VERSION 3
+#define HOOK_TABLESIZE 2048         // a power of two
+#define HOOK_MAXPROBE 8
+#define HOOK_PROCNAME "MKCreationHookProc"
+
+#define HOOK_EVENTSNAME L"Local\\MonitorKeeperEvents"
+#define HOOK_EVENTMAGIC 0x454b4d4d  // "MMKE"
+#define HOOK_EVENTSIZE 1024         // a power of two
+#define HOOK_EVENTPROCNAME "MKEventHookProc"
+#define HOOK_FILTERBATCH 256        // events an application filters before it adds them to m_nFiltered
+#define HOOK_STALLTIME 1000         // ms an event may stay taken but unwritten before the reader skips it
+#define WM_HOOKEVENTS (WM_USER + 102)   // posted to MonitorKeeper when there are events in the ring
+#define HOOK_NOTIFYNAME L"Local\\MonitorKeeperNotify"
+#define HOOK_NOTIFYMAGIC 0x4e4b4d4d // "MMKN"
+
+struct HookPlacement {
+    LONG volatile		m_nVersion;         // odd while being written
+    DWORD				m_dwKey;            // 0 for an empty entry
+    DWORD				m_dwCheck;          // a second hash, so collisions on m_dwKey don't match
+    int					m_nMonitors;        // the monitor count it was saved with
+    int					m_nSession;         // and the session, 0 console or 1 remote as SESSION_
+    RECT				m_rcWindow;         // normal position, screen coordinates
+};
+
+struct HookPlacementTable {
+    DWORD				m_dwMagic;
+    DWORD				m_dwVersion;
+    DWORD				m_dwSize;           // HOOK_TABLESIZE
+    DWORD				m_dwProducerId;     // MonitorKeeper.exe, the /hook helper waits for it
+    HookPlacement		m_entries[HOOK_TABLESIZE];
+};
+
+//
+// FNV-1a of the lower case executable name then the class, with a different
+// basis for the check hash. Never 0.
+//
+inline DWORD HookHash(LPCWSTR szExe, LPCWSTR szClass, DWORD basis)
+{
+    DWORD h = basis;
+    LPCWSTR p;
+    for (p = szExe; *p != '\0'; p++)
+    {
+        WCHAR c = *p;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619;
+    }
+    h = (h ^ '|') * 16777619;
+    for (p = szClass; *p != '\0'; p++) h = (h ^ *p) * 16777619;
+    return h != 0 ? h : 1;
+}
+
+inline DWORD HookKey(LPCWSTR szExe, LPCWSTR szClass)
+{
+    return HookHash(szExe, szClass, 2166136261);
+}
+
+inline DWORD HookCheck(LPCWSTR szExe, LPCWSTR szClass)
+{
+    return HookHash(szExe, szClass, 0x5bd1e995);
+}
+
+//
+// copy out the entry for key, or return false.
+//
+inline BOOL HookFind(const HookPlacementTable * table, DWORD key, DWORD check, HookPlacement & found)
+{
+    int i;
+    for (i = 0; i < HOOK_MAXPROBE; i++)
+    {
+        const HookPlacement & entry = table->m_entries[(key + i) & (HOOK_TABLESIZE - 1)];
+        LONG version = entry.m_nVersion;
+        if (version & 1) continue;
+        MemoryBarrier();
+        if (entry.m_dwKey == 0) return false;
+        if (entry.m_dwKey != key) continue;
+        found = *(const HookPlacement *)&entry;
+        MemoryBarrier();
+        if (entry.m_nVersion == version && found.m_dwCheck == check) return true;
+    }
+    return false;
+}
+
+//
+// the writer's side. An entry for another window is only replaced when all
+// HOOK_MAXPROBE entries are in use, and then the first one goes.
+//
+inline void HookStore(HookPlacementTable * table, DWORD key, DWORD check, int monitors, int session, const RECT & rc)
+{
+    HookPlacement * target = NULL;
+    int i;
+    for (i = 0; i < HOOK_MAXPROBE; i++)
+    {
+        HookPlacement & entry = table->m_entries[(key + i) & (HOOK_TABLESIZE - 1)];
+        if (entry.m_dwKey == 0 || (entry.m_dwKey == key && entry.m_dwCheck == check)) {
+            target = &entry;
+            break;
+        }
+    }
+    if (target == NULL) target = &table->m_entries[key & (HOOK_TABLESIZE - 1)];
+    if (target->m_dwKey == key && target->m_dwCheck == check &&
+        target->m_nMonitors == monitors && target->m_nSession == session && EqualRect(&target->m_rcWindow, &rc)) return;
+
+    InterlockedIncrement(&target->m_nVersion);
+    target->m_dwKey = key;
+    target->m_dwCheck = check;
+    target->m_nMonitors = monitors;
+    target->m_nSession = session;
+    target->m_rcWindow = rc;
+    InterlockedIncrement(&target->m_nVersion);
+}
+
+//
+// window moves forwarded by the event hook. Any number of applications
+// write and MonitorKeeper's window thread reads. A writer takes a position
+// by moving m_nNext on, unless the ring is full, and marks the event
+// written by setting m_nSequence to its position + 1. The reader stops at
+// the first event not yet written; its writer posts WM_HOOKEVENTS again
+// when it is done, because the reader clears m_nPosted before it starts.
+// A writer that never finishes, suspended, killed or hostile, would stop
+// the reader for good, so after HOOK_STALLTIME its event is skipped.
+//
+struct HookEvent {
+    LONG volatile		m_nSequence;        // position + 1 once written
+    DWORD				m_dwEvent;
+    ULONGLONG			m_hwnd;
+};
+
+struct HookEventRing {
+    DWORD				m_dwMagic;
+    DWORD				m_dwVersion;
+    DWORD				m_dwSize;           // HOOK_EVENTSIZE
+    DWORD				m_dwReserved;
+    LONG volatile		m_nNext;            // position written next
+    LONG volatile		m_nRead;            // position read next
+    LONG volatile		m_nPosted;          // 1 while a WM_HOOKEVENTS is on its way
+    LONG volatile		m_nFiltered;        // events dropped or coalesced by applications
+    LONG volatile		m_nOverflows;       // events dropped because the ring was full
+    HookEvent			m_events[HOOK_EVENTSIZE];
+};
+
+//
+// the window WM_HOOKEVENTS is posted to. The ring has to be writable by low
+// integrity applications, so this is in a mapping of its own that only
+// MonitorKeeper can write; otherwise a sandboxed process could have every
+// hooked application post to a window of its choosing.
+//
+struct HookNotify {
+    DWORD				m_dwMagic;
+    DWORD				m_dwVersion;
+    ULONGLONG			m_hwndNotify;       // MonitorKeeper's main window
+};
+
+//
+// the writer's side. Returns false if the ring was full, in which case
+// MonitorKeeper is still told, so it can save everything instead.
+//
+inline BOOL HookPostEvent(HookEventRing * ring, HWND hwndNotify, DWORD dwEvent, HWND hwnd, LONG & position)
+{
+    BOOL posted = false;
+    LONG next = ring->m_nNext;
+    for (;;)
+    {
+        if ((DWORD)next - (DWORD)ring->m_nRead >= HOOK_EVENTSIZE) {
+            InterlockedIncrement(&ring->m_nOverflows);
+            break;
+        }
+        LONG prev = InterlockedCompareExchange(&ring->m_nNext, (LONG)((DWORD)next + 1), next);
+        if (prev == next) {
+            HookEvent & e = ring->m_events[(DWORD)next & (HOOK_EVENTSIZE - 1)];
+            e.m_dwEvent = dwEvent;
+            e.m_hwnd = (ULONGLONG)(UINT_PTR)hwnd;
+            InterlockedExchange(&e.m_nSequence, (LONG)((DWORD)next + 1));
+            position = next;
+            posted = true;
+            break;
+        }
+        next = prev;
+    }
+    if (InterlockedExchange(&ring->m_nPosted, 1) == 0) {
+        PostMessageW(hwndNotify, WM_HOOKEVENTS, 0, 0);
+    }
+    return posted;
+}
+
+//
+// true while the event written at position hasn't been read.
+//
+inline BOOL HookEventPending(const HookEventRing * ring, LONG position)
+{
+    return (LONG)((DWORD)position - (DWORD)ring->m_nRead) >= 0;
+}
+
+//
+// where the reader last stopped at an unwritten event. Applications can
+// write the ring, so this is kept in MonitorKeeper instead.
+//
+struct HookEventReader {
+    BOOL				m_bStalled;
+    LONG				m_nStalledAt;       // the position of the unwritten event
+    DWORD				m_dwStalledSince;   // GetTickCount when it was first seen
+};
+
+//
+// the reader's side, copies out up to max windows. skipped is set if an
+// event was given up on, and we don't know which window moved. While
+// reader.m_bStalled is set the caller has to call again later, no one may
+// post WM_HOOKEVENTS.
+//
+inline int HookTakeEvents(HookEventRing * ring, HookEventReader & reader, HWND * hwnds, int max, BOOL & skipped)
+{
+    InterlockedExchange(&ring->m_nPosted, 0);
+    LONG read = ring->m_nRead;
+    int count = 0;
+    skipped = false;
+    while (count < max)
+    {
+        const HookEvent & e = ring->m_events[(DWORD)read & (HOOK_EVENTSIZE - 1)];
+        if (e.m_nSequence == (LONG)((DWORD)read + 1)) {
+            MemoryBarrier();
+            hwnds[count++] = (HWND)(UINT_PTR)e.m_hwnd;
+        } else if (read == ring->m_nNext) {
+            reader.m_bStalled = false;
+            break;
+        } else if (!reader.m_bStalled || reader.m_nStalledAt != read) {
+            // taken but not written yet.
+            reader.m_bStalled = true;
+            reader.m_nStalledAt = read;
+            reader.m_dwStalledSince = GetTickCount();
+            break;
+        } else if (GetTickCount() - reader.m_dwStalledSince < HOOK_STALLTIME) {
+            break;
+        } else {
+            // if its writer does finish, the sequence no longer matches the
+            // next time round the ring.
+            reader.m_bStalled = false;
+            skipped = true;
+        }
+        read = (LONG)((DWORD)read + 1);
+    }
+    InterlockedExchange(&ring->m_nRead, read);
+    return count;
+}
@@ -0,0 +1,350 @@
+// MonitorKeeperInspector.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// The Inspect Windows... dialog, a live view of the window table. The list
+// is owner data: it only asks for the rows it is drawing, so it costs the
+// same with 10,000 windows as with 10.
+//
+// Once a second the table is copied into a snapshot of InspectorRows, one
+// shard at a time under the shard's shared lock, so CaptureWindow threads
+// wait for at most one shard's copy. Rows are formatted from the snapshot
+// when the list asks for them, without any lock.
+//
+// Double clicking a window shows what the diagnostics log has about it.
+//
+
+#include "MonitorKeeperEngine.h"
+#include <commctrl.h>
+
+#pragma comment(lib, "comctl32.lib")
+
+#define INSPECTOR_REFRESH 1000      // ms between snapshots
+#define INSPECTOR_TIMER 1
+#define INSPECTOR_HISTORY 16        // diagnostics records shown for a window
+
+//
+// the parts of a SavedPlacement the inspector shows.
+//
+struct InspectorLayout {
+    int					m_nMonitors;        // 0 if unused
+    int					m_nSession;
+    RECT				m_rcNormal;
+    UINT				m_showCmd;
+};
+
+struct InspectorRow {
+    HWND				m_hwnd;
+    TCHAR				m_wndClass[40];
+    DWORD				m_dwProcessId;
+    DWORD				m_dwThreadId;
+    int					m_nUnusedCount;
+    BOOL				m_bLocked;
+    BOOL				m_bDrifted;
+    InspectorLayout		m_layouts[MAX_LAYOUTS];
+};
+
+static HWND s_hInspector = NULL;
+static InspectorRow * s_pRows = NULL;
+static int s_nRows = 0;
+static int s_nRowsAllocated = 0;
+static int s_nMonitors = 0;                 // at the time of the snapshot
+static int s_nSession = 0;
+
+static const LPCTSTR s_szColumns[] = {
+    _T("Window"), _T("Class"), _T("Process"), _T("Thread"), _T("Last seen"), _T("State"), _T("Layouts"), _T("Placement")
+};
+static const int s_nColumnWidths[] = { 70, 140, 60, 60, 80, 60, 90, 160 };
+#define INSPECTOR_COLUMNS (sizeof(s_nColumnWidths) / sizeof(s_nColumnWidths[0]))
+
+static int SnapshotShard(WindowTable & shard, int count)
+{
+    int i;
+    for (i = 0; i < shard.m_nLength && count < s_nRowsAllocated; i++)
+    {
+        const SavedWindowData & data = shard.m_data[i];
+        if (data.m_hwnd == NULL || data.m_bOnFreeList) continue;
+        InspectorRow & row = s_pRows[count++];
+        row.m_hwnd = data.m_hwnd;
+        lstrcpyn(row.m_wndClass, data.m_wndClass, 40);
+        row.m_dwProcessId = data.m_dwProcessId;
+        row.m_dwThreadId = data.m_dwThreadId;
+        row.m_nUnusedCount = data.m_nUnusedCount;
+        row.m_bLocked = data.m_bLocked;
+        row.m_bDrifted = data.m_bDrifted;
+        int l;
+        for (l = 0; l < MAX_LAYOUTS; l++)
+        {
+            const SavedPlacement & saved = data.m_layouts[l];
+            InspectorLayout & layout = row.m_layouts[l];
+            layout.m_nMonitors = saved.m_nMonitors;
+            layout.m_nSession = saved.m_nSession;
+            layout.m_rcNormal = saved.m_place.rcNormalPosition;
+            layout.m_showCmd = saved.m_place.showCmd;
+        }
+    }
+    return count;
+}
+
+static void TakeSnapshot()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    inst.LockTableShared();
+    int slots = inst.TotalSlots();
+    if (slots > s_nRowsAllocated) {
+        if (s_pRows != NULL) delete[] s_pRows;
+        s_nRowsAllocated = slots + slots / 4;
+        s_pRows = new InspectorRow[s_nRowsAllocated];
+    }
+    s_nMonitors = inst._NumMonitors;
+    s_nSession = inst._Session;
+    int count = 0;
+    int s;
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        inst._Shards[s].LockShared();
+        count = SnapshotShard(inst._Shards[s], count);
+        inst._Shards[s].UnlockShared();
+    }
+    inst.UnlockTableShared();
+    s_nRows = count;
+}
+
+static void ShowStats(HWND hDlg)
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    TCHAR sz[256];
+    wsprintf(sz, _T("%d windows in %d slots. %d monitors, %s session. Save pass %d took %d us and %d calls.%s"),
+        s_nRows, inst.TotalSlots(), s_nMonitors, s_nSession == SESSION_REMOTE ? _T("remote") : _T("console"),
+        inst._PassCount, inst._LastPassMicroseconds, inst._PassCalls,
+        inst._LayoutLocked ? _T(" Layout locked.") : _T(""));
+    SetDlgItemText(hDlg, IDC_INSPECTORSTATS, sz);
+}
+
+static void Refresh(HWND hDlg)
+{
+    TakeSnapshot();
+    HWND list = GetDlgItem(hDlg, IDC_INSPECTORLIST);
+    ListView_SetItemCountEx(list, s_nRows, LVSICF_NOINVALIDATEALL | LVSICF_NOSCROLL);
+    InvalidateRect(list, NULL, false);
+    ShowStats(hDlg);
+}
+
+//
+// "2 3 4r", with the layout for the current monitors in brackets.
+//
+static void FormatLayouts(const InspectorRow & row, LPTSTR sz)
+{
+    int len = 0;
+    int l;
+    sz[0] = '\0';
+    for (l = 0; l < MAX_LAYOUTS; l++)
+    {
+        const InspectorLayout & layout = row.m_layouts[l];
+        if (layout.m_nMonitors == 0) continue;
+        BOOL current = layout.m_nMonitors == s_nMonitors && layout.m_nSession == s_nSession;
+        len += wsprintf(sz + len, current ? _T("%s[%d%s]") : _T("%s%d%s"), len > 0 ? _T(" ") : _T(""),
+            layout.m_nMonitors, layout.m_nSession == SESSION_REMOTE ? _T("r") : _T(""));
+    }
+}
+
+static void FormatPlacement(const InspectorRow & row, LPTSTR sz)
+{
+    int l;
+    sz[0] = '\0';
+    for (l = 0; l < MAX_LAYOUTS; l++)
+    {
+        const InspectorLayout & layout = row.m_layouts[l];
+        if (layout.m_nMonitors != s_nMonitors || layout.m_nSession != s_nSession) continue;
+        const RECT & r = layout.m_rcNormal;
+        wsprintf(sz, _T("%d,%d %dx%d %s"), r.left, r.top, r.right - r.left, r.bottom - r.top,
+            TranslateShowCommand(layout.m_showCmd));
+        return;
+    }
+}
+
+static void GetRowText(int index, int column, LPTSTR sz, int max)
+{
+    TCHAR text[MAX_LAYOUTS * 8 + 96];
+    const InspectorRow & row = s_pRows[index];
+    text[0] = '\0';
+    switch (column)
+    {
+    case 0:
+        wsprintf(text, _T("%08X"), (DWORD)(UINT_PTR)row.m_hwnd);
+        break;
+    case 1:
+        lstrcpy(text, row.m_wndClass);
+        break;
+    case 2:
+        wsprintf(text, _T("%u"), row.m_dwProcessId);
+        break;
+    case 3:
+        wsprintf(text, _T("%u"), row.m_dwThreadId);
+        break;
+    case 4:
+        if (row.m_nUnusedCount == 0) lstrcpy(text, _T("last pass"));
+        else wsprintf(text, _T("%d passes ago"), row.m_nUnusedCount);
+        break;
+    case 5:
+        lstrcpy(text, row.m_bDrifted ? _T("drifted") : (row.m_bLocked ? _T("locked") : _T("")));
+        break;
+    case 6:
+        FormatLayouts(row, text);
+        break;
+    case 7:
+        FormatPlacement(row, text);
+        break;
+    }
+    lstrcpyn(sz, text, max);
+}
+
+//
+// the newest records about the window first. The log is only closed by
+// the main window, on this thread, so it can be read without _LogLock.
+//
+static void ShowWindowHistory(HWND hDlg, int index)
+{
+    const DiagHeader * diag = InstanceData::g_Instance._Diag;
+    if (index < 0 || index >= s_nRows) return;
+    const InspectorRow & row = s_pRows[index];
+    TCHAR sz[INSPECTOR_HISTORY * (DIAG_TEXTLEN + 16) + 128];
+    int len = wsprintf(sz, _T("%08X %s\n\n"), (DWORD)(UINT_PTR)row.m_hwnd, row.m_wndClass);
+    int count = 0;
+    if (diag != NULL) {
+        DiagQuery query;
+        ZeroMemory(&query, sizeof(query));
+        query.m_dwHwnd = (DWORD)(UINT_PTR)row.m_hwnd;
+        query.m_nEvent = -1;
+        DiagRecord records[INSPECTOR_HISTORY];
+        count = QueryDiagnostics(diag, query, records, INSPECTOR_HISTORY);
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            ULARGE_INTEGER t;
+            t.QuadPart = records[i].m_ftTime;
+            FILETIME utc, local;
+            utc.dwLowDateTime = t.LowPart;
+            utc.dwHighDateTime = t.HighPart;
+            FileTimeToLocalFileTime(&utc, &local);
+            SYSTEMTIME st;
+            FileTimeToSystemTime(&local, &st);
+            len += wsprintf(sz + len, _T("%02d:%02d:%02d  %s\n"), st.wHour, st.wMinute, st.wSecond, records[i].m_szText);
+        }
+    }
+    if (count == 0) lstrcpy(sz + len, diag != NULL ? _T("Nothing has been logged about this window.") : _T("The diagnostics log is off."));
+    MessageBox(hDlg, sz, _T("Window History"), MB_OK);
+}
+
+static void InitList(HWND hDlg)
+{
+    HWND list = GetDlgItem(hDlg, IDC_INSPECTORLIST);
+    ListView_SetExtendedListViewStyle(list, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+    LVCOLUMN column;
+    column.mask = LVCF_TEXT | LVCF_WIDTH;
+    int i;
+    for (i = 0; i < (int)INSPECTOR_COLUMNS; i++)
+    {
+        column.pszText = (LPTSTR)s_szColumns[i];
+        column.cx = s_nColumnWidths[i];
+        ListView_InsertColumn(list, i, &column);
+    }
+}
+
+//
+// the list fills the dialog below the stats line.
+//
+static void LayoutInspector(HWND hDlg)
+{
+    RECT client, stats;
+    GetClientRect(hDlg, &client);
+    HWND hStats = GetDlgItem(hDlg, IDC_INSPECTORSTATS);
+    GetWindowRect(hStats, &stats);
+    MapWindowPoints(NULL, hDlg, (LPPOINT)&stats, 2);
+    int margin = stats.left;
+    MoveWindow(hStats, margin, stats.top, client.right - 2 * margin, stats.bottom - stats.top, true);
+    int top = stats.bottom + margin;
+    MoveWindow(GetDlgItem(hDlg, IDC_INSPECTORLIST), margin, top,
+        client.right - 2 * margin, max(0, (int)client.bottom - top - margin), true);
+}
+
+static INT_PTR CALLBACK InspectorProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    switch (message)
+    {
+    case WM_INITDIALOG:
+        InitList(hDlg);
+        LayoutInspector(hDlg);
+        Refresh(hDlg);
+        SetTimer(hDlg, INSPECTOR_TIMER, INSPECTOR_REFRESH, NULL);
+        return (INT_PTR)TRUE;
+
+    case WM_TIMER:
+        if (wParam == INSPECTOR_TIMER && IsWindowVisible(hDlg) && !IsIconic(hDlg)) Refresh(hDlg);
+        return (INT_PTR)TRUE;
+
+    case WM_SIZE:
+        LayoutInspector(hDlg);
+        return (INT_PTR)TRUE;
+
+    case WM_NOTIFY:
+    {
+        NMLVDISPINFO * info = (NMLVDISPINFO *)lParam;
+        if (info->hdr.idFrom == IDC_INSPECTORLIST && info->hdr.code == LVN_GETDISPINFO) {
+            if ((info->item.mask & LVIF_TEXT) != 0 && info->item.iItem >= 0 && info->item.iItem < s_nRows) {
+                GetRowText(info->item.iItem, info->item.iSubItem, info->item.pszText, info->item.cchTextMax);
+            }
+            return (INT_PTR)TRUE;
+        }
+        if (info->hdr.idFrom == IDC_INSPECTORLIST && info->hdr.code == NM_DBLCLK) {
+            ShowWindowHistory(hDlg, ((NMITEMACTIVATE *)lParam)->iItem);
+            return (INT_PTR)TRUE;
+        }
+    }
+    break;
+
+    case WM_COMMAND:
+        if (LOWORD(wParam) == IDOK || LOWORD(wParam) == IDCANCEL) {
+            DestroyWindow(hDlg);
+            return (INT_PTR)TRUE;
+        }
+        break;
+
+    case WM_DESTROY:
+        KillTimer(hDlg, INSPECTOR_TIMER);
+        if (s_pRows != NULL) delete[] s_pRows;
+        s_pRows = NULL;
+        s_nRows = 0;
+        s_nRowsAllocated = 0;
+        s_hInspector = NULL;
+        break;
+    }
+    return (INT_PTR)FALSE;
+}
+
+//
+// the dialog is modeless, so tracking carries on while it is open.
+//
+void ShowInspector(HINSTANCE hInstance, HWND hwndParent)
+{
+    if (s_hInspector == NULL) {
+        INITCOMMONCONTROLSEX icc;
+        icc.dwSize = sizeof(icc);
+        icc.dwICC = ICC_LISTVIEW_CLASSES;
+        InitCommonControlsEx(&icc);
+        s_hInspector = CreateDialog(hInstance, MAKEINTRESOURCE(IDD_INSPECTOR), hwndParent, InspectorProc);
+        if (s_hInspector == NULL) return;
+    }
+    ShowWindow(s_hInspector, SW_SHOW);
+    SetForegroundWindow(s_hInspector);
+}
+
+//
+// for the message loop, so tab and escape work in the dialog.
+//
+BOOL IsInspectorMessage(MSG * msg)
+{
+    return s_hInspector != NULL && IsDialogMessage(s_hInspector, msg);
+}
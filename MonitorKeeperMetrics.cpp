@@ -0,0 +1,275 @@
+// MonitorKeeperMetrics.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// Keeps a rollup of each active minute in MonitorKeeper.metrics beside the
+// executable, so trends survive restarts. The file is a MetricsHeader
+// followed by METRICS_CAPACITY MetricsRecords used as a ring; m_dwNext is
+// the record written next, and once m_dwCount reaches the capacity it is
+// also the oldest. Minutes with nothing going on aren't written, so the 6MB
+// file holds about a year of working days.
+//
+// "MonitorKeeper.exe /report" turns the file into MonitorKeeper.report.csv
+// with one line per day.
+//
+
+#include "MonitorKeeperEngine.h"
+
+static DWORD CurrentMinuteNumber()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULARGE_INTEGER t;
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return (DWORD)(t.QuadPart / 600000000);
+}
+
+static BOOL MetricsFileName(LPTSTR szFile, LPCTSTR szSuffix)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    int len = lstrlen(szSettings);
+    if (len < 4 || len - 3 + lstrlen(szSuffix) >= MAX_PATH) return false;
+    lstrcpyn(szFile, szSettings, len - 3 + 1);      // keeps the '.'
+    lstrcat(szFile, szSuffix);
+    return true;
+}
+
+static ULONGLONG ProcessCpuMs()
+{
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 10000;
+}
+
+static BOOL WriteAt(HANDLE h, DWORD offset, const void * data, DWORD size)
+{
+    DWORD written;
+    return SetFilePointer(h, (LONG)offset, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+        WriteFile(h, data, size, &written, NULL) && written == size;
+}
+
+static BOOL ReadAt(HANDLE h, DWORD offset, void * data, DWORD size)
+{
+    DWORD read;
+    return SetFilePointer(h, (LONG)offset, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+        ReadFile(h, data, size, &read, NULL) && read == size;
+}
+
+//
+// the record for this minute. The previous one is written out first if the
+// minute has changed.
+//
+MetricsRecord & InstanceData::CurrentMinute()
+{
+    DWORD minute = CurrentMinuteNumber();
+    if (_MetricsMinute.m_dwMinute != minute) {
+        WriteMetricsMinute();
+        ZeroMemory(&_MetricsMinute, sizeof(_MetricsMinute));
+        _MetricsMinute.m_dwMinute = minute;
+    }
+    return _MetricsMinute;
+}
+
+void InstanceData::WriteMetricsMinute()
+{
+    MetricsRecord & r = _MetricsMinute;
+    if (_MetricsFile == INVALID_HANDLE_VALUE || r.m_dwMinute == 0) return;
+    //
+    // these are taken whether or not the minute is written, so a quiet
+    // minute's CPU time isn't put down to the next busy one.
+    ULONGLONG cpu = ProcessCpuMs();
+    r.m_dwCpuMs = (DWORD)(cpu - _MetricsCpuMs);
+    _MetricsCpuMs = cpu;
+    r.m_dwDelivered = (DWORD)InterlockedExchange(&_EventsDelivered, 0);
+    r.m_dwEvents += (DWORD)InterlockedExchange(&_EventsCounted, 0);
+    r.m_dwFiltered = (DWORD)TakeFilteredEvents();
+    if (r.m_wPasses == 0 && r.m_wRestores == 0 && r.m_dwEvents == 0 && r.m_dwDelivered == 0) return;
+
+    if (WriteAt(_MetricsFile, sizeof(MetricsHeader) + _MetricsHeader.m_dwNext * sizeof(MetricsRecord), &r, sizeof(r))) {
+        _MetricsHeader.m_dwNext = (_MetricsHeader.m_dwNext + 1) % _MetricsHeader.m_dwCapacity;
+        if (_MetricsHeader.m_dwCount < _MetricsHeader.m_dwCapacity) _MetricsHeader.m_dwCount++;
+        WriteAt(_MetricsFile, 0, &_MetricsHeader, sizeof(_MetricsHeader));
+    }
+    r.m_dwMinute = 0;
+}
+
+//
+// open MonitorKeeper.metrics, starting it again if it isn't one we wrote.
+//
+void OpenMetrics()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    TCHAR szFile[MAX_PATH];
+    if (!MetricsFileName(szFile, _T("metrics"))) return;
+
+    HANDLE h = CreateFile(szFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return;
+
+    MetricsHeader & header = inst._MetricsHeader;
+    if (!ReadAt(h, 0, &header, sizeof(header)) || header.m_dwMagic != METRICS_MAGIC ||
+        header.m_dwVersion != METRICS_VERSION || header.m_dwCapacity != METRICS_CAPACITY ||
+        header.m_dwNext >= header.m_dwCapacity || header.m_dwCount > header.m_dwCapacity)
+    {
+        ZeroMemory(&header, sizeof(header));
+        header.m_dwMagic = METRICS_MAGIC;
+        header.m_dwVersion = METRICS_VERSION;
+        header.m_dwCapacity = METRICS_CAPACITY;
+        header.m_dwRecordSize = sizeof(MetricsRecord);
+        if (!WriteAt(h, 0, &header, sizeof(header))) {
+            CloseHandle(h);
+            return;
+        }
+    }
+    inst.LockTable();
+    inst._MetricsFile = h;
+    inst._MetricsCpuMs = ProcessCpuMs();
+    inst.UnlockTable();
+}
+
+//
+// write out the minute just finished. Called once a minute so quiet
+// minutes don't wait for the next event.
+//
+void FlushMetrics()
+{
+    InstanceData::g_Instance.LockTable();
+    InstanceData::g_Instance.CurrentMinute();
+    InstanceData::g_Instance.UnlockTable();
+}
+
+void CloseMetrics()
+{
+    InstanceData & inst = InstanceData::g_Instance;
+    inst.LockTable();
+    inst.WriteMetricsMinute();
+    if (inst._MetricsFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(inst._MetricsFile);
+    }
+    inst._MetricsFile = INVALID_HANDLE_VALUE;
+    inst.UnlockTable();
+}
+
+//
+// one line of the report, the minutes of one UTC day added up.
+//
+struct MetricsDay {
+    DWORD				m_dwDay;
+    int					m_nMinutes;
+    int					m_nPasses;
+    LONGLONG			m_llPassUs;
+    DWORD				m_dwPassMaxUs;
+    int					m_nRestores;
+    LONGLONG			m_llRestoreUs;
+    DWORD				m_dwRestoreMaxUs;
+    LONGLONG			m_llEvents;
+    int					m_nMaxSlots;
+    LONGLONG			m_llDelivered;
+    LONGLONG			m_llFiltered;
+    LONGLONG			m_llCpuMs;
+};
+
+static int WriteMetricsDay(char * out, const MetricsDay & day)
+{
+    ULARGE_INTEGER t;
+    t.QuadPart = (ULONGLONG)day.m_dwDay * 1440 * 600000000;
+    FILETIME ft;
+    ft.dwLowDateTime = t.LowPart;
+    ft.dwHighDateTime = t.HighPart;
+    SYSTEMTIME st;
+    FileTimeToSystemTime(&ft, &st);
+    int seconds = day.m_nMinutes * 60;
+    return wsprintfA(out, "%04d-%02d-%02d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\r\n",
+        st.wYear, st.wMonth, st.wDay, day.m_nMinutes,
+        day.m_nPasses, day.m_nPasses ? (int)(day.m_llPassUs / day.m_nPasses) : 0, day.m_dwPassMaxUs,
+        day.m_nRestores, day.m_nRestores ? (int)(day.m_llRestoreUs / day.m_nRestores) : 0, day.m_dwRestoreMaxUs,
+        (int)(day.m_llEvents / seconds), day.m_nMaxSlots,
+        (int)(day.m_llDelivered / seconds), (int)(day.m_llFiltered / seconds), (int)(day.m_llCpuMs / day.m_nMinutes));
+}
+
+//
+// MonitorKeeper.exe /report, oldest day first. Returns the number of days.
+//
+int RunMetricsReport()
+{
+    TCHAR szMetrics[MAX_PATH];
+    TCHAR szReport[MAX_PATH];
+    if (!MetricsFileName(szMetrics, _T("metrics")) || !MetricsFileName(szReport, _T("report.csv"))) return -1;
+
+    HANDLE h = CreateFile(szMetrics, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return -1;
+    MetricsHeader header;
+    if (!ReadAt(h, 0, &header, sizeof(header)) || header.m_dwMagic != METRICS_MAGIC ||
+        header.m_dwRecordSize != sizeof(MetricsRecord) ||
+        header.m_dwCapacity == 0 || header.m_dwCount > header.m_dwCapacity) {
+        CloseHandle(h);
+        return -1;
+    }
+
+    HANDLE hOut = CreateFile(szReport, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hOut == INVALID_HANDLE_VALUE) {
+        CloseHandle(h);
+        return -1;
+    }
+    char line[256];
+    DWORD written;
+    int len = wsprintfA(line, "date,active_minutes,passes,pass_avg_us,pass_max_us,restores,restore_avg_us,restore_max_us,events_per_sec,max_slots,"
+        "delivered_per_sec,filtered_per_sec,cpu_ms_per_min\r\n");
+    WriteFile(hOut, line, len, &written, NULL);
+
+    //
+    // read the ring in chunks, oldest first.
+    MetricsRecord * records = new MetricsRecord[1024];
+    DWORD first = header.m_dwCount < header.m_dwCapacity ? 0 : header.m_dwNext;
+    MetricsDay day;
+    ZeroMemory(&day, sizeof(day));
+    int days = 0;
+    DWORD done = 0;
+    while (done < header.m_dwCount)
+    {
+        DWORD index = (first + done) % header.m_dwCapacity;
+        DWORD n = min(min((DWORD)1024, header.m_dwCount - done), header.m_dwCapacity - index);
+        if (!ReadAt(h, sizeof(MetricsHeader) + index * sizeof(MetricsRecord), records, n * sizeof(MetricsRecord))) break;
+        DWORD i;
+        for (i = 0; i < n; i++)
+        {
+            const MetricsRecord & r = records[i];
+            if (r.m_dwMinute / 1440 != day.m_dwDay) {
+                if (day.m_nMinutes > 0) {
+                    WriteFile(hOut, line, WriteMetricsDay(line, day), &written, NULL);
+                    days++;
+                }
+                ZeroMemory(&day, sizeof(day));
+                day.m_dwDay = r.m_dwMinute / 1440;
+            }
+            day.m_nMinutes++;
+            day.m_nPasses += r.m_wPasses;
+            day.m_llPassUs += r.m_dwPassUs;
+            day.m_dwPassMaxUs = max(day.m_dwPassMaxUs, r.m_dwPassMaxUs);
+            day.m_nRestores += r.m_wRestores;
+            day.m_llRestoreUs += r.m_dwRestoreUs;
+            day.m_dwRestoreMaxUs = max(day.m_dwRestoreMaxUs, r.m_dwRestoreMaxUs);
+            day.m_llEvents += r.m_dwEvents;
+            day.m_nMaxSlots = max(day.m_nMaxSlots, (int)r.m_wSlots);
+            day.m_llDelivered += r.m_dwDelivered;
+            day.m_llFiltered += r.m_dwFiltered;
+            day.m_llCpuMs += r.m_dwCpuMs;
+        }
+        done += n;
+    }
+    if (day.m_nMinutes > 0) {
+        WriteFile(hOut, line, WriteMetricsDay(line, day), &written, NULL);
+        days++;
+    }
+    delete[] records;
+    CloseHandle(hOut);
+    CloseHandle(h);
+    return days;
+}
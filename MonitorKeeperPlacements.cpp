@@ -0,0 +1,376 @@
+// MonitorKeeperPlacements.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// MonitorKeeper.exe's side of MonitorKeeperHook.dll, see MonitorKeeperHook.h.
+// With [Hook] Enabled=1 in MonitorKeeper.ini we keep the placement table up
+// to date from every save pass and hook window creation in every
+// application, so windows that open later land where their application's
+// last window of the same class was, without being moved after they show.
+//
+// A hook DLL only goes into processes of its own bitness. To cover 32 bit
+// applications on 64 bit Windows, set [Hook] Helper32 to the 32 bit build of
+// MonitorKeeper.exe; we start it with /hook and it sets the 32 bit hook
+// until we exit. Both settings are read at startup.
+//
+// With [Hook] Events=1 the window move hook is set in context with the
+// same DLL, which forwards only moves of tracked windows through a
+// HookEventRing. Events from applications of the other bitness are still
+// sent to us out of context, and run the DLL's filter here instead.
+//
+
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperHook.h"
+#include <sddl.h>
+#include <aclapi.h>
+
+#pragma comment(lib, "advapi32.lib")
+
+static HANDLE s_hPlacementMapping = NULL;
+static HookPlacementTable * s_pPlacements = NULL;
+static SRWLOCK s_PublishLock = SRWLOCK_INIT;    // HookStore has to have one writer at a time
+static HMODULE s_hHookDll = NULL;
+static HHOOK s_hCreationHook = NULL;
+static HANDLE s_hHookThread = NULL;     // sets the creation hook and pumps its messages
+static HANDLE s_hHookStop = NULL;       // set to end that thread
+static HANDLE s_hHelper32 = NULL;
+static HANDLE s_hEventMapping = NULL;
+static HANDLE s_hNotifyMapping = NULL;  // the HookNotify, which applications can't write
+static HookEventRing * s_pEvents = NULL;
+static HMODULE s_hEventDll = NULL;
+static LONG s_nFilteredTaken = 0;       // m_nFiltered when it was last read
+static LONG s_nOverflowsTaken = 0;
+static HookEventReader s_EventReader = { false, 0, 0 };
+
+//
+// MonitorKeeperHook.dll from beside the executable.
+//
+static HMODULE LoadHookDll()
+{
+    TCHAR szDll[MAX_PATH];
+    DWORD len = GetModuleFileName(NULL, szDll, MAX_PATH);
+    if (len == 0 || len >= MAX_PATH) return NULL;
+    while (len > 0 && szDll[len - 1] != '\\') len--;
+    if (len + lstrlen(_T("MonitorKeeperHook.dll")) >= MAX_PATH) return NULL;
+    lstrcpy(szDll + len, _T("MonitorKeeperHook.dll"));
+    return LoadLibrary(szDll);
+}
+
+static HHOOK InstallCreationHook()
+{
+    s_hHookDll = LoadHookDll();
+    if (s_hHookDll == NULL) return NULL;
+    HOOKPROC proc = (HOOKPROC)GetProcAddress(s_hHookDll, HOOK_PROCNAME);
+    HHOOK hook = proc != NULL ? SetWindowsHookEx(WH_CBT, proc, s_hHookDll, 0) : NULL;
+    if (hook == NULL) {
+        FreeLibrary(s_hHookDll);
+        s_hHookDll = NULL;
+    }
+    return hook;
+}
+
+//
+// Windows calls a global hook for applications of the other bitness on the
+// thread that set it, through its message queue. That thread must do nothing
+// but pump messages, or every such application waits on window creation
+// and focus changes while it is busy. Returns when h is signalled.
+//
+static void PumpMessagesUntil(HANDLE h)
+{
+    for (;;)
+    {
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            DispatchMessage(&msg);
+        }
+        if (MsgWaitForMultipleObjects(1, &h, false, INFINITE, QS_ALLINPUT) != WAIT_OBJECT_0 + 1) return;
+    }
+}
+
+//
+// the tray's own thread runs save passes and holds the table, so the hook
+// gets a thread of its own. lParam is an event set once the hook is, or
+// isn't.
+//
+static DWORD WINAPI CreationHookThread(LPVOID lParam)
+{
+    s_hCreationHook = InstallCreationHook();
+    SetEvent((HANDLE)lParam);
+    if (s_hCreationHook == NULL) return 1;
+    PumpMessagesUntil(s_hHookStop);
+    UnhookWindowsHookEx(s_hCreationHook);
+    s_hCreationHook = NULL;
+    return 0;
+}
+
+static void StartHelper32(LPCTSTR szSettings)
+{
+    TCHAR szHelper[MAX_PATH];
+    GetPrivateProfileString(_T("Hook"), _T("Helper32"), _T(""), szHelper, MAX_PATH, szSettings);
+    if (szHelper[0] == '\0') return;
+
+    TCHAR szCommand[MAX_PATH + 16];
+    wsprintf(szCommand, _T("\"%s\" /hook"), szHelper);
+    STARTUPINFO si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    PROCESS_INFORMATION pi;
+    if (CreateProcess(NULL, szCommand, NULL, NULL, false, 0, NULL, NULL, &si, &pi)) {
+        CloseHandle(pi.hThread);
+        s_hHelper32 = pi.hProcess;
+    }
+}
+
+void StartCreationHook()
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    if (!GetPrivateProfileInt(_T("Hook"), _T("Enabled"), 0, szSettings)) return;
+
+    s_hPlacementMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+        sizeof(HookPlacementTable), HOOK_TABLENAME);
+    if (s_hPlacementMapping == NULL) return;
+    s_pPlacements = (HookPlacementTable *)MapViewOfFile(s_hPlacementMapping, FILE_MAP_ALL_ACCESS, 0, 0,
+        sizeof(HookPlacementTable));
+    if (s_pPlacements == NULL) {
+        StopCreationHook();
+        return;
+    }
+    // a table left by an earlier run is for windows that are gone.
+    ZeroMemory(s_pPlacements, sizeof(HookPlacementTable));
+    s_pPlacements->m_dwVersion = HOOK_VERSION;
+    s_pPlacements->m_dwSize = HOOK_TABLESIZE;
+    s_pPlacements->m_dwProducerId = GetCurrentProcessId();
+    InterlockedExchange((LONG volatile *)&s_pPlacements->m_dwMagic, HOOK_MAGIC);
+
+    s_hHookStop = CreateEvent(NULL, true, false, NULL);
+    HANDLE hStarted = CreateEvent(NULL, true, false, NULL);
+    if (s_hHookStop != NULL && hStarted != NULL) {
+        s_hHookThread = CreateThread(NULL, 0, CreationHookThread, hStarted, 0, NULL);
+        if (s_hHookThread != NULL) WaitForSingleObject(hStarted, INFINITE);
+    }
+    if (hStarted != NULL) CloseHandle(hStarted);
+    if (s_hCreationHook == NULL) {
+        InstanceData::g_Instance.LogMessage(_T("Creation hook not set, is MonitorKeeperHook.dll missing?\n"));
+        StopCreationHook();
+        return;
+    }
+    StartHelper32(szSettings);
+    InstanceData::g_Instance.LogMessage(_T("Creation hook set\n"));
+}
+
+void StopCreationHook()
+{
+    if (s_hHookThread != NULL) {
+        SetEvent(s_hHookStop);
+        WaitForSingleObject(s_hHookThread, INFINITE);
+        CloseHandle(s_hHookThread);
+    }
+    if (s_hHookStop != NULL) CloseHandle(s_hHookStop);
+    if (s_hHookDll != NULL) FreeLibrary(s_hHookDll);
+    if (s_pPlacements != NULL) UnmapViewOfFile(s_pPlacements);
+    if (s_hPlacementMapping != NULL) CloseHandle(s_hPlacementMapping);
+    // the helper goes when we do.
+    if (s_hHelper32 != NULL) CloseHandle(s_hHelper32);
+    s_hHookThread = NULL;
+    s_hHookStop = NULL;
+    s_hHookDll = NULL;
+    s_pPlacements = NULL;
+    s_hPlacementMapping = NULL;
+    s_hHelper32 = NULL;
+}
+
+//
+// low integrity applications, browsers mostly, have to be able to write to
+// the ring too. Only the label changes, the default DACL still keeps other
+// users out.
+//
+static void AllowLowIntegrity(HANDLE h)
+{
+    PSECURITY_DESCRIPTOR sd;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(_T("S:(ML;;NW;;;LW)"), SDDL_REVISION_1, &sd, NULL)) return;
+    BOOL present, defaulted;
+    PACL sacl;
+    if (GetSecurityDescriptorSacl(sd, &present, &sacl, &defaulted) && present) {
+        SetSecurityInfo(h, SE_KERNEL_OBJECT, LABEL_SECURITY_INFORMATION, NULL, NULL, NULL, sacl);
+    }
+    LocalFree(sd);
+}
+
+//
+// set the window move hook in context, if [Hook] Events=1. The ring has to
+// exist before the DLL is loaded here, so call this before
+// StartCreationHook. Returns NULL if the hook should be set out of context
+// as usual.
+//
+HWINEVENTHOOK StartEventFilter(HWND hwndNotify)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    if (hwndNotify == NULL || !GetPrivateProfileInt(_T("Hook"), _T("Events"), 0, szSettings)) return NULL;
+
+    //
+    // created with the default security, so low integrity applications can
+    // read it but not write it. One made before us isn't ours to trust.
+    s_hNotifyMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+        sizeof(HookNotify), HOOK_NOTIFYNAME);
+    if (s_hNotifyMapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+        InstanceData::g_Instance.LogMessage(_T("Event filter not set, its notify mapping already exists\n"));
+        StopEventFilter();
+        return NULL;
+    }
+    HookNotify * notify = s_hNotifyMapping != NULL ?
+        (HookNotify *)MapViewOfFile(s_hNotifyMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(HookNotify)) : NULL;
+    if (notify == NULL) {
+        StopEventFilter();
+        return NULL;
+    }
+    notify->m_dwVersion = HOOK_VERSION;
+    notify->m_hwndNotify = (ULONGLONG)(UINT_PTR)hwndNotify;
+    InterlockedExchange((LONG volatile *)&notify->m_dwMagic, HOOK_NOTIFYMAGIC);
+    UnmapViewOfFile(notify);
+
+    s_hEventMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+        sizeof(HookEventRing), HOOK_EVENTSNAME);
+    if (s_hEventMapping == NULL) return NULL;
+    AllowLowIntegrity(s_hEventMapping);
+    s_pEvents = (HookEventRing *)MapViewOfFile(s_hEventMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(HookEventRing));
+    if (s_pEvents == NULL) {
+        StopEventFilter();
+        return NULL;
+    }
+    ZeroMemory(s_pEvents, sizeof(HookEventRing));
+    s_pEvents->m_dwVersion = HOOK_VERSION;
+    s_pEvents->m_dwSize = HOOK_EVENTSIZE;
+    InterlockedExchange((LONG volatile *)&s_pEvents->m_dwMagic, HOOK_EVENTMAGIC);
+    ChangeWindowMessageFilterEx(hwndNotify, WM_HOOKEVENTS, MSGFLT_ALLOW, NULL);
+
+    HWINEVENTHOOK hook = NULL;
+    s_hEventDll = LoadHookDll();
+    if (s_hEventDll != NULL) {
+        WINEVENTPROC proc = (WINEVENTPROC)GetProcAddress(s_hEventDll, HOOK_EVENTPROCNAME);
+        if (proc != NULL) {
+            hook = SetWinEventHook(EVENT_OBJECT_LOCATIONCHANGE, EVENT_OBJECT_LOCATIONCHANGE, s_hEventDll, proc,
+                0, 0, WINEVENT_INCONTEXT | WINEVENT_SKIPOWNPROCESS);
+        }
+    }
+    if (hook == NULL) {
+        InstanceData::g_Instance.LogMessage(_T("Event filter not set, is MonitorKeeperHook.dll missing?\n"));
+        StopEventFilter();
+        return NULL;
+    }
+    InstanceData::g_Instance.LogMessage(_T("Event filter set\n"));
+    return hook;
+}
+
+//
+// the hook has to be gone first, events from the other bitness run the
+// DLL's filter in this process.
+//
+void StopEventFilter()
+{
+    if (s_hEventDll != NULL) FreeLibrary(s_hEventDll);
+    if (s_pEvents != NULL) UnmapViewOfFile(s_pEvents);
+    if (s_hEventMapping != NULL) CloseHandle(s_hEventMapping);
+    if (s_hNotifyMapping != NULL) CloseHandle(s_hNotifyMapping);
+    s_hNotifyMapping = NULL;
+    s_hEventDll = NULL;
+    s_pEvents = NULL;
+    s_hEventMapping = NULL;
+}
+
+//
+// the windows forwarded since the last call, for WM_HOOKEVENTS. lost is set
+// if applications found the ring full, or one never finished writing, and
+// we don't know which windows moved. stalled is set while an application
+// is still writing, call again in HOOK_STALLTIME.
+//
+int TakeHookEvents(HWND * hwnds, int max, BOOL & lost, BOOL & stalled)
+{
+    lost = false;
+    stalled = false;
+    if (s_pEvents == NULL) return 0;
+    LONG overflows = s_pEvents->m_nOverflows;
+    lost = overflows != s_nOverflowsTaken;
+    s_nOverflowsTaken = overflows;
+    BOOL skipped;
+    int count = HookTakeEvents(s_pEvents, s_EventReader, hwnds, max, skipped);
+    if (skipped) lost = true;
+    stalled = s_EventReader.m_bStalled;
+    return count;
+}
+
+//
+// events applications dropped or coalesced since the last call, for the
+// metrics. They only add them up every HOOK_FILTERBATCH, or when they
+// forward one.
+//
+int TakeFilteredEvents()
+{
+    if (s_pEvents == NULL) return 0;
+    LONG filtered = s_pEvents->m_nFiltered;
+    int count = (int)((DWORD)filtered - (DWORD)s_nFilteredTaken);
+    s_nFilteredTaken = filtered;
+    return count;
+}
+
+//
+// called by the save pass and CaptureWindow for each window saved, with the
+// window's shard or the whole table held. The key needs the executable
+// name, which is only looked up once per window; ReadAttributes clears it
+// if the HWND is reused.
+//
+void PublishPlacement(SavedWindowData & data, int monitors, int session)
+{
+    if (s_pPlacements == NULL) return;
+    WINDOWPLACEMENT * place = data.Placement(monitors, session);
+    if (place == NULL) return;
+
+    if (data.m_dwHookKey == 0) {
+        TCHAR szApp[MAX_PATH];
+        WindowAppName(data.m_hwnd, szApp, MAX_PATH);
+        data.m_dwHookKey = HookKey(szApp, data.m_wndClass);
+        data.m_dwHookCheck = HookCheck(szApp, data.m_wndClass);
+    }
+
+    //
+    // rcNormalPosition is relative to the primary monitor's work area, a
+    // new window is given screen coordinates.
+    RECT rc = place->rcNormalPosition;
+    if ((GetWindowLong(data.m_hwnd, GWL_EXSTYLE) & WS_EX_TOOLWINDOW) == 0) {
+        RECT work;
+        if (SystemParametersInfo(SPI_GETWORKAREA, 0, &work, 0)) OffsetRect(&rc, work.left, work.top);
+    }
+    AcquireSRWLockExclusive(&s_PublishLock);
+    HookStore(s_pPlacements, data.m_dwHookKey, data.m_dwHookCheck, monitors, session, rc);
+    ReleaseSRWLockExclusive(&s_PublishLock);
+}
+
+//
+// MonitorKeeper.exe /hook, the 32 bit hook for a 64 bit MonitorKeeper.exe.
+// The 64 bit applications' hook calls come through this thread's messages,
+// see PumpMessagesUntil, which we pump until the MonitorKeeper that owns the
+// table exits.
+//
+int RunCreationHookHelper()
+{
+    HANDLE hMapping = OpenFileMapping(FILE_MAP_READ, false, HOOK_TABLENAME);
+    if (hMapping == NULL) return 1;
+    const HookPlacementTable * table = (const HookPlacementTable *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0,
+        sizeof(HookPlacementTable));
+    DWORD pid = table != NULL && table->m_dwMagic == HOOK_MAGIC ? table->m_dwProducerId : 0;
+    if (table != NULL) UnmapViewOfFile(table);
+    CloseHandle(hMapping);
+
+    HANDLE hProducer = pid != 0 ? OpenProcess(SYNCHRONIZE, false, pid) : NULL;
+    if (hProducer == NULL) return 1;
+    HHOOK hook = InstallCreationHook();
+    if (hook != NULL) {
+        PumpMessagesUntil(hProducer);
+        UnhookWindowsHookEx(hook);
+        FreeLibrary(s_hHookDll);
+        s_hHookDll = NULL;
+    }
+    CloseHandle(hProducer);
+    return hook != NULL ? 0 : 1;
+}
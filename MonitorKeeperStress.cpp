@@ -0,0 +1,274 @@
+// MonitorKeeperStress.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// The engine's callers all at once, run with "MonitorKeeper.exe /stress
+// [seed]". On a private InstanceData with made up HWNDs, threads capture
+// windows the way CaptureWindow does, plan restores through MKPlan, pick
+// the windows a restore would place and age the table the way a save pass
+// does, swap settings while others read them, and count moves towards a
+// storm, each choosing what to do from its own seed. A change to the
+// locking should be tried here first.
+//
+// Operations per second for each kind of caller go to
+// MonitorKeeper.stress.txt beside the executable with the seed. Afterwards
+// the table is checked; the exit code is the number of problems found.
+//
+
+#include "MonitorKeeperEngine.h"
+#include "MonitorKeeperApi.h"
+
+#define STRESS_HANDLES      4096
+#define STRESS_OPERATIONS   200000      // per thread, for one window at a time
+#define STRESS_PASSES       2000        // per thread, for all the windows at once or new settings
+#define STRESS_CAPTURERS    4
+#define STRESS_PLANNERS     2
+#define STRESS_MONITORS     4
+#define STRESS_BUFFERSIZE   2048
+
+#define STRESS_CAPTURE      0
+#define STRESS_PLAN         1
+#define STRESS_RESTORE      2
+#define STRESS_SETTINGS     3
+#define STRESS_EVENTS       4
+#define STRESS_KINDS        5
+
+static const char * s_szStressKinds[STRESS_KINDS] = {
+    "capture", "plan", "restore", "settings", "events"
+};
+
+struct StressThread {
+    InstanceData *		m_pInst;
+    int					m_nKind;            // STRESS_ value
+    DWORD				m_dwRandom;
+    int					m_nOperations;
+    LONGLONG			m_llTicks;          // time it took, in QueryPerformanceCounter ticks
+};
+
+static DWORD StressRandom(StressThread & thread, DWORD range)
+{
+    // xorshift32, as in MonitorKeeperFuzz.cpp.
+    DWORD x = thread.m_dwRandom;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    thread.m_dwRandom = x;
+    return x % range;
+}
+
+static HWND StressHwnd(int n)
+{
+    return (HWND)(UINT_PTR)(0x10000 + n * 2);
+}
+
+//
+// CaptureWindow without asking the window: the table held shared and the
+// window's shard exclusively.
+//
+static void StressCapture(StressThread & thread)
+{
+    InstanceData * inst = thread.m_pInst;
+    HWND hwnd = StressHwnd((int)StressRandom(thread, STRESS_HANDLES));
+    int monitors = 2 + (int)StressRandom(thread, 3);
+    inst->LockTableShared();
+    WindowTable & shard = inst->ShardFor(hwnd);
+    shard.Lock();
+    SavedWindowData * pData = shard.FindWindowSlot(hwnd);
+    pData->m_nUnusedCount = 0;
+    WINDOWPLACEMENT * place = pData->PlacementForSave(monitors, SESSION_CONSOLE);
+    place->length = sizeof(WINDOWPLACEMENT);
+    place->showCmd = SW_SHOWNORMAL;
+    place->rcNormalPosition.left = (LONG)StressRandom(thread, STRESS_MONITORS * 1920 - 400);
+    place->rcNormalPosition.top = (LONG)StressRandom(thread, 700);
+    place->rcNormalPosition.right = place->rcNormalPosition.left + 400;
+    place->rcNormalPosition.bottom = place->rcNormalPosition.top + 300;
+    inst->IndexSavedWindow(pData, monitors, SESSION_CONSOLE);
+    shard.Unlock();
+    inst->UnlockTableShared();
+}
+
+static void StressPlan(StressThread & thread, MKPlacement * placements)
+{
+    MKPlan((MKEngine *)thread.m_pInst, 2 + (int)StressRandom(thread, 3), SESSION_CONSOLE, placements, STRESS_HANDLES);
+}
+
+//
+// the table held exclusively, as RestoreWindowPositions and a save pass
+// do: pick what a restore would place, and now and then age every window.
+//
+static void StressRestore(StressThread & thread, RestoreItem * items)
+{
+    InstanceData * inst = thread.m_pInst;
+    int monitors = 2 + (int)StressRandom(thread, 3);
+    inst->LockTable();
+    int count = 0;
+    int s, i;
+    for (s = 0; s < WINDOW_SHARDS; s++)
+    {
+        WindowTable & shard = inst->_Shards[s];
+        for (i = 0; i < shard.m_nLength && count < STRESS_HANDLES; i++)
+        {
+            SavedWindowData & data = shard.m_data[i];
+            if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+            WINDOWPLACEMENT * place = data.Placement(monitors, SESSION_CONSOLE);
+            if (place == NULL) continue;
+            items[count].m_hwnd = data.m_hwnd;
+            items[count].m_dwProcessId = data.m_dwProcessId;
+            items[count].m_place = *place;
+            count++;
+        }
+    }
+    if (StressRandom(thread, 8) == 0) inst->TagWindowsUnused();
+    inst->UnlockTable();
+}
+
+//
+// new settings while the other threads read them, as the settings watcher
+// does when MonitorKeeper.ini changes.
+//
+static void StressSettings(StressThread & thread)
+{
+    Settings * settings = new Settings();
+    settings->m_nSaveDelay = 100 + (int)StressRandom(thread, 200);
+    settings->m_nStormEvents = 20 + (int)StressRandom(thread, 40);
+    thread.m_pInst->SwapSettings(settings);
+}
+
+static void StressEvents(StressThread & thread)
+{
+    thread.m_pInst->SaveDelayForEvent();
+    if (StressRandom(thread, 64) == 0) thread.m_pInst->StormSaved();
+}
+
+static DWORD WINAPI StressThreadProc(LPVOID param)
+{
+    StressThread & thread = *(StressThread *)param;
+    MKPlacement * placements = thread.m_nKind == STRESS_PLAN ? new MKPlacement[STRESS_HANDLES] : NULL;
+    RestoreItem * items = thread.m_nKind == STRESS_RESTORE ? new RestoreItem[STRESS_HANDLES] : NULL;
+    // each swapped out Settings is kept until the end.
+    int operations = thread.m_nKind == STRESS_CAPTURE || thread.m_nKind == STRESS_EVENTS ?
+        STRESS_OPERATIONS : STRESS_PASSES;
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    int i;
+    for (i = 0; i < operations; i++)
+    {
+        switch (thread.m_nKind)
+        {
+        case STRESS_CAPTURE: StressCapture(thread); break;
+        case STRESS_PLAN: StressPlan(thread, placements); break;
+        case STRESS_RESTORE: StressRestore(thread, items); break;
+        case STRESS_SETTINGS: StressSettings(thread); break;
+        case STRESS_EVENTS: StressEvents(thread); break;
+        }
+    }
+    QueryPerformanceCounter(&end);
+    thread.m_nOperations = operations;
+    thread.m_llTicks = end.QuadPart - start.QuadPart;
+    if (placements != NULL) delete[] placements;
+    if (items != NULL) delete[] items;
+    return 0;
+}
+
+static BOOL StressFileName(LPTSTR szFile, LPCTSTR szSuffix)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    int len = lstrlen(szSettings);
+    if (len < 4 || len - 3 + lstrlen(szSuffix) >= MAX_PATH) return false;
+    lstrcpyn(szFile, szSettings, len - 3 + 1);      // keeps the '.'
+    lstrcat(szFile, szSuffix);
+    return true;
+}
+
+//
+// szArgs is the rest of the command line, a decimal seed or nothing for
+// one from the clock. Each thread's choices follow from the seed, though
+// how they interleave doesn't.
+//
+int RunStress(LPCTSTR szArgs)
+{
+    TCHAR szResults[MAX_PATH];
+    if (!StressFileName(szResults, _T("stress.txt"))) return -1;
+
+    DWORD seed = 0;
+    while (*szArgs == ' ') szArgs++;
+    for (; *szArgs >= '0' && *szArgs <= '9'; szArgs++) seed = seed * 10 + (*szArgs - '0');
+    if (*szArgs != '\0') return -1;
+    if (seed == 0) seed = GetTickCount() | 1;
+
+    InstanceData * inst = new InstanceData();
+    inst->_NumKnownMonitors = STRESS_MONITORS;
+    int i;
+    for (i = 0; i < STRESS_MONITORS; i++)
+    {
+        KnownMonitor & monitor = inst->_KnownMonitors[i];
+        wsprintf(monitor.m_szDevice, _T("\\\\.\\DISPLAY%d"), i + 1);
+        monitor.m_rcMonitor.left = i * 1920;
+        monitor.m_rcMonitor.top = 0;
+        monitor.m_rcMonitor.right = (i + 1) * 1920;
+        monitor.m_rcMonitor.bottom = 1080;
+        monitor.m_bPresent = true;
+    }
+
+    StressThread threads[STRESS_CAPTURERS + STRESS_PLANNERS + 3];
+    HANDLE handles[STRESS_CAPTURERS + STRESS_PLANNERS + 3];
+    int numThreads = 0;
+    for (i = 0; i < STRESS_CAPTURERS + STRESS_PLANNERS + 3; i++)
+    {
+        StressThread & thread = threads[i];
+        thread.m_pInst = inst;
+        thread.m_nKind = i < STRESS_CAPTURERS ? STRESS_CAPTURE :
+            i < STRESS_CAPTURERS + STRESS_PLANNERS ? STRESS_PLAN :
+            STRESS_RESTORE + (i - STRESS_CAPTURERS - STRESS_PLANNERS);
+        thread.m_dwRandom = seed + (DWORD)i * 0x9e3779b9;
+        if (thread.m_dwRandom == 0) thread.m_dwRandom = 1;
+        thread.m_nOperations = 0;
+        thread.m_llTicks = 0;
+    }
+    for (i = 0; i < STRESS_CAPTURERS + STRESS_PLANNERS + 3; i++)
+    {
+        handles[numThreads] = CreateThread(NULL, 0, StressThreadProc, &threads[i], 0, NULL);
+        if (handles[numThreads] != NULL) numThreads++;
+    }
+    WaitForMultipleObjects(numThreads, handles, true, INFINITE);
+    for (i = 0; i < numThreads; i++) CloseHandle(handles[i]);
+
+    //
+    // operations a second for each kind, added over its threads.
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    char * out = new char[STRESS_BUFFERSIZE];
+    int len = wsprintfA(out, "seed %u, %d threads\r\n", seed, numThreads);
+    int kind;
+    for (kind = 0; kind < STRESS_KINDS; kind++)
+    {
+        LONGLONG perSecond = 0;
+        int count = 0;
+        for (i = 0; i < STRESS_CAPTURERS + STRESS_PLANNERS + 3; i++)
+        {
+            if (threads[i].m_nKind != kind || threads[i].m_llTicks <= 0) continue;
+            perSecond += threads[i].m_nOperations * freq.QuadPart / threads[i].m_llTicks;
+            count++;
+        }
+        len += wsprintfA(out + len, "%s: %d threads, %d operations a second\r\n", s_szStressKinds[kind], count, (int)perSecond);
+    }
+
+    int problems = numThreads == STRESS_CAPTURERS + STRESS_PLANNERS + 3 ? 0 : 1;
+#ifdef _DEBUG
+    problems += inst->VerifyWindowTable();
+#endif
+    len += wsprintfA(out + len, "%d problems\r\n", problems);
+    HANDLE h = CreateFile(szResults, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (h != INVALID_HANDLE_VALUE) {
+        DWORD written;
+        WriteFile(h, out, len, &written, NULL);
+        CloseHandle(h);
+    }
+    delete[] out;
+
+    // frees the swapped out settings too, see SwapSettings.
+    delete inst;
+    return problems;
+}
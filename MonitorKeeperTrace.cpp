@@ -0,0 +1,345 @@
+// MonitorKeeperTrace.cpp
+//
+// Author: Garr Godfrey
+// License: MIT License
+// License Summary: Free but author takes no responsibility.
+//
+// With [Trace] Capture=1 MonitorKeeper records what the engine was asked to
+// do in MonitorKeeper.trace beside the executable: every window move, each
+// save pass and the windows it saved, and each restore. The benchmark
+// replays traces against a private InstanceData, so changes to the engine
+// can be measured on real desktops instead of made up ones.
+//
+// Traces are meant to be shared, so no names are written. Window classes
+// and executable names are hashed with HMAC-SHA256, keyed with random bytes
+// made for each capture and never written: the same class has the same hash
+// all through a trace, but without the key a hash can't be checked against a
+// guessed name, even knowing what some of them are. Window titles are never
+// read. HWNDs and window rectangles are kept as they are, since they say
+// nothing about what the user was doing and the table's hash and the
+// restore both depend on them.
+//
+// A corpus is any number of traces renamed to MonitorKeeper.<name>.trace
+// and left beside the executable; "MonitorKeeper.exe /benchmark" replays
+// each of them, see BenchTraces.
+//
+
+#include "MonitorKeeperEngine.h"
+#include <bcrypt.h>
+
+#pragma comment(lib, "bcrypt.lib")
+
+#define TRACE_PROCESSES 1024        // executable name hashes remembered by process id, a power of two
+
+struct TraceProcess {
+    DWORD				m_dwProcessId;
+    DWORD				m_dwHash;
+};
+
+static SRWLOCK s_TraceLock = SRWLOCK_INIT;
+static HANDLE s_hTrace = INVALID_HANDLE_VALUE;
+static TraceRecord s_Buffered[TRACE_BUFFERED];
+static int s_nBuffered = 0;
+static DWORD s_dwWritten = 0;               // records in the file
+static DWORD s_dwStart = 0;                 // tick count the capture started
+static BCRYPT_ALG_HANDLE s_hHmac = NULL;    // HMAC-SHA256, open while capturing
+static BYTE s_Key[32];                      // the capture's key, see TraceHash
+static TraceProcess s_Processes[TRACE_PROCESSES];
+
+static BOOL TraceFileName(LPTSTR szFile, LPCTSTR szSuffix)
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    int len = lstrlen(szSettings);
+    if (len < 4 || len - 3 + lstrlen(szSuffix) >= MAX_PATH) return false;
+    lstrcpyn(szFile, szSettings, len - 3 + 1);      // keeps the '.'
+    lstrcat(szFile, szSuffix);
+    return true;
+}
+
+//
+// the first 32 bits of the name's HMAC with the capture's key. Never 0.
+// With s_TraceLock held.
+//
+static DWORD TraceHash(LPCTSTR sz)
+{
+    BCRYPT_HASH_HANDLE hHash;
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(s_hHmac, &hHash, NULL, 0, s_Key, sizeof(s_Key), 0))) return 1;
+    BYTE digest[32];
+    BOOL ok = BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)sz, lstrlen(sz) * sizeof(TCHAR), 0)) &&
+        BCRYPT_SUCCESS(BCryptFinishHash(hHash, digest, sizeof(digest), 0));
+    BCryptDestroyHash(hHash);
+    if (!ok) return 1;
+    DWORD h;
+    CopyMemory(&h, digest, sizeof(h));
+    return h != 0 ? h : 1;
+}
+
+//
+// looking up an executable name opens the process, so it is done once per
+// process. A process id that is reused while its entry is still here keeps
+// the old hash, which only makes the trace a little less exact.
+//
+static DWORD ProcessHash(HWND hwnd, DWORD pid)
+{
+    TraceProcess & entry = s_Processes[(pid / 4) & (TRACE_PROCESSES - 1)];
+    if (entry.m_dwProcessId != pid || entry.m_dwHash == 0) {
+        TCHAR szApp[MAX_PATH];
+        WindowAppName(hwnd, szApp, MAX_PATH);
+        entry.m_dwProcessId = pid;
+        entry.m_dwHash = TraceHash(szApp);
+    }
+    return entry.m_dwHash;
+}
+
+static void WriteBuffered()
+{
+    if (s_nBuffered == 0) return;
+    DWORD written;
+    if (!WriteFile(s_hTrace, s_Buffered, s_nBuffered * sizeof(TraceRecord), &written, NULL)) {
+        written = 0;
+    }
+    s_dwWritten += s_nBuffered;
+    s_nBuffered = 0;
+    if (written == 0 || s_dwWritten >= TRACE_MAXRECORDS) {
+        CloseHandle(s_hTrace);
+        s_hTrace = INVALID_HANDLE_VALUE;
+        InstanceData::g_Instance.LogMessage(written == 0 ? _T("Trace stopped, the file can't be written\n") : _T("Trace full, capture stopped\n"));
+    }
+}
+
+//
+// with s_TraceLock held.
+//
+static void AppendLocked(TraceRecord & record)
+{
+    if (s_hTrace == INVALID_HANDLE_VALUE) return;
+    record.m_dwTime = GetTickCount() - s_dwStart;
+    s_Buffered[s_nBuffered++] = record;
+    if (s_nBuffered == TRACE_BUFFERED) WriteBuffered();
+}
+
+static void TraceAppend(TraceRecord & record)
+{
+    AcquireSRWLockExclusive(&s_TraceLock);
+    AppendLocked(record);
+    ReleaseSRWLockExclusive(&s_TraceLock);
+}
+
+//
+// start MonitorKeeper.trace again if [Trace] Capture=1. Read at startup.
+//
+void OpenTrace()
+{
+    LPCTSTR szSettings = InstanceData::g_Instance._SettingsFile;
+    if (!GetPrivateProfileInt(_T("Trace"), _T("Capture"), 0, szSettings)) return;
+    TCHAR szFile[MAX_PATH];
+    if (!TraceFileName(szFile, _T("trace"))) return;
+    BCRYPT_ALG_HANDLE hHmac;
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hHmac, BCRYPT_SHA256_ALGORITHM, NULL, BCRYPT_ALG_HANDLE_HMAC_FLAG))) return;
+    if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, s_Key, sizeof(s_Key), BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+        BCryptCloseAlgorithmProvider(hHmac, 0);
+        return;
+    }
+
+    HANDLE h = CreateFile(szFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        BCryptCloseAlgorithmProvider(hHmac, 0);
+        return;
+    }
+    TraceHeader header;
+    ZeroMemory(&header, sizeof(header));
+    header.m_dwMagic = TRACE_MAGIC;
+    header.m_dwVersion = TRACE_VERSION;
+    header.m_dwRecordSize = sizeof(TraceRecord);
+    DWORD written;
+    if (!WriteFile(h, &header, sizeof(header), &written, NULL)) {
+        CloseHandle(h);
+        BCryptCloseAlgorithmProvider(hHmac, 0);
+        return;
+    }
+    AcquireSRWLockExclusive(&s_TraceLock);
+    s_hHmac = hHmac;
+    ZeroMemory(s_Processes, sizeof(s_Processes));
+    s_nBuffered = 0;
+    s_dwWritten = 0;
+    s_dwStart = GetTickCount();
+    s_hTrace = h;
+    ReleaseSRWLockExclusive(&s_TraceLock);
+    InstanceData::g_Instance.LogMessage(_T("Trace capture started\n"));
+}
+
+//
+// called once a minute, so a trace copied while MonitorKeeper runs is at
+// most a minute behind.
+//
+void FlushTrace()
+{
+    if (s_hTrace == INVALID_HANDLE_VALUE) return;
+    AcquireSRWLockExclusive(&s_TraceLock);
+    if (s_hTrace != INVALID_HANDLE_VALUE) WriteBuffered();
+    ReleaseSRWLockExclusive(&s_TraceLock);
+}
+
+void CloseTrace()
+{
+    AcquireSRWLockExclusive(&s_TraceLock);
+    if (s_hTrace != INVALID_HANDLE_VALUE) WriteBuffered();
+    if (s_hTrace != INVALID_HANDLE_VALUE) CloseHandle(s_hTrace);
+    s_hTrace = INVALID_HANDLE_VALUE;
+    if (s_hHmac != NULL) BCryptCloseAlgorithmProvider(s_hHmac, 0);
+    s_hHmac = NULL;
+    SecureZeroMemory(s_Key, sizeof(s_Key));
+    ReleaseSRWLockExclusive(&s_TraceLock);
+}
+
+//
+// the capture hooks, which cost a compare while nothing is being captured.
+//
+void TraceWindowMoved(HWND hwnd)
+{
+    if (s_hTrace == INVALID_HANDLE_VALUE) return;
+    TraceRecord record;
+    ZeroMemory(&record, sizeof(record));
+    record.m_wEvent = TRACE_MOVE;
+    record.m_dwWindow = (DWORD)(UINT_PTR)hwnd;
+    TraceAppend(record);
+}
+
+void TracePass(int monitors, int session)
+{
+    if (s_hTrace == INVALID_HANDLE_VALUE) return;
+    TraceRecord record;
+    ZeroMemory(&record, sizeof(record));
+    record.m_wEvent = TRACE_PASS;
+    record.m_wMonitors = (WORD)monitors;
+    record.m_wSession = (WORD)session;
+    TraceAppend(record);
+}
+
+void TraceWindowSaved(SavedWindowData & data, int monitors, int session)
+{
+    if (s_hTrace == INVALID_HANDLE_VALUE) return;
+    const WINDOWPLACEMENT * place = data.Placement(monitors, session);
+    if (place == NULL) return;
+    TraceRecord record;
+    ZeroMemory(&record, sizeof(record));
+    record.m_wEvent = TRACE_SAVE;
+    record.m_wMonitors = (WORD)monitors;
+    record.m_wSession = (WORD)session;
+    record.m_wShowCmd = (WORD)place->showCmd;
+    record.m_rcNormal = place->rcNormalPosition;
+    record.m_dwWindow = (DWORD)(UINT_PTR)data.m_hwnd;
+    AcquireSRWLockExclusive(&s_TraceLock);
+    if (s_hTrace != INVALID_HANDLE_VALUE) {
+        record.m_dwClass = TraceHash(data.m_wndClass);
+        record.m_dwProcess = ProcessHash(data.m_hwnd, data.m_dwProcessId);
+        AppendLocked(record);
+    }
+    ReleaseSRWLockExclusive(&s_TraceLock);
+}
+
+void TraceRestore(int monitors, int session)
+{
+    if (s_hTrace == INVALID_HANDLE_VALUE) return;
+    TraceRecord record;
+    ZeroMemory(&record, sizeof(record));
+    record.m_wEvent = TRACE_RESTORE;
+    record.m_wMonitors = (WORD)monitors;
+    record.m_wSession = (WORD)session;
+    TraceAppend(record);
+}
+
+//
+// the records of a trace file, or NULL if it isn't one. Delete[] them.
+//
+TraceRecord * ReadTrace(LPCTSTR szFile, int & count)
+{
+    count = 0;
+    HANDLE h = CreateFile(szFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return NULL;
+    TraceHeader header;
+    DWORD read;
+    DWORD size = GetFileSize(h, NULL);
+    TraceRecord * records = NULL;
+    if (size != INVALID_FILE_SIZE && ReadFile(h, &header, sizeof(header), &read, NULL) && read == sizeof(header) &&
+        header.m_dwMagic == TRACE_MAGIC && header.m_dwVersion == TRACE_VERSION &&
+        header.m_dwRecordSize == sizeof(TraceRecord))
+    {
+        DWORD n = min((size - sizeof(header)) / sizeof(TraceRecord), (DWORD)TRACE_MAXRECORDS);
+        records = new TraceRecord[n + 1];
+        if (ReadFile(h, records, n * sizeof(TraceRecord), &read, NULL)) {
+            count = (int)(read / sizeof(TraceRecord));
+        }
+    }
+    CloseHandle(h);
+    return records;
+}
+
+//
+// do what the engine did for each record, to inst's table rather than the
+// desktop: find the window for a move, save it the way SetData does, with
+// the attributes from the trace, and plan each restore the way MKPlan does.
+// Saves are filed under this desktop's monitors. Returns the windows planned.
+//
+int ReplayTrace(InstanceData * inst, const TraceRecord * records, int count)
+{
+    int planned = 0;
+    int i;
+    inst->LockTable();
+    UpdateKnownMonitors(*inst);
+    inst->UnlockTable();
+    for (i = 0; i < count; i++)
+    {
+        const TraceRecord & r = records[i];
+        HWND hwnd = (HWND)(UINT_PTR)r.m_dwWindow;
+        inst->LockTable();
+        switch (r.m_wEvent)
+        {
+        case TRACE_MOVE:
+            inst->FindSavedWindow(hwnd);
+            break;
+
+        case TRACE_PASS:
+            inst->TagWindowsUnused();
+            break;
+
+        case TRACE_SAVE:
+        {
+            if (hwnd == NULL || r.m_wMonitors < MIN_MONITORTORESTORE || r.m_wMonitors > MAX_MONITORS) break;
+            SavedWindowData * data = inst->FindWindowSlot(hwnd);
+            data->m_hwnd = hwnd;
+            data->m_nUnusedCount = 0;
+            if (data->m_hwndAttributes != hwnd || data->m_dwProcessId != r.m_dwProcess) {
+                data->m_hwndAttributes = hwnd;
+                data->m_dwProcessId = r.m_dwProcess;
+                wsprintf(data->m_wndClass, _T("%08X"), r.m_dwClass);
+            }
+            WINDOWPLACEMENT * place = data->PlacementForSave(r.m_wMonitors, r.m_wSession);
+            ZeroMemory(place, sizeof(WINDOWPLACEMENT));
+            place->length = sizeof(WINDOWPLACEMENT);
+            place->showCmd = r.m_wShowCmd;
+            place->rcNormalPosition = r.m_rcNormal;
+            inst->IndexSavedWindow(data, r.m_wMonitors, r.m_wSession);
+        }
+        break;
+
+        case TRACE_RESTORE:
+        {
+            int s, w;
+            for (s = 0; s < WINDOW_SHARDS; s++)
+            {
+                WindowTable & shard = inst->_Shards[s];
+                for (w = 0; w < shard.m_nLength; w++)
+                {
+                    SavedWindowData & data = shard.m_data[w];
+                    if (data.m_hwnd == NULL || data.m_nUnusedCount > 2) continue;
+                    if (data.Placement(r.m_wMonitors, r.m_wSession) != NULL) planned++;
+                }
+            }
+        }
+        break;
+        }
+        inst->UnlockTable();
+    }
+    return planned;
+}